@@ -1,4 +1,5 @@
 #include "httplib.h"
+#include "kvshm.h"
 #include <iostream>
 #include <vector>
 #include <thread>
@@ -6,6 +7,8 @@
 #include <chrono>
 #include <random>
 #include <mutex>
+#include <algorithm>
+#include <cstdlib>
 
 using namespace std;
 using namespace std::chrono;
@@ -46,72 +49,106 @@ struct Config
     WorkloadType workload = GET_POPULAR;
     int keyspace = 1000;
     int popular = 10;
+    // Unix-domain socket of a co-located kvserver (--unix)
+    string unix_socket;
+    // tcp, unix, or both (runs the workload once per transport)
+    string transport = "tcp";
+    // kvserver's shared-memory hot-key table; GETs try it before HTTP
+    string shm_name;
 };
 
-// ------------------- Load Generator ---------------------
+// Connects over TCP, or over the Unix socket when useUnix is set
+httplib::Client make_client(const Config &cfg, bool useUnix)
+{
+    httplib::Client cli(useUnix ? cfg.unix_socket : cfg.server_url, cfg.port);
+    if (useUnix)
+        cli.set_address_family(AF_UNIX);
+    cli.set_connection_timeout(5, 0);
+    cli.set_read_timeout(5, 0);
+    return cli;
+}
 
-int main(int argc, char *argv[])
+struct RunResult
 {
-    Config cfg;
+    uint64_t total_requests = 0;
+    uint64_t success = 0;
+    uint64_t failures = 0;
+    uint64_t total_latency_ns = 0;
+    uint64_t shm_hits = 0;
+    // GETs answered from kvserver's cache vs. its storage ("CACHE HIT: " /
+    // "DB HIT: " bodies); shared-memory hits count as cache hits
+    uint64_t cache_hits = 0;
+    uint64_t db_hits = 0;
+    vector<uint64_t> latencies_ns; // successful requests only
+    // Server-Timing breakdown of successful HTTP requests, one vector per
+    // component in TIMING_NAMES order
+    vector<vector<uint64_t>> timings_ns;
+};
 
-    // ---- Simple argument parsing ----
-    for (int i = 1; i < argc; i++)
-    {
-        // --- Warmup for GET_POPULAR: create popular_0..popular_{popular-1} ---
+// Components of kvserver's Server-Timing header, plus "network": the
+// client-measured latency not covered by the server's total
+static const char *TIMING_NAMES[] = {"queue", "cache", "db", "total", "network"};
+static constexpr size_t TIMING_COUNT = 5;
+static constexpr size_t TIMING_TOTAL = 3;
+static constexpr size_t TIMING_NETWORK = 4;
 
-        string a = argv[i];
-        if (a == "--url")
-            cfg.server_url = argv[++i];
-        else if (a == "--port")
-            cfg.port = stoi(argv[++i]);
-        else if (a == "--clients")
-            cfg.clients = stoi(argv[++i]);
-        else if (a == "--dur")
-            cfg.duration_sec = stoi(argv[++i]);
-        else if (a == "--keyspace")
-            cfg.keyspace = stoi(argv[++i]);
-        else if (a == "--popular")
-            cfg.popular = stoi(argv[++i]);
-        else if (a == "--workload")
-        {
-            string w = argv[++i];
-            if (w == "put-all")
-                cfg.workload = PUT_ALL;
-            else if (w == "get-all")
-                cfg.workload = GET_ALL;
-            else if (w == "get-popular")
-                cfg.workload = GET_POPULAR;
-            else if (w == "delete-all")
-                cfg.workload = DELETE_ALL;
-            else
-                cfg.workload = MIXED;
-        }
-    }
-
-    if (cfg.workload == GET_POPULAR)
+// Parses "name;dur=ms, ..." into ns per component; false if the header
+// is missing or has no total
+bool parse_server_timing(const string &header, uint64_t (&out)[TIMING_COUNT])
+{
+    fill(begin(out), end(out), 0);
+    bool has_total = false;
+    size_t pos = 0;
+    while (pos < header.size())
     {
-        cout << "Warmup: inserting popular keys into server..." << endl;
-        httplib::Client warm_cli(cfg.server_url, cfg.port);
-        warm_cli.set_connection_timeout(5, 0);
-        warm_cli.set_read_timeout(5, 0);
-
-        for (int i = 0; i < cfg.popular; i++)
-        {
-            string key = "popular_" + to_string(i);
-            string value = "popular_value_" + to_string(i);
-            auto res = warm_cli.Put(("/kv/" + key).c_str(), value, "text/plain");
-            if (!res || res->status < 200 || res->status >= 300)
+        size_t end = header.find(',', pos);
+        if (end == string::npos)
+            end = header.size();
+        string metric = header.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t b = metric.find_first_not_of(' ');
+        size_t semi = metric.find(';');
+        size_t dur = metric.find("dur=");
+        if (b == string::npos || semi == string::npos || dur == string::npos)
+            continue;
+        string name = metric.substr(b, semi - b);
+        double ms = strtod(metric.c_str() + dur + 4, nullptr);
+        for (size_t i = 0; i < TIMING_NETWORK; i++)
+            if (name == TIMING_NAMES[i])
             {
-                cerr << "Warmup PUT failed for key " << key << endl;
+                out[i] = uint64_t(ms * 1e6);
+                has_total |= i == TIMING_TOTAL;
             }
-        }
-        cout << "Warmup done.\n";
     }
+    return has_total;
+}
+
+double percentile_ms(const vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+    size_t idx = min(sorted.size() - 1, size_t(p * (sorted.size() - 1) + 0.5));
+    return sorted[idx] / 1e6;
+}
+
+// ------------------- Load Generator ---------------------
 
+RunResult run_workload(const Config &cfg, bool useUnix)
+{
     atomic<uint64_t> total_requests{0};
     atomic<uint64_t> success{0};
     atomic<uint64_t> failures{0};
     atomic<uint64_t> total_latency_ns{0};
+    atomic<uint64_t> shm_hits{0};
+    atomic<uint64_t> cache_hits{0};
+    atomic<uint64_t> db_hits{0};
+    vector<vector<uint64_t>> per_thread_latencies(cfg.clients);
+    vector<vector<vector<uint64_t>>> per_thread_timings(cfg.clients, vector<vector<uint64_t>>(TIMING_COUNT));
+
+    kvshm::Table shm;
+    if (!cfg.shm_name.empty() && !shm.open(cfg.shm_name))
+        cerr << "Shared memory " << cfg.shm_name << " not available, using HTTP only" << endl;
 
     vector<thread> threads;
     threads.reserve(cfg.clients);
@@ -120,26 +157,38 @@ int main(int argc, char *argv[])
 
     cout << "Starting load generator with "
          << cfg.clients << " clients for "
-         << cfg.duration_sec << " seconds..." << endl;
+         << cfg.duration_sec << " seconds over "
+         << (useUnix ? "unix:" + cfg.unix_socket : "tcp") << "..." << endl;
 
     for (int c = 0; c < cfg.clients; c++)
     {
         threads.emplace_back([&, c]()
                              {
-            httplib::Client cli(cfg.server_url, cfg.port);
-            cli.set_connection_timeout(5, 0);
-            cli.set_read_timeout(5, 0);
+            httplib::Client cli = make_client(cfg, useUnix);
+            auto &latencies = per_thread_latencies[c];
+            auto &timings = per_thread_timings[c];
+            uint64_t timing[TIMING_COUNT];
 
             std::mt19937_64 rng(std::random_device{}());
             std::uniform_int_distribution<int> dist(0, cfg.keyspace - 1);
             std::uniform_int_distribution<int> pop_dist(0, cfg.popular - 1);
             std::uniform_real_distribution<double> chance(0.0, 1.0);
 
+            // Hot keys are read straight from kvserver's shared memory;
+            // returns true on a hit, otherwise issues the HTTP GET
+            auto shm_or_http_get = [&](const string &key, string &value, httplib::Result &res) {
+                if (shm.is_open() && shm.get(key, value))
+                    return true;
+                res = cli.Get(("/kv/" + key).c_str());
+                return false;
+            };
+
             while (steady_clock::now() < end_time) {
                 auto t0 = steady_clock::now();
 
                 string key, value;
                 httplib::Result res;
+                bool shm_hit = false;
                 double p = chance(rng);
 
                 // ------------- Workload Logic -------------
@@ -158,11 +207,11 @@ int main(int argc, char *argv[])
     res = cli.Put(("/kv/" + key).c_str(), value, "text/plain");
                 } else if (cfg.workload == GET_ALL) {
                     key = "k" + to_string(dist(rng));
-                    res = cli.Get(("/kv/" + key).c_str());
+                    shm_hit = shm_or_http_get(key, value, res);
 
                 } else if (cfg.workload == GET_POPULAR) {
                     key = "popular_" + to_string(pop_dist(rng));
-                    res = cli.Get(("/kv/" + key).c_str());
+                    shm_hit = shm_or_http_get(key, value, res);
 
                 }else if (cfg.workload == DELETE_ALL) {
     key = "k" + to_string(dist(rng));
@@ -172,7 +221,7 @@ int main(int argc, char *argv[])
                 else {  // MIXED
                     if (p < 0.5) {   // GET
                         key = "k" + to_string(dist(rng));
-                        res = cli.Get(("/kv/" + key).c_str());
+                        shm_hit = shm_or_http_get(key, value, res);
                     }
                     else if (p < 0.8) { // PUT
                         key = "k" + to_string(dist(rng));
@@ -189,9 +238,23 @@ int main(int argc, char *argv[])
                 total_latency_ns += elapsed;
                 total_requests++;
 
-                if (res && res->status >= 200 && res->status < 300)
+                if (shm_hit || (res && res->status >= 200 && res->status < 300)) {
                     success++;
-                else
+                    if (shm_hit) {
+                        shm_hits++;
+                        cache_hits++;
+                    } else if (res->body.compare(0, 11, "CACHE HIT: ") == 0)
+                        cache_hits++;
+                    else if (res->body.compare(0, 8, "DB HIT: ") == 0)
+                        db_hits++;
+                    latencies.push_back(elapsed);
+
+                    if (!shm_hit && parse_server_timing(res->get_header_value("Server-Timing"), timing)) {
+                        timing[TIMING_NETWORK] = uint64_t(elapsed) > timing[TIMING_TOTAL] ? elapsed - timing[TIMING_TOTAL] : 0;
+                        for (size_t i = 0; i < TIMING_COUNT; i++)
+                            timings[i].push_back(timing[i]);
+                    }
+                } else
                     failures++;
             } });
     }
@@ -199,23 +262,143 @@ int main(int argc, char *argv[])
     for (auto &t : threads)
         t.join();
 
+    RunResult r;
+    r.total_requests = total_requests.load();
+    r.success = success.load();
+    r.failures = failures.load();
+    r.total_latency_ns = total_latency_ns.load();
+    r.shm_hits = shm_hits.load();
+    r.cache_hits = cache_hits.load();
+    r.db_hits = db_hits.load();
+    for (auto &l : per_thread_latencies)
+        r.latencies_ns.insert(r.latencies_ns.end(), l.begin(), l.end());
+    sort(r.latencies_ns.begin(), r.latencies_ns.end());
+    r.timings_ns.resize(TIMING_COUNT);
+    for (size_t i = 0; i < TIMING_COUNT; i++)
+    {
+        for (auto &t : per_thread_timings)
+            r.timings_ns[i].insert(r.timings_ns[i].end(), t[i].begin(), t[i].end());
+        sort(r.timings_ns[i].begin(), r.timings_ns[i].end());
+    }
+    return r;
+}
+
+void print_results(const Config &cfg, bool useUnix, const RunResult &r)
+{
     double duration = cfg.duration_sec;
-    uint64_t succ = success.load();
-    uint64_t req = total_requests.load();
-    double throughput = succ / duration;
-    // double avg_latency_ms = (double(total_latency_ns) / succ) / 1e6;
-    double avg_latency_ms = succ > 0
-                                ? (double(total_latency_ns) / succ) / 1e6
+    double throughput = r.success / duration;
+    double avg_latency_ms = r.success > 0
+                                ? (double(r.total_latency_ns) / r.success) / 1e6
                                 : 0.0;
 
-    // -------------------- Results ------------------------
-    cout << "\n===== RESULTS =====" << endl;
-    cout << "Total Requests:      " << req << endl;
-    cout << "Successful Requests: " << succ << endl;
-    cout << "Failed Requests:     " << failures << endl;
+    cout << "\n===== RESULTS (" << (useUnix ? "unix" : "tcp") << ") =====" << endl;
+    cout << "Total Requests:      " << r.total_requests << endl;
+    cout << "Successful Requests: " << r.success << endl;
+    cout << "Failed Requests:     " << r.failures << endl;
     cout << "Throughput (req/s):  " << throughput << endl;
     cout << "Avg Latency (ms):    " << avg_latency_ms << endl;
+    if (!cfg.shm_name.empty())
+        cout << "Shared-Memory Hits:  " << r.shm_hits << endl;
+    cout << "p50 Latency (ms):    " << percentile_ms(r.latencies_ns, 0.50) << endl;
+    cout << "p90 Latency (ms):    " << percentile_ms(r.latencies_ns, 0.90) << endl;
+    cout << "p99 Latency (ms):    " << percentile_ms(r.latencies_ns, 0.99) << endl;
+    cout << "p99.9 Latency (ms):  " << percentile_ms(r.latencies_ns, 0.999) << endl;
+    if (r.cache_hits + r.db_hits > 0)
+        cout << "Hit Rate:            " << 100.0 * r.cache_hits / (r.cache_hits + r.db_hits)
+             << "% (" << r.cache_hits << " cache, " << r.db_hits << " db)" << endl;
+    if (!r.timings_ns.empty() && !r.timings_ns[TIMING_TOTAL].empty())
+    {
+        cout << "Server-Timing (ms)   p50       p90       p99      (" << r.timings_ns[TIMING_TOTAL].size() << " responses)" << endl;
+        for (size_t i = 0; i < TIMING_COUNT; i++)
+        {
+            printf("  %-18s %-9.3f %-9.3f %-9.3f\n", TIMING_NAMES[i], percentile_ms(r.timings_ns[i], 0.50),
+                   percentile_ms(r.timings_ns[i], 0.90), percentile_ms(r.timings_ns[i], 0.99));
+        }
+        fflush(stdout);
+    }
     cout << "====================\n";
+}
+
+int main(int argc, char *argv[])
+{
+    Config cfg;
+
+    // ---- Simple argument parsing ----
+    for (int i = 1; i < argc; i++)
+    {
+        // --- Warmup for GET_POPULAR: create popular_0..popular_{popular-1} ---
+
+        string a = argv[i];
+        if (a == "--url")
+            cfg.server_url = argv[++i];
+        else if (a == "--port")
+            cfg.port = stoi(argv[++i]);
+        else if (a == "--clients")
+            cfg.clients = stoi(argv[++i]);
+        else if (a == "--dur")
+            cfg.duration_sec = stoi(argv[++i]);
+        else if (a == "--keyspace")
+            cfg.keyspace = stoi(argv[++i]);
+        else if (a == "--popular")
+            cfg.popular = stoi(argv[++i]);
+        else if (a == "--unix")
+            cfg.unix_socket = argv[++i];
+        else if (a == "--transport")
+            cfg.transport = argv[++i];
+        else if (a == "--shm")
+            cfg.shm_name = argv[++i];
+        else if (a == "--workload")
+        {
+            string w = argv[++i];
+            if (w == "put-all")
+                cfg.workload = PUT_ALL;
+            else if (w == "get-all")
+                cfg.workload = GET_ALL;
+            else if (w == "get-popular")
+                cfg.workload = GET_POPULAR;
+            else if (w == "delete-all")
+                cfg.workload = DELETE_ALL;
+            else
+                cfg.workload = MIXED;
+        }
+    }
+
+    // false = TCP, true = Unix socket
+    vector<bool> transports;
+    if (cfg.transport != "unix")
+        transports.push_back(false);
+    if (cfg.transport == "unix" || cfg.transport == "both")
+        transports.push_back(true);
+    if (transports.back() && cfg.unix_socket.empty())
+    {
+        cerr << "--transport " << cfg.transport << " needs --unix <path>" << endl;
+        return 1;
+    }
+
+    if (cfg.workload == GET_POPULAR)
+    {
+        cout << "Warmup: inserting popular keys into server..." << endl;
+        httplib::Client warm_cli = make_client(cfg, transports.front());
+
+        for (int i = 0; i < cfg.popular; i++)
+        {
+            string key = "popular_" + to_string(i);
+            string value = "popular_value_" + to_string(i);
+            auto res = warm_cli.Put(("/kv/" + key).c_str(), value, "text/plain");
+            if (!res || res->status < 200 || res->status >= 300)
+            {
+                cerr << "Warmup PUT failed for key " << key << endl;
+            }
+        }
+        cout << "Warmup done.\n";
+    }
+
+    for (bool useUnix : transports)
+    {
+        global_key_counter = 0;
+        RunResult r = run_workload(cfg, useUnix);
+        print_results(cfg, useUnix, r);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,315 @@
+// kvshm.h - shared-memory hot-key table shared by kvserver and local readers.
+//
+// kvserver (the only writer) publishes hot key/value pairs into a POSIX
+// shared-memory segment; co-located processes map it read-only and look
+// keys up without any syscall. Each slot is guarded by a seqlock: the
+// writer makes the sequence odd while it rewrites a slot, and readers retry
+// until they copy a slot with the same even sequence before and after.
+//
+// The same file is kept in server/ and client/ (like httplib.h).
+// Older glibc needs -lrt for shm_open.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kvshm
+{
+
+static constexpr uint64_t MAGIC = 0x6b7673686d763032ULL; // "kvshmv02"
+static constexpr uint32_t WAYS = 4;                      // slots per bucket
+static constexpr int MAX_RETRIES = 64;
+
+struct Header
+{
+    uint64_t magic;
+    uint32_t buckets; // power of two
+    uint32_t key_max;
+    uint32_t value_max;
+    uint32_t slot_size;
+    uint32_t max_age_ms; // readers skip older slots (0 = no limit)
+};
+
+struct SlotHeader
+{
+    std::atomic<uint32_t> seq;
+    uint32_t key_len; // 0 = empty
+    uint32_t value_len;
+    uint32_t age; // writer-only replacement clock
+    uint64_t hash;
+    uint64_t written_ms; // CLOCK_MONOTONIC, which all local processes share
+};
+
+inline uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000 + uint64_t(ts.tv_nsec) / 1000000;
+}
+
+inline uint64_t hash_key(const char *key, size_t len)
+{
+    // FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h | 1; // never 0, which marks an empty slot
+}
+
+class Table
+{
+public:
+    Table() = default;
+    Table(const Table &) = delete;
+    Table &operator=(const Table &) = delete;
+
+    ~Table()
+    {
+        if (base)
+            munmap(base, size);
+    }
+
+    // Writer side: creates (or replaces) the segment. mode is applied as
+    // given, without the umask; readers need read permission.
+    bool create(const std::string &name, uint32_t buckets, uint32_t keyMax, uint32_t valueMax,
+                uint32_t maxAgeMs, mode_t mode = 0600)
+    {
+        uint32_t b = 1;
+        while (b < buckets)
+            b <<= 1;
+        uint32_t slot_size = (uint32_t)((sizeof(SlotHeader) + keyMax + valueMax + 63) & ~size_t(63));
+        size_t bytes = 64 + size_t(b) * WAYS * slot_size;
+
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, mode & 0600);
+        if (fd < 0)
+            return false;
+        if (fchmod(fd, mode) != 0 || ftruncate(fd, (off_t)bytes) != 0)
+        {
+            close(fd);
+            return false;
+        }
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return false;
+
+        base = (char *)p;
+        size = bytes;
+        hdr = (Header *)base;
+        hdr->buckets = b;
+        hdr->key_max = keyMax;
+        hdr->value_max = valueMax;
+        hdr->slot_size = slot_size;
+        hdr->max_age_ms = maxAgeMs;
+        // Readers check the magic last
+        std::atomic_thread_fence(std::memory_order_release);
+        hdr->magic = MAGIC;
+        return true;
+    }
+
+    // Reader side: maps an existing segment read-only
+    bool open(const std::string &name)
+    {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < 64)
+        {
+            close(fd);
+            return false;
+        }
+        void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return false;
+
+        base = (char *)p;
+        size = (size_t)st.st_size;
+        hdr = (Header *)base;
+        if (hdr->magic != MAGIC || 64 + size_t(hdr->buckets) * WAYS * hdr->slot_size > size)
+        {
+            munmap(base, size);
+            base = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    bool is_open() const { return base != nullptr; }
+    uint32_t value_max() const { return hdr->value_max; }
+    uint32_t key_max() const { return hdr->key_max; }
+
+    // Lock-free read; safe against a concurrent writer. Gives up (returns
+    // false, so the caller falls back to HTTP) if a slot keeps changing or
+    // is older than max_age_ms.
+    bool get(const std::string &key, std::string &value) const
+    {
+        if (key.empty() || key.size() > hdr->key_max)
+            return false;
+        uint64_t h = hash_key(key.data(), key.size());
+        uint64_t now = now_ms();
+        uint64_t oldest = now > hdr->max_age_ms ? now - hdr->max_age_ms : 0;
+
+        char buf[4096];
+        for (uint32_t w = 0; w < WAYS; w++)
+        {
+            const char *s = slot(h, w);
+            const SlotHeader *sh = (const SlotHeader *)s;
+            for (int attempt = 0; attempt < MAX_RETRIES; attempt++)
+            {
+                uint32_t s1 = sh->seq.load(std::memory_order_acquire);
+                if (s1 & 1)
+                    continue; // writer in progress
+
+                bool match = sh->hash == h && sh->key_len == key.size() &&
+                             std::memcmp(s + sizeof(SlotHeader), key.data(), key.size()) == 0;
+                bool fresh = sh->written_ms >= oldest;
+                uint32_t len = match ? sh->value_len : 0;
+                const char *src = s + sizeof(SlotHeader) + hdr->key_max;
+                if (match && len <= hdr->value_max && len <= sizeof(buf))
+                    std::memcpy(buf, src, len);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sh->seq.load(std::memory_order_relaxed) != s1)
+                    continue; // torn, retry this way
+
+                if (!match)
+                    break;
+                if (!fresh)
+                    return false;
+                if (len <= sizeof(buf))
+                {
+                    value.assign(buf, len);
+                    return true;
+                }
+                // Large value: copy straight out and re-validate
+                value.assign(src, len);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sh->seq.load(std::memory_order_relaxed) == s1)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // Writer side (single writer). Returns false if the pair doesn't fit.
+    bool put(const std::string &key, const std::string &value)
+    {
+        if (key.empty() || key.size() > hdr->key_max || value.size() > hdr->value_max)
+            return false;
+        uint64_t h = hash_key(key.data(), key.size());
+
+        // Same key, else an empty way, else the way with the oldest write
+        char *target = nullptr;
+        char *empty = nullptr;
+        char *oldest = nullptr;
+        for (uint32_t w = 0; w < WAYS; w++)
+        {
+            char *s = slot(h, w);
+            SlotHeader *sh = (SlotHeader *)s;
+            if (sh->hash == h && sh->key_len == key.size() &&
+                std::memcmp(s + sizeof(SlotHeader), key.data(), key.size()) == 0)
+            {
+                target = s;
+                break;
+            }
+            if (!empty && sh->key_len == 0)
+                empty = s;
+            if (!oldest || (int32_t)(sh->age - ((SlotHeader *)oldest)->age) < 0)
+                oldest = s;
+        }
+        if (!target)
+            target = empty ? empty : oldest;
+
+        SlotHeader *sh = (SlotHeader *)target;
+        begin_write(sh);
+        sh->hash = h;
+        sh->key_len = (uint32_t)key.size();
+        sh->value_len = (uint32_t)value.size();
+        sh->age = ++clock;
+        sh->written_ms = now_ms();
+        std::memcpy(target + sizeof(SlotHeader), key.data(), key.size());
+        std::memcpy(target + sizeof(SlotHeader) + hdr->key_max, value.data(), value.size());
+        end_write(sh);
+        return true;
+    }
+
+    void erase(const std::string &key)
+    {
+        if (key.size() > hdr->key_max)
+            return;
+        uint64_t h = hash_key(key.data(), key.size());
+        for (uint32_t w = 0; w < WAYS; w++)
+        {
+            char *s = slot(h, w);
+            SlotHeader *sh = (SlotHeader *)s;
+            if (sh->hash == h && sh->key_len == key.size() &&
+                std::memcmp(s + sizeof(SlotHeader), key.data(), key.size()) == 0)
+                clear(sh);
+        }
+    }
+
+    // Removes every key starting with prefix (walks the whole table)
+    size_t erase_prefix(const std::string &prefix)
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < size_t(hdr->buckets) * WAYS; i++)
+        {
+            char *s = base + 64 + i * hdr->slot_size;
+            SlotHeader *sh = (SlotHeader *)s;
+            if (sh->key_len >= prefix.size() && sh->key_len > 0 &&
+                std::memcmp(s + sizeof(SlotHeader), prefix.data(), prefix.size()) == 0)
+            {
+                clear(sh);
+                n++;
+            }
+        }
+        return n;
+    }
+
+private:
+    char *slot(uint64_t h, uint32_t way) const
+    {
+        size_t bucket = h & (hdr->buckets - 1);
+        return base + 64 + (bucket * WAYS + way) * hdr->slot_size;
+    }
+
+    static void begin_write(SlotHeader *sh)
+    {
+        sh->seq.store(sh->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    static void end_write(SlotHeader *sh)
+    {
+        sh->seq.store(sh->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    static void clear(SlotHeader *sh)
+    {
+        begin_write(sh);
+        sh->key_len = 0;
+        sh->hash = 0;
+        end_write(sh);
+    }
+
+    char *base = nullptr;
+    size_t size = 0;
+    Header *hdr = nullptr;
+    uint32_t clock = 0;
+};
+
+} // namespace kvshm
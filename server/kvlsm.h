@@ -0,0 +1,1414 @@
+// kvlsm.h - embedded log-structured merge-tree store for kvserver.
+//
+// Writes are appended to a write-ahead log and applied to an in-memory
+// sorted memtable. Full memtables are flushed to immutable sorted tables
+// (SSTables) in level 0; background threads merge them down through
+// levels 1..6, where tables of one level never overlap and each level
+// holds ~10x the bytes of the previous one. Every table keeps its block
+// index and Bloom filter in memory, so a point read costs at most one
+// block read per level, and usually none for levels without the key.
+//
+// .sst layout:
+//   data blocks   entries + u32 crc32; entry = u32 klen, u32 vlen, key, value
+//                 (vlen == TOMBSTONE marks a delete)
+//   index block   u32 n, n x (u64 offset, u32 size, u32 klen, last key)
+//   bloom block   u32 k, bit array
+//   footer        u64 index_off, u64 index_size, u64 bloom_off, u64 bloom_size, u64 MAGIC
+// .log records:   u32 crc32(rest), u32 klen, u32 vlen, key, value
+// MANIFEST:       text; rewritten (tmp + rename) after every flush/compaction
+//
+// Integers are stored in host byte order (little-endian targets only).
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kvlsm
+{
+
+static constexpr int LEVELS = 7;
+static constexpr uint32_t TOMBSTONE = 0xFFFFFFFF;
+static constexpr uint64_t MAGIC = 0x6b766c736d763031ULL; // "kvlsmv01"
+static constexpr size_t FOOTER_SIZE = 40;
+static constexpr size_t MAX_IMMUTABLE = 2; // memtables waiting for flush before writes stall
+
+struct Options
+{
+    size_t memtable_bytes = 4 << 20;
+    size_t block_bytes = 4096;
+    size_t table_bytes = 2 << 20;     // target SSTable size in levels >= 1
+    uint64_t level1_bytes = 10 << 20; // each deeper level is 10x larger
+    size_t l0_compaction_trigger = 4;
+    size_t l0_stop_writes = 12;
+    int bloom_bits_per_key = 10;
+    int background_threads = 2;
+    bool sync = false; // fdatasync the WAL (group commit) before a write returns
+};
+
+// ------------------- Encoding --------------------
+
+inline uint32_t crc32(const char *data, size_t len)
+{
+    static const struct Table
+    {
+        uint32_t v[256];
+        Table()
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                v[i] = c;
+            }
+        }
+    } table;
+
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++)
+        c = table.v[(c ^ (unsigned char)data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+inline uint64_t hash64(const std::string &key)
+{
+    // FNV-1a with a final mix so the Bloom probes are spread out
+    uint64_t h = 1469598103934665603ULL;
+    for (unsigned char c : key)
+    {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+inline void put_u32(std::string &s, uint32_t v) { s.append((const char *)&v, 4); }
+inline void put_u64(std::string &s, uint64_t v) { s.append((const char *)&v, 8); }
+
+inline uint32_t get_u32(const char *p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint64_t get_u64(const char *p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+}
+
+[[noreturn]] inline void fail(const std::string &what)
+{
+    throw std::runtime_error("kvlsm: " + what + ": " + std::strerror(errno));
+}
+
+[[noreturn]] inline void corrupt(const std::string &what)
+{
+    throw std::runtime_error("kvlsm: corrupt " + what);
+}
+
+inline void write_all(int fd, const char *data, size_t len, const std::string &path)
+{
+    while (len > 0)
+    {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fail("write " + path);
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+inline void read_at(int fd, char *data, size_t len, uint64_t off, const std::string &path)
+{
+    while (len > 0)
+    {
+        ssize_t n = ::pread(fd, data, len, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            corrupt(path + " (short read)");
+        data += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+}
+
+inline void sync_dir(const std::string &dir)
+{
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0)
+    {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+inline std::string file_name(const std::string &dir, uint64_t number, const char *ext)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "/%06llu.%s", (unsigned long long)number, ext);
+    return dir + buf;
+}
+
+// ------------------- Iterators --------------------
+
+// Walks entries (including tombstones) in key order
+class Iterator
+{
+public:
+    virtual ~Iterator() = default;
+    virtual bool valid() const = 0;
+    virtual void seek(const std::string &target) = 0; // first key >= target
+    virtual void next() = 0;
+    virtual const std::string &key() const = 0;
+    virtual const std::string &value() const = 0;
+    virtual bool deleted() const = 0;
+};
+
+// Merges children ordered newest first; for a key present in several
+// children only the newest entry is returned.
+class MergeIterator : public Iterator
+{
+public:
+    explicit MergeIterator(std::vector<std::unique_ptr<Iterator>> c) : children(std::move(c)) {}
+
+    bool valid() const override { return cur != nullptr; }
+
+    void seek(const std::string &target) override
+    {
+        for (auto &c : children)
+            c->seek(target);
+        find_smallest();
+    }
+
+    void next() override
+    {
+        std::string k = cur->key();
+        for (auto &c : children)
+            if (c->valid() && c->key() == k)
+                c->next();
+        find_smallest();
+    }
+
+    const std::string &key() const override { return cur->key(); }
+    const std::string &value() const override { return cur->value(); }
+    bool deleted() const override { return cur->deleted(); }
+
+private:
+    void find_smallest()
+    {
+        cur = nullptr;
+        for (auto &c : children)
+            if (c->valid() && (!cur || c->key() < cur->key()))
+                cur = c.get(); // strict < keeps the newest on ties
+    }
+
+    std::vector<std::unique_ptr<Iterator>> children;
+    Iterator *cur = nullptr;
+};
+
+// ------------------- Memtable --------------------
+
+struct Memtable
+{
+    struct Slot
+    {
+        std::string value;
+        bool deleted;
+    };
+
+    std::map<std::string, Slot> rows;
+    size_t bytes = 0;
+    uint64_t wal_number = 0;
+    int wal_fd = -1;
+
+    void apply(const std::string &key, const std::string &value, bool deleted)
+    {
+        auto it = rows.find(key);
+        if (it == rows.end())
+        {
+            rows.emplace(key, Slot{value, deleted});
+            bytes += key.size() + value.size() + 64;
+        }
+        else
+        {
+            bytes += value.size();
+            bytes -= std::min(bytes, it->second.value.size());
+            it->second.value = value;
+            it->second.deleted = deleted;
+        }
+    }
+};
+
+// The active memtable keeps changing under the DB mutex, so this copies
+// it in small chunks under that mutex instead of holding it for a scan.
+class MemIterator : public Iterator
+{
+public:
+    MemIterator(std::shared_ptr<Memtable> m, std::mutex &mtx) : mem(std::move(m)), mtx(mtx) {}
+
+    bool valid() const override { return pos < chunk.size(); }
+
+    void seek(const std::string &target) override { refill(target, true); }
+
+    void next() override
+    {
+        if (++pos == chunk.size() && !exhausted)
+            refill(chunk.back().key, false);
+    }
+
+    const std::string &key() const override { return chunk[pos].key; }
+    const std::string &value() const override { return chunk[pos].value; }
+    bool deleted() const override { return chunk[pos].deleted; }
+
+private:
+    static constexpr size_t CHUNK = 128;
+
+    struct Row
+    {
+        std::string key;
+        std::string value;
+        bool deleted;
+    };
+
+    void refill(std::string from, bool inclusive)
+    {
+        chunk.clear();
+        pos = 0;
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = inclusive ? mem->rows.lower_bound(from) : mem->rows.upper_bound(from);
+        for (; it != mem->rows.end() && chunk.size() < CHUNK; ++it)
+            chunk.push_back(Row{it->first, it->second.value, it->second.deleted});
+        exhausted = it == mem->rows.end();
+    }
+
+    std::shared_ptr<Memtable> mem;
+    std::mutex &mtx;
+    std::vector<Row> chunk;
+    size_t pos = 0;
+    bool exhausted = true;
+};
+
+// ------------------- SSTable --------------------
+
+class TableBuilder
+{
+public:
+    TableBuilder(const std::string &p, const Options &o) : path(p), opts(o)
+    {
+        fd = ::open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (fd < 0)
+            fail("create " + path);
+    }
+
+    ~TableBuilder()
+    {
+        if (fd >= 0)
+        {
+            // Not finished: an exception unwound the build
+            ::close(fd);
+            ::unlink(path.c_str());
+        }
+    }
+
+    void add(const std::string &key, const std::string &value, bool deleted)
+    {
+        put_u32(block, (uint32_t)key.size());
+        put_u32(block, deleted ? TOMBSTONE : (uint32_t)value.size());
+        block += key;
+        if (!deleted)
+            block += value;
+        last_key = key;
+        hashes.push_back(hash64(key));
+        if (block.size() >= opts.block_bytes)
+            flush_block();
+    }
+
+    uint64_t estimated_size() const { return offset + block.size(); }
+    size_t entries() const { return hashes.size(); }
+
+    // Writes index, filter and footer and syncs the file. Returns its size.
+    uint64_t finish()
+    {
+        if (!block.empty())
+            flush_block();
+
+        uint64_t index_off = offset;
+        std::string out = index;
+        uint64_t bloom_off = index_off + out.size();
+
+        size_t bits = std::max<size_t>(64, hashes.size() * opts.bloom_bits_per_key);
+        uint32_t k = (uint32_t)std::max(1, std::min(30, int(opts.bloom_bits_per_key * 0.69)));
+        std::string bloom((bits + 7) / 8, '\0');
+        bits = bloom.size() * 8;
+        for (uint64_t h : hashes)
+        {
+            uint64_t delta = (h >> 33) | (h << 31);
+            for (uint32_t i = 0; i < k; i++, h += delta)
+                bloom[(h % bits) / 8] |= char(1 << ((h % bits) % 8));
+        }
+        put_u32(out, k);
+        out += bloom;
+
+        put_u64(out, index_off);
+        put_u64(out, bloom_off - index_off);
+        put_u64(out, bloom_off);
+        put_u64(out, 4 + bloom.size());
+        put_u64(out, MAGIC);
+        write_all(fd, out.data(), out.size(), path);
+        offset += out.size();
+
+        if (::fdatasync(fd) != 0)
+            fail("sync " + path);
+        ::close(fd);
+        fd = -1;
+        return offset;
+    }
+
+private:
+    void flush_block()
+    {
+        uint32_t crc = crc32(block.data(), block.size());
+        put_u32(block, crc);
+        write_all(fd, block.data(), block.size(), path);
+
+        put_u64(index, offset);
+        put_u32(index, (uint32_t)(block.size() - 4));
+        put_u32(index, (uint32_t)last_key.size());
+        index += last_key;
+        index_count++;
+        std::memcpy(&index[0], &index_count, 4);
+
+        offset += block.size();
+        block.clear();
+    }
+
+    std::string path;
+    const Options &opts;
+    int fd = -1;
+    uint64_t offset = 0;
+    std::string block;
+    std::string index = std::string(4, '\0'); // u32 count, patched per block
+    uint32_t index_count = 0;
+    std::string last_key;
+    std::vector<uint64_t> hashes;
+};
+
+class Table
+{
+public:
+    const uint64_t number;
+    const std::string path;
+    uint64_t file_size = 0;
+    std::string smallest;
+    std::string largest;
+
+    // Guarded by the DB mutex
+    bool being_compacted = false;
+    // Set once a newer version no longer references the file
+    std::atomic<bool> obsolete{false};
+
+    Table(const std::string &p, uint64_t n) : number(n), path(p)
+    {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            fail("open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || (size_t)st.st_size < FOOTER_SIZE)
+        {
+            ::close(fd);
+            corrupt(path);
+        }
+        file_size = (uint64_t)st.st_size;
+        try
+        {
+            load();
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+    }
+
+    ~Table()
+    {
+        ::close(fd);
+        if (obsolete)
+            ::unlink(path.c_str());
+    }
+
+    Table(const Table &) = delete;
+    Table &operator=(const Table &) = delete;
+
+    bool may_contain(const std::string &key) const
+    {
+        size_t bits = bloom.size() * 8;
+        uint64_t h = hash64(key);
+        uint64_t delta = (h >> 33) | (h << 31);
+        for (uint32_t i = 0; i < bloom_k; i++, h += delta)
+            if (!(bloom[(h % bits) / 8] & (1 << ((h % bits) % 8))))
+                return false;
+        return true;
+    }
+
+    // Returns true if the table has an entry for key (possibly a tombstone)
+    bool get(const std::string &key, std::string &value, bool &deleted) const
+    {
+        size_t b = find_block(key);
+        if (b == blocks.size())
+            return false;
+        std::string buf;
+        read_block(b, buf);
+        for (size_t pos = 0; pos < buf.size();)
+        {
+            uint32_t klen = get_u32(&buf[pos]);
+            uint32_t vlen = get_u32(&buf[pos + 4]);
+            size_t vsize = vlen == TOMBSTONE ? 0 : vlen;
+            int cmp = buf.compare(pos + 8, klen, key);
+            if (cmp == 0)
+            {
+                deleted = vlen == TOMBSTONE;
+                value.assign(buf, pos + 8 + klen, vsize);
+                return true;
+            }
+            if (cmp > 0)
+                break;
+            pos += 8 + klen + vsize;
+        }
+        return false;
+    }
+
+    size_t block_count() const { return blocks.size(); }
+
+    // First block whose last key >= key (block_count() if none)
+    size_t find_block(const std::string &key) const
+    {
+        return std::lower_bound(blocks.begin(), blocks.end(), key,
+                                [](const Block &b, const std::string &k)
+                                { return b.last_key < k; }) -
+               blocks.begin();
+    }
+
+    void read_block(size_t b, std::string &buf) const
+    {
+        const Block &blk = blocks[b];
+        buf.resize(blk.size + 4);
+        read_at(fd, &buf[0], buf.size(), blk.offset, path);
+        if (crc32(buf.data(), blk.size) != get_u32(&buf[blk.size]))
+            corrupt(path + " (block checksum)");
+        buf.resize(blk.size);
+        block_reads++;
+    }
+
+    static inline std::atomic<uint64_t> block_reads{0};
+
+private:
+    struct Block
+    {
+        uint64_t offset;
+        uint32_t size;
+        std::string last_key;
+    };
+
+    void load()
+    {
+        char footer[FOOTER_SIZE];
+        read_at(fd, footer, FOOTER_SIZE, file_size - FOOTER_SIZE, path);
+        uint64_t index_off = get_u64(footer), index_size = get_u64(footer + 8);
+        uint64_t bloom_off = get_u64(footer + 16), bloom_size = get_u64(footer + 24);
+        if (get_u64(footer + 32) != MAGIC || index_size < 4 || bloom_size < 5 ||
+            index_off + index_size > file_size || bloom_off + bloom_size > file_size)
+            corrupt(path + " (footer)");
+
+        std::string index(index_size, '\0');
+        read_at(fd, &index[0], index_size, index_off, path);
+        uint32_t n = get_u32(&index[0]);
+        for (size_t pos = 4; blocks.size() < n;)
+        {
+            if (pos + 16 > index.size())
+                corrupt(path + " (index)");
+            Block b;
+            b.offset = get_u64(&index[pos]);
+            b.size = get_u32(&index[pos + 8]);
+            uint32_t klen = get_u32(&index[pos + 12]);
+            if (pos + 16 + klen > index.size())
+                corrupt(path + " (index)");
+            b.last_key.assign(index, pos + 16, klen);
+            blocks.push_back(std::move(b));
+            pos += 16 + klen;
+        }
+        if (blocks.empty())
+            corrupt(path + " (no blocks)");
+
+        std::string filter(bloom_size, '\0');
+        read_at(fd, &filter[0], bloom_size, bloom_off, path);
+        bloom_k = get_u32(&filter[0]);
+        bloom = filter.substr(4);
+
+        std::string first;
+        read_block(0, first);
+        smallest.assign(first, 8, get_u32(&first[0]));
+        largest = blocks.back().last_key;
+    }
+
+    int fd = -1;
+    std::vector<Block> blocks;
+    std::string bloom;
+    uint32_t bloom_k = 0;
+};
+
+class TableIterator : public Iterator
+{
+public:
+    explicit TableIterator(std::shared_ptr<Table> t) : table(std::move(t)) {}
+
+    bool valid() const override { return ok; }
+
+    void seek(const std::string &target) override
+    {
+        load(table->find_block(target));
+        while (ok && k < target)
+            next();
+    }
+
+    void next() override
+    {
+        if (pos >= buf.size())
+            load(block + 1);
+        else
+            parse();
+    }
+
+    const std::string &key() const override { return k; }
+    const std::string &value() const override { return v; }
+    bool deleted() const override { return del; }
+
+private:
+    void load(size_t b)
+    {
+        block = b;
+        ok = false;
+        if (block >= table->block_count())
+            return;
+        table->read_block(block, buf);
+        pos = 0;
+        parse();
+    }
+
+    void parse()
+    {
+        uint32_t klen = get_u32(&buf[pos]);
+        uint32_t vlen = get_u32(&buf[pos + 4]);
+        del = vlen == TOMBSTONE;
+        k.assign(buf, pos + 8, klen);
+        v.assign(buf, pos + 8 + klen, del ? 0 : vlen);
+        pos += 8 + klen + (del ? 0 : vlen);
+        ok = true;
+    }
+
+    std::shared_ptr<Table> table;
+    size_t block = 0;
+    std::string buf;
+    size_t pos = 0;
+    std::string k, v;
+    bool del = false;
+    bool ok = false;
+};
+
+// Concatenates the non-overlapping tables of one level (sorted by key)
+class LevelIterator : public Iterator
+{
+public:
+    explicit LevelIterator(std::vector<std::shared_ptr<Table>> t) : tables(std::move(t)) {}
+
+    bool valid() const override { return it && it->valid(); }
+
+    void seek(const std::string &target) override
+    {
+        idx = std::lower_bound(tables.begin(), tables.end(), target,
+                               [](const std::shared_ptr<Table> &t, const std::string &k)
+                               { return t->largest < k; }) -
+              tables.begin();
+        open(target);
+    }
+
+    void next() override
+    {
+        it->next();
+        if (!it->valid())
+        {
+            idx++;
+            open(std::string());
+        }
+    }
+
+    const std::string &key() const override { return it->key(); }
+    const std::string &value() const override { return it->value(); }
+    bool deleted() const override { return it->deleted(); }
+
+private:
+    void open(const std::string &target)
+    {
+        it.reset();
+        if (idx < tables.size())
+        {
+            it.reset(new TableIterator(tables[idx]));
+            it->seek(target);
+        }
+    }
+
+    std::vector<std::shared_ptr<Table>> tables;
+    size_t idx = 0;
+    std::unique_ptr<Iterator> it;
+};
+
+// ------------------- DB --------------------
+
+class DB
+{
+public:
+    // Opens (or creates) the store in dir, replaying any write-ahead logs
+    DB(const std::string &d, const Options &o = Options()) : dir(d), opts(o)
+    {
+        if (::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+            fail("mkdir " + dir);
+        lock_fd = ::open((dir + "/LOCK").c_str(), O_CREAT | O_RDWR, 0644);
+        if (lock_fd < 0 || ::flock(lock_fd, LOCK_EX | LOCK_NB) != 0)
+            fail("lock " + dir);
+
+        version = std::make_shared<Version>();
+        recover();
+
+        for (int i = 0; i < std::max(1, opts.background_threads); i++)
+            bg_threads.emplace_back([this]
+                                    { background_loop(); });
+        std::lock_guard<std::mutex> lock(mtx);
+        maybe_schedule();
+    }
+
+    ~DB()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closing = true;
+        }
+        bg_cv.notify_all();
+        for (auto &t : bg_threads)
+            t.join();
+        // Unflushed memtables stay recoverable from their logs
+        if (mem->wal_fd >= 0)
+            ::close(mem->wal_fd);
+        for (auto &m : imm)
+            ::close(m->wal_fd);
+        ::close(lock_fd);
+    }
+
+    DB(const DB &) = delete;
+    DB &operator=(const DB &) = delete;
+
+    void put(const std::string &key, const std::string &value) { write(key, value, false); }
+    void del(const std::string &key) { write(key, std::string(), true); }
+
+    bool get(const std::string &key, std::string &value)
+    {
+        gets++;
+        std::vector<std::shared_ptr<Memtable>> frozen;
+        std::shared_ptr<const Version> v;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = mem->rows.find(key);
+            if (it != mem->rows.end())
+                return found(it->second, value);
+            frozen = imm;
+            v = version;
+        }
+
+        // Immutable memtables are never modified, newest last
+        for (auto m = frozen.rbegin(); m != frozen.rend(); ++m)
+        {
+            auto it = (*m)->rows.find(key);
+            if (it != (*m)->rows.end())
+                return found(it->second, value);
+        }
+
+        bool deleted = false;
+        auto probe = [&](const Table &t)
+        {
+            if (key < t.smallest || key > t.largest)
+                return false;
+            if (!t.may_contain(key))
+            {
+                bloom_skips++;
+                return false;
+            }
+            return t.get(key, value, deleted);
+        };
+
+        // Level 0 tables may overlap; newest (highest number) last
+        for (auto t = v->levels[0].rbegin(); t != v->levels[0].rend(); ++t)
+            if (probe(**t))
+                return !deleted;
+        for (int l = 1; l < LEVELS; l++)
+        {
+            auto &files = v->levels[l];
+            auto t = std::lower_bound(files.begin(), files.end(), key,
+                                      [](const std::shared_ptr<Table> &t, const std::string &k)
+                                      { return t->largest < k; });
+            if (t != files.end() && probe(**t))
+                return !deleted;
+        }
+        return false;
+    }
+
+    // Calls fn(key, value) for live keys in [start, end) in key order (empty
+    // end = no upper bound), at most limit times (0 = no limit) or until fn
+    // returns false.
+    void scan(const std::string &start, const std::string &end, size_t limit,
+              const std::function<bool(const std::string &, const std::string &)> &fn)
+    {
+        scans++;
+        std::vector<std::unique_ptr<Iterator>> children;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            children.emplace_back(new MemIterator(mem, mtx));
+            for (auto m = imm.rbegin(); m != imm.rend(); ++m)
+                children.emplace_back(new MemIterator(*m, mtx));
+            for (auto t = version->levels[0].rbegin(); t != version->levels[0].rend(); ++t)
+                children.emplace_back(new TableIterator(*t));
+            for (int l = 1; l < LEVELS; l++)
+                if (!version->levels[l].empty())
+                    children.emplace_back(new LevelIterator(version->levels[l]));
+        }
+
+        MergeIterator it(std::move(children));
+        size_t n = 0;
+        for (it.seek(start); it.valid() && (end.empty() || it.key() < end); it.next())
+        {
+            if (it.deleted())
+                continue;
+            if (!fn(it.key(), it.value()) || (limit && ++n >= limit))
+                return;
+        }
+    }
+
+    std::string stats()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::string s =
+            "lsm_puts=" + std::to_string(puts.load()) + "\n" +
+            "lsm_deletes=" + std::to_string(deletes.load()) + "\n" +
+            "lsm_gets=" + std::to_string(gets.load()) + "\n" +
+            "lsm_scans=" + std::to_string(scans.load()) + "\n" +
+            "lsm_bloom_skips=" + std::to_string(bloom_skips.load()) + "\n" +
+            "lsm_block_reads=" + std::to_string(Table::block_reads.load()) + "\n" +
+            "lsm_memtable_bytes=" + std::to_string(mem->bytes) + "\n" +
+            "lsm_immutable_memtables=" + std::to_string(imm.size()) + "\n" +
+            "lsm_flushes=" + std::to_string(flushes) + "\n" +
+            "lsm_compactions=" + std::to_string(compactions) + "\n" +
+            "lsm_trivial_moves=" + std::to_string(trivial_moves) + "\n" +
+            "lsm_compaction_bytes_read=" + std::to_string(compaction_read) + "\n" +
+            "lsm_compaction_bytes_written=" + std::to_string(compaction_written) + "\n" +
+            "lsm_write_stalls=" + std::to_string(write_stalls) + "\n";
+        for (int l = 0; l < LEVELS; l++)
+            s += "lsm_level" + std::to_string(l) + "_files=" + std::to_string(version->levels[l].size()) + "\n" +
+                 "lsm_level" + std::to_string(l) + "_bytes=" + std::to_string(level_bytes(*version, l)) + "\n";
+        if (!bg_error.empty())
+            s += "lsm_error=" + bg_error + "\n";
+        return s;
+    }
+
+private:
+    struct Version
+    {
+        // Level 0 sorted by file number (age); deeper levels by key range
+        std::vector<std::shared_ptr<Table>> levels[LEVELS];
+    };
+
+    struct Compaction
+    {
+        int level;
+        std::vector<std::shared_ptr<Table>> inputs[2]; // level, level + 1
+        bool bottommost = false;
+    };
+
+    static bool found(const Memtable::Slot &slot, std::string &value)
+    {
+        if (slot.deleted)
+            return false;
+        value = slot.value;
+        return true;
+    }
+
+    static uint64_t level_bytes(const Version &v, int level)
+    {
+        uint64_t total = 0;
+        for (auto &t : v.levels[level])
+            total += t->file_size;
+        return total;
+    }
+
+    uint64_t max_level_bytes(int level) const
+    {
+        uint64_t b = opts.level1_bytes;
+        for (int l = 1; l < level; l++)
+            b *= 10;
+        return b;
+    }
+
+    // ---- Writes ----
+
+    void write(const std::string &key, const std::string &value, bool deleted)
+    {
+        std::string rec;
+        rec.reserve(12 + key.size() + value.size());
+        put_u32(rec, 0);
+        put_u32(rec, (uint32_t)key.size());
+        put_u32(rec, deleted ? TOMBSTONE : (uint32_t)value.size());
+        rec += key;
+        if (!deleted)
+            rec += value;
+        uint32_t crc = crc32(rec.data() + 4, rec.size() - 4);
+        std::memcpy(&rec[0], &crc, 4);
+
+        uint64_t seq;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            make_room(lock);
+            write_all(mem->wal_fd, rec.data(), rec.size(), "wal");
+            mem->apply(key, value, deleted);
+            seq = ++wal_written;
+        }
+        (deleted ? deletes : puts)++;
+
+        if (opts.sync)
+            sync_wal(seq);
+    }
+
+    // Switches to a new memtable when the current one is full, stalling
+    // while flushes or level-0 compactions are behind
+    void make_room(std::unique_lock<std::mutex> &lock)
+    {
+        while (true)
+        {
+            if (!bg_error.empty())
+                throw std::runtime_error("kvlsm: background error: " + bg_error);
+            if (mem->bytes < opts.memtable_bytes)
+                return;
+            if (imm.size() >= MAX_IMMUTABLE || version->levels[0].size() >= opts.l0_stop_writes)
+            {
+                write_stalls++;
+                stall_cv.wait(lock);
+                continue;
+            }
+
+            if (opts.sync && ::fdatasync(mem->wal_fd) != 0)
+                fail("sync wal");
+            imm.push_back(mem);
+            mem = std::make_shared<Memtable>();
+            open_wal(*mem);
+            maybe_schedule();
+            return;
+        }
+    }
+
+    void open_wal(Memtable &m)
+    {
+        m.wal_number = next_file++;
+        std::string path = file_name(dir, m.wal_number, "log");
+        m.wal_fd = ::open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644);
+        if (m.wal_fd < 0)
+            fail("create " + path);
+        sync_dir(dir);
+    }
+
+    // Group commit: one fdatasync covers every record written before it
+    void sync_wal(uint64_t seq)
+    {
+        std::lock_guard<std::mutex> lock(sync_mtx);
+        if (wal_synced >= seq)
+            return;
+        uint64_t target;
+        int fd;
+        {
+            std::lock_guard<std::mutex> l(mtx);
+            target = wal_written;
+            fd = mem->wal_fd; // earlier logs were synced when they were sealed
+        }
+        if (::fdatasync(fd) != 0)
+            fail("sync wal");
+        wal_synced = target;
+    }
+
+    // ---- Background work ----
+
+    void background_loop()
+    {
+        // kvserver groups its per-thread CPU stats by this name
+        pthread_setname_np(pthread_self(), "kv-flusher");
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true)
+        {
+            bg_cv.wait(lock, [&]
+                       { return closing || !bg_jobs.empty(); });
+            if (closing)
+                return;
+            auto job = std::move(bg_jobs.front());
+            bg_jobs.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+
+    // Caller holds mtx
+    void maybe_schedule()
+    {
+        if (closing || !bg_error.empty())
+            return;
+        if (!imm.empty() && !flush_scheduled)
+        {
+            flush_scheduled = true;
+            bg_jobs.push_back([this]
+                              { guarded([this]
+                                        { flush(); }); });
+        }
+        // Leave one thread free for flushes
+        while (running_compactions < std::max(1, opts.background_threads - 1))
+        {
+            auto c = std::make_shared<Compaction>();
+            if (!pick_compaction(*c))
+                break;
+            running_compactions++;
+            bg_jobs.push_back([this, c]
+                              { guarded([this, c]
+                                        { compact(*c); }); });
+        }
+        bg_cv.notify_all();
+    }
+
+    void guarded(const std::function<void()> &job)
+    {
+        try
+        {
+            job();
+        }
+        catch (const std::exception &e)
+        {
+            // Stop accepting writes rather than risk losing them
+            std::lock_guard<std::mutex> lock(mtx);
+            bg_error = e.what();
+            stall_cv.notify_all();
+        }
+    }
+
+    void flush()
+    {
+        std::shared_ptr<Memtable> m;
+        uint64_t number;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            m = imm.front();
+            number = next_file++;
+        }
+
+        std::shared_ptr<Table> t = write_table(*m, number);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto v = std::make_shared<Version>(*version);
+            if (t)
+                v->levels[0].push_back(t);
+            install(v);
+        }
+
+        // The table and manifest are durable, so the log can go. Done
+        // before the next flush starts so recovery replays logs in order.
+        {
+            std::lock_guard<std::mutex> lock(sync_mtx);
+            ::close(m->wal_fd);
+        }
+        ::unlink(file_name(dir, m->wal_number, "log").c_str());
+
+        std::lock_guard<std::mutex> lock(mtx);
+        imm.erase(imm.begin());
+        flushes++;
+        flush_scheduled = false;
+        stall_cv.notify_all();
+        maybe_schedule();
+    }
+
+    std::shared_ptr<Table> write_table(const Memtable &m, uint64_t number)
+    {
+        if (m.rows.empty())
+            return nullptr;
+        std::string path = file_name(dir, number, "sst");
+        TableBuilder b(path, opts);
+        for (auto &r : m.rows)
+            b.add(r.first, r.second.value, r.second.deleted);
+        b.finish();
+        return std::make_shared<Table>(path, number);
+    }
+
+    // Caller holds mtx. Fills c and marks its inputs; false if nothing to do.
+    bool pick_compaction(Compaction &c)
+    {
+        const Version &v = *version;
+
+        int level = -1;
+        if (v.levels[0].size() >= opts.l0_compaction_trigger &&
+            std::none_of(v.levels[0].begin(), v.levels[0].end(),
+                         [](const std::shared_ptr<Table> &t)
+                         { return t->being_compacted; }))
+        {
+            level = 0;
+            c.inputs[0] = v.levels[0];
+        }
+        else
+        {
+            // Level furthest over its size budget
+            double best = 1.0;
+            for (int l = 1; l < LEVELS - 1; l++)
+            {
+                double score = double(level_bytes(v, l)) / max_level_bytes(l);
+                if (score >= best)
+                {
+                    best = score;
+                    level = l;
+                }
+            }
+            if (level < 0)
+                return false;
+
+            // Round-robin through the key space of the level
+            auto &files = v.levels[level];
+            size_t start = std::upper_bound(files.begin(), files.end(), compact_pointer[level],
+                                            [](const std::string &k, const std::shared_ptr<Table> &t)
+                                            { return k < t->smallest; }) -
+                           files.begin();
+            for (size_t i = 0; i < files.size() && c.inputs[0].empty(); i++)
+            {
+                auto &t = files[(start + i) % files.size()];
+                if (!t->being_compacted)
+                    c.inputs[0].push_back(t);
+            }
+            if (c.inputs[0].empty())
+                return false;
+        }
+
+        c.level = level;
+        std::string lo, hi;
+        key_range(c.inputs[0], lo, hi);
+        c.inputs[1] = overlapping(v, level + 1, lo, hi);
+        for (auto &t : c.inputs[1])
+            if (t->being_compacted)
+            {
+                c.inputs[0].clear();
+                c.inputs[1].clear();
+                return false;
+            }
+
+        std::vector<std::shared_ptr<Table>> all = c.inputs[0];
+        all.insert(all.end(), c.inputs[1].begin(), c.inputs[1].end());
+        key_range(all, lo, hi);
+        c.bottommost = true;
+        for (int l = level + 2; l < LEVELS; l++)
+            if (!overlapping(v, l, lo, hi).empty())
+                c.bottommost = false;
+
+        for (auto &t : all)
+            t->being_compacted = true;
+        compact_pointer[level] = hi;
+        return true;
+    }
+
+    static void key_range(const std::vector<std::shared_ptr<Table>> &tables, std::string &lo, std::string &hi)
+    {
+        lo = tables.front()->smallest;
+        hi = tables.front()->largest;
+        for (auto &t : tables)
+        {
+            lo = std::min(lo, t->smallest);
+            hi = std::max(hi, t->largest);
+        }
+    }
+
+    static std::vector<std::shared_ptr<Table>> overlapping(const Version &v, int level,
+                                                           const std::string &lo, const std::string &hi)
+    {
+        std::vector<std::shared_ptr<Table>> out;
+        for (auto &t : v.levels[level])
+            if (!(t->largest < lo || hi < t->smallest))
+                out.push_back(t);
+        return out;
+    }
+
+    void compact(Compaction &c)
+    {
+        std::vector<std::shared_ptr<Table>> outputs;
+        bool moved = c.level > 0 && c.inputs[0].size() == 1 && c.inputs[1].empty();
+
+        if (moved)
+        {
+            // Nothing to merge with: move the file down a level as is
+            outputs = c.inputs[0];
+        }
+        else
+        {
+            std::vector<std::unique_ptr<Iterator>> children;
+            for (auto t = c.inputs[0].rbegin(); t != c.inputs[0].rend(); ++t)
+                children.emplace_back(new TableIterator(*t)); // level 0: newest first
+            if (!c.inputs[1].empty())
+                children.emplace_back(new LevelIterator(c.inputs[1]));
+            MergeIterator it(std::move(children));
+
+            std::unique_ptr<TableBuilder> b;
+            std::vector<std::pair<std::string, uint64_t>> written;
+            auto finish = [&]
+            {
+                b->finish();
+                b.reset();
+            };
+            for (it.seek(std::string()); it.valid(); it.next())
+            {
+                if (it.deleted() && c.bottommost)
+                    continue; // nothing older left for the tombstone to hide
+                if (!b)
+                {
+                    uint64_t number;
+                    {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        number = next_file++;
+                    }
+                    written.emplace_back(file_name(dir, number, "sst"), number);
+                    b.reset(new TableBuilder(written.back().first, opts));
+                }
+                b->add(it.key(), it.value(), it.deleted());
+                if (b->estimated_size() >= opts.table_bytes)
+                    finish();
+            }
+            if (b)
+                finish();
+            for (auto &w : written)
+                outputs.push_back(std::make_shared<Table>(w.first, w.second));
+        }
+
+        std::lock_guard<std::mutex> lock(mtx);
+        auto v = std::make_shared<Version>(*version);
+        for (int i = 0; i < 2; i++)
+        {
+            auto &files = v->levels[c.level + i];
+            for (auto &in : c.inputs[i])
+                files.erase(std::remove(files.begin(), files.end(), in), files.end());
+        }
+        auto &out = v->levels[c.level + 1];
+        out.insert(out.end(), outputs.begin(), outputs.end());
+        std::sort(out.begin(), out.end(), [](const std::shared_ptr<Table> &a, const std::shared_ptr<Table> &b)
+                  { return a->smallest < b->smallest; });
+        install(v);
+
+        for (int i = 0; i < 2; i++)
+            for (auto &in : c.inputs[i])
+            {
+                in->being_compacted = false;
+                if (!moved)
+                {
+                    in->obsolete = true; // unlinked when the last reader lets go
+                    compaction_read += in->file_size;
+                }
+            }
+        if (moved)
+            trivial_moves++;
+        else
+        {
+            compactions++;
+            for (auto &t : outputs)
+                compaction_written += t->file_size;
+        }
+        running_compactions--;
+        stall_cv.notify_all();
+        maybe_schedule();
+    }
+
+    // ---- Manifest and recovery ----
+
+    // Caller holds mtx. Makes v current once it is durable.
+    void install(const std::shared_ptr<Version> &v)
+    {
+        std::string s = "next_file " + std::to_string(next_file) + "\n";
+        for (int l = 0; l < LEVELS; l++)
+            for (auto &t : v->levels[l])
+                s += "table " + std::to_string(l) + " " + std::to_string(t->number) + "\n";
+
+        std::string tmp = dir + "/MANIFEST.tmp";
+        int fd = ::open(tmp.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (fd < 0)
+            fail("create " + tmp);
+        write_all(fd, s.data(), s.size(), tmp);
+        bool ok = ::fdatasync(fd) == 0;
+        ::close(fd);
+        if (!ok || ::rename(tmp.c_str(), (dir + "/MANIFEST").c_str()) != 0)
+            fail("write manifest");
+        sync_dir(dir);
+        version = v;
+    }
+
+    void recover()
+    {
+        auto v = std::make_shared<Version>();
+        std::vector<uint64_t> live;
+        std::ifstream manifest(dir + "/MANIFEST");
+        std::string line;
+        while (std::getline(manifest, line))
+        {
+            std::istringstream in(line);
+            std::string kind;
+            in >> kind;
+            if (kind == "next_file")
+                in >> next_file;
+            else if (kind == "table")
+            {
+                int level;
+                uint64_t number;
+                in >> level >> number;
+                if (level < 0 || level >= LEVELS)
+                    corrupt("MANIFEST");
+                v->levels[level].push_back(std::make_shared<Table>(file_name(dir, number, "sst"), number));
+                live.push_back(number);
+            }
+        }
+        for (int l = 1; l < LEVELS; l++)
+            std::sort(v->levels[l].begin(), v->levels[l].end(),
+                      [](const std::shared_ptr<Table> &a, const std::shared_ptr<Table> &b)
+                      { return a->smallest < b->smallest; });
+        std::sort(v->levels[0].begin(), v->levels[0].end(),
+                  [](const std::shared_ptr<Table> &a, const std::shared_ptr<Table> &b)
+                  { return a->number < b->number; });
+
+        // Logs in age order; tables a crash left outside the manifest
+        std::vector<uint64_t> logs;
+        if (DIR *d = ::opendir(dir.c_str()))
+        {
+            while (struct dirent *e = ::readdir(d))
+            {
+                std::string name = e->d_name;
+                size_t dot = name.find('.');
+                if (dot == std::string::npos || dot == 0 ||
+                    name.find_first_not_of("0123456789") != dot)
+                    continue;
+                uint64_t number = std::stoull(name.substr(0, dot));
+                std::string ext = name.substr(dot + 1);
+                next_file = std::max(next_file, number + 1);
+                if (ext == "log")
+                    logs.push_back(number);
+                else if (ext == "sst" && std::find(live.begin(), live.end(), number) == live.end())
+                    ::unlink((dir + "/" + name).c_str());
+            }
+            ::closedir(d);
+        }
+        std::sort(logs.begin(), logs.end());
+
+        mem = std::make_shared<Memtable>();
+        for (uint64_t number : logs)
+            replay(file_name(dir, number, "log"), *mem);
+
+        // Persist what the logs held as a level-0 table, then drop them
+        std::lock_guard<std::mutex> lock(mtx);
+        if (auto t = write_table(*mem, next_file++))
+            v->levels[0].push_back(t);
+        install(v);
+        for (uint64_t number : logs)
+            ::unlink(file_name(dir, number, "log").c_str());
+
+        mem = std::make_shared<Memtable>();
+        open_wal(*mem);
+    }
+
+    static void replay(const std::string &path, Memtable &m)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        for (size_t pos = 0; pos + 12 <= data.size();)
+        {
+            uint32_t crc = get_u32(&data[pos]);
+            uint32_t klen = get_u32(&data[pos + 4]);
+            uint32_t vlen = get_u32(&data[pos + 8]);
+            bool deleted = vlen == TOMBSTONE;
+            size_t len = 8 + size_t(klen) + (deleted ? 0 : vlen);
+            // A torn or corrupt tail ends the log
+            if (pos + 4 + len > data.size() || crc32(&data[pos + 4], len) != crc)
+                break;
+            m.apply(data.substr(pos + 12, klen), deleted ? std::string() : data.substr(pos + 12 + klen, vlen), deleted);
+            pos += 4 + len;
+        }
+    }
+
+    const std::string dir;
+    const Options opts;
+    int lock_fd = -1;
+
+    std::mutex mtx;
+    std::condition_variable stall_cv;
+    std::shared_ptr<Memtable> mem;
+    std::vector<std::shared_ptr<Memtable>> imm; // oldest first
+    std::shared_ptr<const Version> version;
+    uint64_t next_file = 1;
+    std::string compact_pointer[LEVELS];
+    std::string bg_error;
+
+    std::mutex sync_mtx; // taken before mtx
+    uint64_t wal_written = 0;
+    uint64_t wal_synced = 0;
+
+    std::vector<std::thread> bg_threads;
+    std::deque<std::function<void()>> bg_jobs;
+    std::condition_variable bg_cv;
+    bool closing = false;
+    bool flush_scheduled = false;
+    int running_compactions = 0;
+
+    std::atomic<uint64_t> puts{0};
+    std::atomic<uint64_t> deletes{0};
+    std::atomic<uint64_t> gets{0};
+    std::atomic<uint64_t> scans{0};
+    std::atomic<uint64_t> bloom_skips{0};
+    uint64_t flushes = 0;
+    uint64_t compactions = 0;
+    uint64_t trivial_moves = 0;
+    uint64_t compaction_read = 0;
+    uint64_t compaction_written = 0;
+    uint64_t write_stalls = 0;
+};
+
+} // namespace kvlsm
@@ -2,205 +2,6995 @@
 #include <iostream>
 #include <unordered_map>
 #include <list>
+#include <map>
+#include <set>
+#include <functional>
+#include <algorithm>
+#include <cstring>
 #include <mutex>
 #include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <condition_variable>
+#include <random>
+#include <deque>
+#include <sstream>
+#include <cmath>
+#include <fstream>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <malloc.h>
+#include <cstdio>
+#include "kvshm.h"
+#include "kvlsm.h"
 #include <pqxx/pqxx> // For libpqxx (C++ wrapper for libpq) - easier to use
 // If you prefer raw libpq: #include <libpq-fe.h>
 
 using namespace httplib;
 
+
 std::atomic<uint64_t> cache_hits{0};
 std::atomic<uint64_t> cache_misses{0};
 
-// ------------------- LRU Cache --------------------
-class LRUCache
+// Names the calling thread "kv-<role>" (visible in top -H); /stats groups
+// per-thread CPU and context switches by it. Roles are string literals.
+void label_thread(const char *role)
+{
+    thread_local const char *labeled = nullptr;
+    if (labeled == role)
+        return;
+    labeled = role;
+    pthread_setname_np(pthread_self(), (std::string("kv-") + role).substr(0, 15).c_str());
+}
+
+// ------------------- Lock Policies --------------------
+// The caches below take their lock as a template parameter. Lock policies
+// are BasicLockable so they work with std::lock_guard; NoLock compiles
+// away entirely for thread-per-core use.
+
+struct MutexLock
+{
+    void lock() { m.lock(); }
+    void unlock() { m.unlock(); }
+    std::mutex m;
+};
+
+struct SpinLock
+{
+    void lock()
+    {
+        while (flag.test_and_set(std::memory_order_acquire))
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+    }
+    void unlock() { flag.clear(std::memory_order_release); }
+    std::atomic_flag flag = ATOMIC_FLAG_INIT;
+};
+
+struct NoLock
+{
+    void lock() {}
+    void unlock() {}
+};
+
+// ------------------- Adaptive Radix Tree --------------------
+// ART index (Leis et al.) with Node4/16/48/256 and hybrid path
+// compression: up to MAX_PREFIX prefix bytes are stored in the node and
+// longer prefixes are verified against a leaf. Leaves hold only the value;
+// the full key is read back through KeyOf, so each key is stored once.
+
+template <typename V, typename KeyOf>
+class ArtIndex
 {
 public:
-    LRUCache(size_t capacity) : cap(capacity) {}
+    ArtIndex() = default;
+    ArtIndex(const ArtIndex &) = delete;
+    ArtIndex &operator=(const ArtIndex &) = delete;
+    ~ArtIndex() { destroy(root); }
 
-    bool get(const std::string &key, std::string &value)
+    V *find(const std::string &key)
     {
-        std::lock_guard<std::mutex> lock(mtx);
+        Node *n = root;
+        size_t depth = 0;
+        while (n)
+        {
+            if (n->type == LEAF)
+            {
+                Leaf *l = static_cast<Leaf *>(n);
+                return KeyOf()(l->value) == key ? &l->value : nullptr;
+            }
 
-        auto it = map.find(key);
-        if (it == map.end())
-            return false;
+            Inner *in = static_cast<Inner *>(n);
+            if (in->prefix_len)
+            {
+                if (key.size() < depth + in->prefix_len)
+                    return nullptr;
+                // Optimistic: bytes beyond MAX_PREFIX are checked at the leaf
+                size_t stored = std::min<size_t>(in->prefix_len, MAX_PREFIX);
+                for (size_t i = 0; i < stored; i++)
+                    if (in->prefix[i] != (unsigned char)key[depth + i])
+                        return nullptr;
+                depth += in->prefix_len;
+            }
 
-        // Move to front (most recently used)
-        cache.splice(cache.begin(), cache, it->second);
-        value = it->second->second;
+            if (depth == key.size())
+            {
+                Leaf *l = in->terminal;
+                return l && KeyOf()(l->value) == key ? &l->value : nullptr;
+            }
+
+            Node **child = find_child(in, key[depth]);
+            n = child ? *child : nullptr;
+            depth++;
+        }
+        return nullptr;
+    }
+
+    // Inserts or replaces the value stored under key
+    void insert(const std::string &key, V value) { insert(root, key, 0, std::move(value)); }
+
+    bool erase(const std::string &key)
+    {
+        if (!erase(root, key, 0))
+            return false;
+        count--;
         return true;
     }
 
-    void put(const std::string &key, const std::string &value)
+    // Visits every value whose key starts with prefix, in key order,
+    // touching only the subtree under the prefix. f may return bool;
+    // false stops the walk.
+    template <typename F>
+    void for_each_prefix(const std::string &prefix, F f) const
     {
-        std::lock_guard<std::mutex> lock(mtx);
+        const Node *n = root;
+        size_t depth = 0;
+        while (n)
+        {
+            if (n->type == LEAF || depth >= prefix.size())
+                break;
 
-        auto it = map.find(key);
-        if (it != map.end())
+            const Inner *in = static_cast<const Inner *>(n);
+            size_t stored = std::min<size_t>(in->prefix_len, MAX_PREFIX);
+            for (size_t i = 0; i < stored && depth + i < prefix.size(); i++)
+                if (in->prefix[i] != (unsigned char)prefix[depth + i])
+                    return;
+            if (depth + in->prefix_len >= prefix.size())
+                break;
+            depth += in->prefix_len;
+
+            Node *const *child = find_child(const_cast<Inner *>(in), prefix[depth]);
+            n = child ? *child : nullptr;
+            depth++;
+        }
+        if (!n)
+            return;
+
+        // Every key below n shares the path bytes, so one leaf settles
+        // whether the skipped (unstored) prefix bytes match
+        const std::string &k = KeyOf()(minimum(n)->value);
+        if (k.compare(0, prefix.size(), prefix) != 0)
+            return;
+        walk(n, f);
+    }
+
+    template <typename F>
+    void for_each(F f) const
+    {
+        if (root)
+            walk(root, f);
+    }
+
+    size_t size() const { return count; }
+
+    // Approximate heap footprint of the tree nodes (values included)
+    size_t memory_bytes() const
+    {
+        return leaves * sizeof(Leaf) + nodes[0] * sizeof(Node4) + nodes[1] * sizeof(Node16) +
+               nodes[2] * sizeof(Node48) + nodes[3] * sizeof(Node256);
+    }
+
+private:
+    static constexpr uint32_t MAX_PREFIX = 10;
+    enum : uint8_t
+    {
+        LEAF,
+        N4,
+        N16,
+        N48,
+        N256
+    };
+
+    struct Node
+    {
+        uint8_t type;
+    };
+    struct Leaf : Node
+    {
+        V value;
+    };
+    struct Inner : Node
+    {
+        uint16_t children = 0;
+        uint32_t prefix_len = 0;
+        unsigned char prefix[MAX_PREFIX];
+        Leaf *terminal = nullptr; // key that ends exactly at this node
+    };
+    struct Node4 : Inner
+    {
+        unsigned char keys[4];
+        Node *child[4];
+    };
+    struct Node16 : Inner
+    {
+        unsigned char keys[16];
+        Node *child[16];
+    };
+    struct Node48 : Inner
+    {
+        unsigned char index[256]; // slot + 1, 0 = empty
+        Node *child[48];
+    };
+    struct Node256 : Inner
+    {
+        Node *child[256];
+    };
+
+    Leaf *new_leaf(V value)
+    {
+        Leaf *l = new Leaf();
+        l->type = LEAF;
+        l->value = std::move(value);
+        leaves++;
+        count++;
+        return l;
+    }
+
+    template <typename T>
+    T *new_node(uint8_t type)
+    {
+        T *n = new T();
+        n->type = type;
+        nodes[type - N4]++;
+        return n;
+    }
+
+    void release(Node *n)
+    {
+        if (n->type != LEAF)
+            nodes[n->type - N4]--;
+        switch (n->type)
         {
-            // Update existing
-            it->second->second = value;
-            cache.splice(cache.begin(), cache, it->second);
+        case LEAF:
+            leaves--;
+            delete static_cast<Leaf *>(n);
             return;
+        case N4:
+            delete static_cast<Node4 *>(n);
+            break;
+        case N16:
+            delete static_cast<Node16 *>(n);
+            break;
+        case N48:
+            delete static_cast<Node48 *>(n);
+            break;
+        default:
+            delete static_cast<Node256 *>(n);
+            break;
         }
+    }
 
-        // New insert
-        cache.emplace_front(key, value);
-        map[key] = cache.begin();
-
-        if (cache.size() > cap)
+    void destroy(Node *n)
+    {
+        if (!n)
+            return;
+        if (n->type != LEAF)
         {
-            auto last = cache.back().first;
-            cache.pop_back();
-            map.erase(last);
+            Inner *in = static_cast<Inner *>(n);
+            if (in->terminal)
+                destroy(in->terminal);
+            for_each_child(in, [this](unsigned char, Node *c)
+                           { destroy(c); });
         }
+        release(n);
     }
 
-    void remove(const std::string &key)
+    static void copy_header(Inner *dst, const Inner *src)
     {
-        std::lock_guard<std::mutex> lock(mtx);
+        dst->children = src->children;
+        dst->prefix_len = src->prefix_len;
+        std::memcpy(dst->prefix, src->prefix, MAX_PREFIX);
+        dst->terminal = src->terminal;
+    }
 
-        auto it = map.find(key);
-        if (it != map.end())
+    static Node **find_child(Inner *in, char c)
+    {
+        unsigned char b = (unsigned char)c;
+        switch (in->type)
         {
-            cache.erase(it->second);
-            map.erase(it);
+        case N4:
+        {
+            Node4 *n = static_cast<Node4 *>(in);
+            for (int i = 0; i < n->children; i++)
+                if (n->keys[i] == b)
+                    return &n->child[i];
+            return nullptr;
+        }
+        case N16:
+        {
+            Node16 *n = static_cast<Node16 *>(in);
+            // keys are sorted; binary search
+            int lo = 0, hi = n->children;
+            while (lo < hi)
+            {
+                int mid = (lo + hi) / 2;
+                if (n->keys[mid] < b)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            return lo < n->children && n->keys[lo] == b ? &n->child[lo] : nullptr;
+        }
+        case N48:
+        {
+            Node48 *n = static_cast<Node48 *>(in);
+            return n->index[b] ? &n->child[n->index[b] - 1] : nullptr;
+        }
+        default:
+        {
+            Node256 *n = static_cast<Node256 *>(in);
+            return n->child[b] ? &n->child[b] : nullptr;
+        }
         }
     }
 
-private:
-    size_t cap;
-    std::list<std::pair<std::string, std::string>> cache;
-    std::unordered_map<std::string, decltype(cache.begin())> map;
-    std::mutex mtx;
-};
-
-// ------------------- PostgreSQL DB Wrapper --------------------
+    // Calls f(byte, child) in ascending byte order
+    template <typename F>
+    static void for_each_child(const Inner *in, F f)
+    {
+        switch (in->type)
+        {
+        case N4:
+        {
+            const Node4 *n = static_cast<const Node4 *>(in);
+            for (int i = 0; i < n->children; i++)
+                f(n->keys[i], n->child[i]);
+            break;
+        }
+        case N16:
+        {
+            const Node16 *n = static_cast<const Node16 *>(in);
+            for (int i = 0; i < n->children; i++)
+                f(n->keys[i], n->child[i]);
+            break;
+        }
+        case N48:
+        {
+            const Node48 *n = static_cast<const Node48 *>(in);
+            for (int b = 0; b < 256; b++)
+                if (n->index[b])
+                    f((unsigned char)b, n->child[n->index[b] - 1]);
+            break;
+        }
+        default:
+        {
+            const Node256 *n = static_cast<const Node256 *>(in);
+            for (int b = 0; b < 256; b++)
+                if (n->child[b])
+                    f((unsigned char)b, n->child[b]);
+            break;
+        }
+        }
+    }
 
-class Database
-{
-public:
-    std::string connStr;
+    template <typename T>
+    static void insert_sorted(T *n, unsigned char b, Node *child)
+    {
+        int i = n->children;
+        while (i > 0 && n->keys[i - 1] > b)
+        {
+            n->keys[i] = n->keys[i - 1];
+            n->child[i] = n->child[i - 1];
+            i--;
+        }
+        n->keys[i] = b;
+        n->child[i] = child;
+        n->children++;
+    }
 
-    Database(const std::string &str) : connStr(str)
+    void add_child(Node *&ref, unsigned char b, Node *child)
     {
-        // Only use a temporary connection for setup
-        pqxx::connection conn(connStr);
-        pqxx::work w(conn);
-        w.exec("CREATE TABLE IF NOT EXISTS kv(key TEXT PRIMARY KEY, value TEXT)");
-        w.commit();
+        Inner *in = static_cast<Inner *>(ref);
+        switch (in->type)
+        {
+        case N4:
+        {
+            Node4 *n = static_cast<Node4 *>(in);
+            if (n->children < 4)
+            {
+                insert_sorted(n, b, child);
+                return;
+            }
+            Node16 *g = new_node<Node16>(N16);
+            copy_header(g, n);
+            std::memcpy(g->keys, n->keys, 4);
+            std::memcpy(g->child, n->child, 4 * sizeof(Node *));
+            release(n);
+            ref = g;
+            insert_sorted(g, b, child);
+            return;
+        }
+        case N16:
+        {
+            Node16 *n = static_cast<Node16 *>(in);
+            if (n->children < 16)
+            {
+                insert_sorted(n, b, child);
+                return;
+            }
+            Node48 *g = new_node<Node48>(N48);
+            copy_header(g, n);
+            for (int i = 0; i < 16; i++)
+            {
+                g->child[i] = n->child[i];
+                g->index[n->keys[i]] = (unsigned char)(i + 1);
+            }
+            release(n);
+            ref = g;
+            add_child(ref, b, child);
+            return;
+        }
+        case N48:
+        {
+            Node48 *n = static_cast<Node48 *>(in);
+            if (n->children < 48)
+            {
+                int slot = 0;
+                while (n->child[slot])
+                    slot++;
+                n->child[slot] = child;
+                n->index[b] = (unsigned char)(slot + 1);
+                n->children++;
+                return;
+            }
+            Node256 *g = new_node<Node256>(N256);
+            copy_header(g, n);
+            for (int i = 0; i < 256; i++)
+                if (n->index[i])
+                    g->child[i] = n->child[n->index[i] - 1];
+            release(n);
+            ref = g;
+            add_child(ref, b, child);
+            return;
+        }
+        default:
+        {
+            Node256 *n = static_cast<Node256 *>(in);
+            n->child[b] = child;
+            n->children++;
+            return;
+        }
+        }
     }
 
-    void put(const std::string &key, const std::string &value)
+    void remove_child(Node *&ref, unsigned char b)
     {
-        // pqxx::connection conn(connStr); // âœ… New connection per op
-        thread_local pqxx::connection conn(connStr);
-        pqxx::work w(conn);
-        w.exec_params(
-            "INSERT INTO kv(key,value) VALUES($1,$2) "
-            "ON CONFLICT(key) DO UPDATE SET value=EXCLUDED.value",
-            key, value);
-        w.commit();
+        Inner *in = static_cast<Inner *>(ref);
+        switch (in->type)
+        {
+        case N4:
+        case N16:
+        {
+            // Node4 and Node16 share the keys/child layout up to their size
+            unsigned char *keys = in->type == N4 ? static_cast<Node4 *>(in)->keys : static_cast<Node16 *>(in)->keys;
+            Node **child = in->type == N4 ? static_cast<Node4 *>(in)->child : static_cast<Node16 *>(in)->child;
+            int i = 0;
+            while (keys[i] != b)
+                i++;
+            for (; i + 1 < in->children; i++)
+            {
+                keys[i] = keys[i + 1];
+                child[i] = child[i + 1];
+            }
+            in->children--;
+            break;
+        }
+        case N48:
+        {
+            Node48 *n = static_cast<Node48 *>(in);
+            n->child[n->index[b] - 1] = nullptr;
+            n->index[b] = 0;
+            n->children--;
+            break;
+        }
+        default:
+            static_cast<Node256 *>(in)->child[b] = nullptr;
+            in->children--;
+            break;
+        }
+        shrink(ref);
     }
 
-    bool get(const std::string &key, std::string &value)
+    // Moves a node to a smaller type, or collapses it into its only
+    // descendant, once it has few enough children
+    void shrink(Node *&ref)
     {
-        // pqxx::connection conn(connStr); // âœ… New connection per op
-        thread_local pqxx::connection conn(connStr);
-        pqxx::work w(conn);
-        pqxx::result r = w.exec_params("SELECT value FROM kv WHERE key=$1", key);
+        Inner *in = static_cast<Inner *>(ref);
 
-        if (r.empty())
-            return false;
-        value = r[0]["value"].as<std::string>();
-        return true;
+        if (in->children == 0)
+        {
+            ref = in->terminal;
+            release(in);
+            return;
+        }
+
+        if (in->type == N4 && in->children == 1 && !in->terminal)
+        {
+            Node4 *n = static_cast<Node4 *>(in);
+            Node *child = n->child[0];
+            if (child->type != LEAF)
+            {
+                // Concatenate prefixes: ours + edge byte + child's
+                Inner *c = static_cast<Inner *>(child);
+                unsigned char buf[MAX_PREFIX];
+                uint32_t len = std::min<uint32_t>(n->prefix_len, MAX_PREFIX);
+                std::memcpy(buf, n->prefix, len);
+                if (len < MAX_PREFIX)
+                    buf[len++] = n->keys[0];
+                uint32_t rest = std::min<uint32_t>(c->prefix_len, MAX_PREFIX - len);
+                std::memcpy(buf + len, c->prefix, rest);
+                len += rest;
+                std::memcpy(c->prefix, buf, len);
+                c->prefix_len += n->prefix_len + 1;
+            }
+            ref = child;
+            release(n);
+            return;
+        }
+
+        if (in->type == N16 && in->children <= 3)
+        {
+            Node16 *n = static_cast<Node16 *>(in);
+            Node4 *s = new_node<Node4>(N4);
+            copy_header(s, n);
+            std::memcpy(s->keys, n->keys, n->children);
+            std::memcpy(s->child, n->child, n->children * sizeof(Node *));
+            release(n);
+            ref = s;
+        }
+        else if (in->type == N48 && in->children <= 12)
+        {
+            Node48 *n = static_cast<Node48 *>(in);
+            Node16 *s = new_node<Node16>(N16);
+            copy_header(s, n);
+            s->children = 0;
+            for (int b = 0; b < 256; b++)
+                if (n->index[b])
+                    insert_sorted(s, (unsigned char)b, n->child[n->index[b] - 1]);
+            release(n);
+            ref = s;
+        }
+        else if (in->type == N256 && in->children <= 37)
+        {
+            Node256 *n = static_cast<Node256 *>(in);
+            Node48 *s = new_node<Node48>(N48);
+            copy_header(s, n);
+            int slot = 0;
+            for (int b = 0; b < 256; b++)
+                if (n->child[b])
+                {
+                    s->child[slot] = n->child[b];
+                    s->index[b] = (unsigned char)(++slot);
+                }
+            release(n);
+            ref = s;
+        }
     }
 
-    void remove(const std::string &key)
+    static const Leaf *minimum(const Node *n)
     {
-        // pqxx::connection conn(connStr); // âœ… New connection per op
-        thread_local pqxx::connection conn(connStr);
-        pqxx::work w(conn);
-        w.exec_params("DELETE FROM kv WHERE key=$1", key);
-        w.commit();
+        while (n->type != LEAF)
+        {
+            const Inner *in = static_cast<const Inner *>(n);
+            // A key ending here is a prefix of every other key below
+            if (in->terminal)
+                return in->terminal;
+            const Node *first = nullptr;
+            for_each_child(in, [&](unsigned char, Node *c)
+                           { if (!first) first = c; });
+            n = first;
+        }
+        return static_cast<const Leaf *>(n);
     }
-};
 
-// ------------------- MAIN SERVER --------------------
+    // Length of the match between the node's compressed prefix and key
+    size_t prefix_mismatch(const Inner *in, const std::string &key, size_t depth) const
+    {
+        size_t avail = key.size() - depth;
+        size_t max_cmp = std::min<size_t>(std::min<size_t>(in->prefix_len, MAX_PREFIX), avail);
+        size_t i = 0;
+        for (; i < max_cmp; i++)
+            if (in->prefix[i] != (unsigned char)key[depth + i])
+                return i;
 
-int main()
-{
-    Server svr;
+        if (in->prefix_len > MAX_PREFIX)
+        {
+            const std::string &mk = KeyOf()(minimum(in)->value);
+            max_cmp = std::min<size_t>(in->prefix_len, avail);
+            for (; i < max_cmp; i++)
+                if (mk[depth + i] != key[depth + i])
+                    return i;
+        }
+        return i;
+    }
 
-    // Initialize DB + Cache
-    Database db("dbname=kvdb user=kvuser password=kvpass host=127.0.0.1");
-    LRUCache cache(1000);
+    void insert(Node *&ref, const std::string &key, size_t depth, V value)
+    {
+        Node *n = ref;
+        if (!n)
+        {
+            ref = new_leaf(std::move(value));
+            return;
+        }
 
-    // PUT /kv/key
-    svr.Put(R"(^/kv/([^/]+)$)", [&](const Request &req, Response &res)
+        if (n->type == LEAF)
+        {
+            Leaf *l = static_cast<Leaf *>(n);
+            const std::string &lk = KeyOf()(l->value);
+            if (lk == key)
             {
-                std::string key = req.matches[1];
-                std::string value = req.body; // raw value
+                l->value = std::move(value);
+                return;
+            }
 
-                db.put(key, value);
-                cache.put(key, value);
+            // Split the leaf: new Node4 holding the common prefix
+            size_t lcp = 0;
+            while (depth + lcp < key.size() && depth + lcp < lk.size() && key[depth + lcp] == lk[depth + lcp])
+                lcp++;
 
-                res.set_content("PUT OK", "text/plain");
-                // std::cout << "PUT /kv/" << key << " = " << value << std::endl;
-            });
+            Node4 *nn = new_node<Node4>(N4);
+            nn->prefix_len = (uint32_t)lcp;
+            std::memcpy(nn->prefix, key.data() + depth, std::min<size_t>(lcp, MAX_PREFIX));
+            depth += lcp;
 
-    // GET /kv/key
-    svr.Get(R"(^/kv/(.+)$)", [&](const Request &req, Response &res)
-            {
-        std::string key = req.matches[1];
-        std::string value;
+            Node *split = nn;
+            if (lk.size() == depth)
+                nn->terminal = l;
+            else
+                add_child(split, lk[depth], l);
 
-        // Check cache
-        if (cache.get(key, value)) {
-            cache_hits++; 
-            res.set_content("CACHE HIT: " + value, "text/plain");
+            Leaf *nl = new_leaf(std::move(value));
+            if (key.size() == depth)
+                static_cast<Inner *>(split)->terminal = nl;
+            else
+                add_child(split, key[depth], nl);
+            ref = split;
             return;
         }
 
-        cache_misses++; 
-        // Fallback DB
-        if (db.get(key, value)) {
-            cache.put(key, value);
-            res.set_content("DB HIT: " + value, "text/plain");
+        Inner *in = static_cast<Inner *>(n);
+        if (in->prefix_len)
+        {
+            size_t mismatch = prefix_mismatch(in, key, depth);
+            if (mismatch < in->prefix_len)
+            {
+                Node4 *nn = new_node<Node4>(N4);
+                nn->prefix_len = (uint32_t)mismatch;
+                std::memcpy(nn->prefix, in->prefix, std::min<size_t>(mismatch, MAX_PREFIX));
+
+                Node *split = nn;
+                if (in->prefix_len <= MAX_PREFIX)
+                {
+                    add_child(split, in->prefix[mismatch], in);
+                    in->prefix_len -= (uint32_t)(mismatch + 1);
+                    std::memmove(in->prefix, in->prefix + mismatch + 1, std::min<size_t>(in->prefix_len, MAX_PREFIX));
+                }
+                else
+                {
+                    // Recover the unstored prefix bytes from a leaf
+                    const std::string &mk = KeyOf()(minimum(in)->value);
+                    add_child(split, mk[depth + mismatch], in);
+                    in->prefix_len -= (uint32_t)(mismatch + 1);
+                    std::memcpy(in->prefix, mk.data() + depth + mismatch + 1, std::min<size_t>(in->prefix_len, MAX_PREFIX));
+                }
+
+                Leaf *nl = new_leaf(std::move(value));
+                if (key.size() == depth + mismatch)
+                    static_cast<Inner *>(split)->terminal = nl;
+                else
+                    add_child(split, key[depth + mismatch], nl);
+                ref = split;
+                return;
+            }
+            depth += in->prefix_len;
+        }
+
+        if (depth == key.size())
+        {
+            if (in->terminal)
+                in->terminal->value = std::move(value);
+            else
+                in->terminal = new_leaf(std::move(value));
             return;
         }
 
-        res.status = 404;
-        res.set_content("Not found", "text/plain");
-        std::cout << "GET /kv/" << key << std::endl; });
+        Node **child = find_child(in, key[depth]);
+        if (child)
+            insert(*child, key, depth + 1, std::move(value));
+        else
+            add_child(ref, key[depth], new_leaf(std::move(value)));
+    }
 
-    // DELETE /kv/key
-    svr.Delete(R"(^/kv/([^/]+)$)", [&](const Request &req, Response &res)
-               {
-                   std::string key = req.matches[1];
+    bool erase(Node *&ref, const std::string &key, size_t depth)
+    {
+        Node *n = ref;
+        if (!n)
+            return false;
 
-                   db.remove(key);
-                   cache.remove(key);
+        if (n->type == LEAF)
+        {
+            if (KeyOf()(static_cast<Leaf *>(n)->value) != key)
+                return false;
+            release(n);
+            ref = nullptr;
+            return true;
+        }
 
-                   res.set_content("DELETE OK", "text/plain");
-                   std::cout << "DELETE /kv/" << key << std::endl; });
+        Inner *in = static_cast<Inner *>(n);
+        if (in->prefix_len)
+        {
+            if (prefix_mismatch(in, key, depth) != in->prefix_len)
+                return false;
+            depth += in->prefix_len;
+        }
 
-    // GET /stats  -> show cache stats
-    svr.Get("/stats", [&](const Request &req, Response &res)
-            {
-    uint64_t h = cache_hits.load();
-    uint64_t m = cache_misses.load();
-    uint64_t total = h + m;
-    double hit_rate = (total > 0) ? (double(h) * 100.0 / total) : 0.0;
+        if (depth == key.size())
+        {
+            if (!in->terminal || KeyOf()(in->terminal->value) != key)
+                return false;
+            release(in->terminal);
+            in->terminal = nullptr;
+            shrink(ref);
+            return true;
+        }
+
+        Node **child = find_child(in, key[depth]);
+        if (!child || !erase(*child, key, depth + 1))
+            return false;
+        if (!*child)
+            remove_child(ref, (unsigned char)key[depth]);
+        return true;
+    }
+
+    template <typename F>
+    static bool visit(F &f, const V &v)
+    {
+        if constexpr (std::is_void<decltype(f(v))>::value)
+        {
+            f(v);
+            return true;
+        }
+        else
+            return f(v);
+    }
+
+    // false once f asked to stop
+    template <typename F>
+    static bool walk(const Node *n, F &f)
+    {
+        if (n->type == LEAF)
+            return visit(f, static_cast<const Leaf *>(n)->value);
+        const Inner *in = static_cast<const Inner *>(n);
+        if (in->terminal && !visit(f, in->terminal->value))
+            return false;
+        bool go = true;
+        for_each_child(in, [&](unsigned char, Node *c)
+                       { go = go && walk(c, f); });
+        return go;
+    }
+
+    Node *root = nullptr;
+    size_t count = 0;
+    size_t leaves = 0;
+    size_t nodes[4] = {0, 0, 0, 0};
+};
+
+// ------------------- LRU Cache --------------------
+
+enum class EvictionPolicy
+{
+    LRU,
+    // GreedyDual-Size-Frequency: keep the entries that save the most DB
+    // time per byte (priority = L + hits * refill_cost / size)
+    GDSF
+};
+
+enum class CacheIndex
+{
+    Hash,
+    // Adaptive radix tree: stores each key once and supports ordered
+    // prefix scans without walking the whole cache
+    ART
+};
+
+// Cached values are immutable and shared by reference between the cache,
+// queued writes and responses, so a value read off the socket is never
+// copied again on its way into the cache or back out
+using SharedValue = std::shared_ptr<const std::string>;
+
+template <typename Lock = MutexLock, typename Hash = std::hash<std::string>>
+class BasicLRUCache
+{
+public:
+    BasicLRUCache(size_t capacity, size_t maxBytes = 0, EvictionPolicy p = EvictionPolicy::LRU,
+             CacheIndex idx = CacheIndex::Hash)
+        : cap(capacity), max_bytes(maxBytes), policy(p), index(idx) {}
+
+    // Refresh-ahead: a hit on an entry that has been hit at least minHits
+    // times and was loaded more than maxAge ago still returns the cached
+    // value, but asks the caller to reload it in the background.
+    void set_refresh_ahead(std::chrono::milliseconds maxAge, uint32_t minHits)
+    {
+        std::lock_guard<Lock> lock(mtx);
+        refresh_age = maxAge;
+        refresh_min_hits = minHits;
+    }
+
+    // Called with each key the size limits evict, under the cache lock:
+    // fn must not call back into the cache
+    void set_on_evict(std::function<void(const std::string &)> fn)
+    {
+        std::lock_guard<Lock> lock(mtx);
+        on_evict = std::move(fn);
+    }
+
+    // refreshVersion (optional) is set to the entry version when a
+    // background reload should be scheduled, and left untouched otherwise
+    bool get(const std::string &key, std::string &value, uint64_t *refreshVersion = nullptr)
+    {
+        SharedValue v;
+        if (!get(key, v, refreshVersion))
+            return false;
+        value = *v; // outside the lock
+        return true;
+    }
 
-    std::string body =
-        "cache_hits=" + std::to_string(h) + "\n" +
-        "cache_misses=" + std::to_string(m) + "\n" +
-        "hit_rate=" + std::to_string(hit_rate) + "%\n";
+    bool get(const std::string &key, SharedValue &value, uint64_t *refreshVersion = nullptr)
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        ListIt *pos = lookup(key);
+        if (!pos)
+            return false;
+
+        if (is_stale(**pos))
+        {
+            // Its prefix generation was bumped after it was cached
+            erase(*pos);
+            stale_dropped++;
+            return false;
+        }
+
+        // Move to front (most recently used)
+        cache.splice(cache.begin(), cache, *pos);
+        Entry &e = **pos;
+        value = e.value;
+        e.hits++;
+        saved_ms += e.cost_ms;
+        if (policy == EvictionPolicy::GDSF)
+            reprioritize(*pos);
+
+        if (refreshVersion && refresh_age.count() > 0 && e.hits >= refresh_min_hits)
+        {
+            auto now = std::chrono::steady_clock::now();
+            // Re-arm if an earlier request was dropped or failed
+            if (now - e.loaded_at > refresh_age && now - e.refresh_requested > refresh_age)
+            {
+                e.refresh_requested = now;
+                *refreshVersion = e.version;
+            }
+        }
+        return true;
+    }
 
-    res.set_content(body, "text/plain"); });
+    // Current value without touching recency or hit statistics
+    bool peek(const std::string &key, std::string &value)
+    {
+        std::lock_guard<Lock> lock(mtx);
 
-    std::cout << "Server running on http://127.0.0.1:8080\n";
-    svr.listen("0.0.0.0", 8080);
+        ListIt *pos = lookup(key);
+        if (!pos || is_stale(**pos))
+            return false;
+        value = *(*pos)->value;
+        return true;
+    }
+
+    // costMs is how long the value took to fetch from the DB; a negative
+    // cost keeps the entry's previous estimate (or the running average)
+    void put(const std::string &key, const std::string &value, double costMs = -1)
+    {
+        put(key, std::make_shared<const std::string>(value), costMs);
+    }
+
+    void put(const std::string &key, SharedValue value, double costMs = -1)
+    {
+        size_t size = entry_size(key, *value);
+        std::lock_guard<Lock> lock(mtx);
+
+        if (costMs >= 0)
+        {
+            // Exponential moving average used for values we never fetched
+            avg_cost_ms = avg_cost_ms * 0.9 + costMs * 0.1;
+        }
+
+        ListIt *pos = lookup(key);
+        if (pos)
+        {
+            // Update existing
+            Entry &e = **pos;
+            bytes -= e.bytes;
+            e.value = std::move(value);
+            e.bytes = size;
+            bytes += e.bytes;
+            if (costMs >= 0)
+            {
+                resident_cost_ms += costMs - e.cost_ms;
+                e.cost_ms = costMs;
+            }
+            e.version = ++next_version;
+            e.loaded_at = std::chrono::steady_clock::now();
+            tag(e);
+            cache.splice(cache.begin(), cache, *pos);
+            if (policy == EvictionPolicy::GDSF)
+                reprioritize(*pos);
+            evict_if_needed();
+            return;
+        }
+
+        // New insert
+        cache.push_front(Entry{key, std::move(value), ++next_version, std::chrono::steady_clock::now(), {}, 0,
+                               size, costMs >= 0 ? costMs : avg_cost_ms, 0, {}, NO_PREFIX, 0});
+        tag(cache.front());
+        if (index == CacheIndex::ART)
+            art.insert(key, cache.begin());
+        else
+        {
+            auto ins = map.emplace(key, cache.begin()).first;
+            key_bytes += key_heap_bytes(ins->first);
+        }
+        bytes += cache.front().bytes;
+        resident_cost_ms += cache.front().cost_ms;
+        if (policy == EvictionPolicy::GDSF)
+            cache.front().prio_pos = prio.emplace(priority_of(cache.front()), cache.begin());
+
+        evict_if_needed();
+    }
+
+    // Apply a background reload. Ignored if the entry was rewritten or
+    // evicted since the reload was scheduled. value == nullptr means the
+    // key no longer exists in the DB.
+    bool complete_refresh(const std::string &key, uint64_t version, const std::string *value)
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        ListIt *pos = lookup(key);
+        if (!pos || (*pos)->version != version)
+            return false;
+
+        if (!value)
+        {
+            erase(*pos);
+            return true;
+        }
+
+        Entry &e = **pos;
+        bytes -= e.bytes;
+        e.value = std::make_shared<const std::string>(*value);
+        e.bytes = entry_size(key, *value);
+        bytes += e.bytes;
+        e.version = ++next_version;
+        e.loaded_at = std::chrono::steady_clock::now();
+        if (policy == EvictionPolicy::GDSF)
+            reprioritize(*pos);
+        evict_if_needed();
+        return true;
+    }
+
+    void remove(const std::string &key)
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        ListIt *pos = lookup(key);
+        if (pos)
+            erase(*pos);
+    }
+
+    // Registers a prefix for generation-based invalidation. Entries already
+    // cached under it are dropped once; later inserts are tagged with the
+    // prefix generation. Returns the current generation.
+    //
+    // Registered prefixes may nest ("user:" and "user:123:"): each one
+    // links to its longest registered ancestor, and an entry is stale once
+    // any prefix on that chain has been bumped.
+    uint64_t register_prefix(const std::string &prefix)
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        auto it = prefix_ids.find(prefix);
+        if (it != prefix_ids.end())
+            return prefix_gens[it->second];
+
+        // Entries under registered descendants go too, since their chain
+        // changes below
+        std::vector<ListIt> existing;
+        collect_prefix(prefix, existing);
+        for (auto e : existing)
+            erase(e);
+
+        uint32_t id = (uint32_t)prefix_gens.size();
+        uint32_t parent = prefix.empty() ? NO_PREFIX : longest_registered(prefix, prefix.size() - 1);
+        // Descendants whose nearest ancestor was above the new prefix now
+        // hang below it
+        for (auto &p : prefix_ids)
+        {
+            uint32_t &up = prefix_parents[p.second];
+            if (p.first.size() > prefix.size() && p.first.compare(0, prefix.size(), prefix) == 0 &&
+                (up == NO_PREFIX || prefix_names[up].size() < prefix.size()))
+                up = id;
+        }
+        prefix_ids.emplace(prefix, id);
+        prefix_names.push_back(prefix);
+        prefix_gens.push_back(0);
+        prefix_parents.push_back(parent);
+        prefix_lengths.insert(prefix.size());
+        return 0;
+    }
+
+    bool is_registered(const std::string &prefix)
+    {
+        std::lock_guard<Lock> lock(mtx);
+        return prefix_ids.count(prefix) > 0;
+    }
+
+    // O(1) invalidation of every entry under a registered prefix: entries
+    // tagged with an older generation read as misses and are dropped lazily.
+    // Returns false if the prefix is not registered.
+    bool bump_prefix(const std::string &prefix)
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        auto it = prefix_ids.find(prefix);
+        if (it == prefix_ids.end())
+            return false;
+        prefix_gens[it->second]++;
+        prefix_bumps++;
+        return true;
+    }
+
+    // Drops every cached key starting with prefix; returns how many
+    size_t remove_prefix(const std::string &prefix)
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        std::vector<ListIt> victims;
+        collect_prefix(prefix, victims);
+        for (auto it : victims)
+            erase(it);
+        return victims.size();
+    }
+
+    // Appends cached (key, value) pairs under prefix, in key order for the
+    // ART index, stopping after limit entries (0 = no limit)
+    void dump_prefix(const std::string &prefix, std::vector<std::pair<std::string, std::string>> &out, size_t limit = 0)
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        std::vector<ListIt> found;
+        if (index == CacheIndex::ART)
+        {
+            // Key order already: stop the walk once limit entries are found
+            art.for_each_prefix(prefix, [&](ListIt it)
+                                {
+                if (!is_stale(*it))
+                    found.push_back(it);
+                return !limit || found.size() < limit; });
+        }
+        else
+        {
+            // The hash index has no order: scan it all, but keep only the
+            // limit smallest keys (a max-heap on key)
+            auto by_key = [](ListIt a, ListIt b)
+            { return a->key < b->key; };
+            for (auto &kv : map)
+            {
+                if (kv.first.compare(0, prefix.size(), prefix) != 0 || is_stale(*kv.second))
+                    continue;
+                if (limit && found.size() == limit)
+                {
+                    if (!by_key(kv.second, found.front()))
+                        continue;
+                    std::pop_heap(found.begin(), found.end(), by_key);
+                    found.pop_back();
+                }
+                found.push_back(kv.second);
+                std::push_heap(found.begin(), found.end(), by_key);
+            }
+            std::sort_heap(found.begin(), found.end(), by_key);
+        }
+        for (auto it : found)
+            out.emplace_back(it->key, *it->value);
+    }
+
+    // Bytes charged for cached keys and values (what --cache-bytes limits)
+    size_t value_bytes()
+    {
+        std::lock_guard<Lock> lock(mtx);
+        return bytes;
+    }
+
+    size_t index_bytes()
+    {
+        std::lock_guard<Lock> lock(mtx);
+        return index_bytes_locked();
+    }
+
+    std::string stats()
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        size_t index_bytes = index_bytes_locked();
+
+
+        return std::string("cache_policy=") + (policy == EvictionPolicy::GDSF ? "gdsf" : "lru") + "\n" +
+               "cache_entries=" + std::to_string(cache.size()) + "\n" +
+               "cache_bytes=" + std::to_string(bytes) + "\n" +
+               "cache_index=" + (index == CacheIndex::ART ? "art" : "hash") + "\n" +
+               "cache_index_bytes=" + std::to_string(index_bytes) + "\n" +
+               "cache_evictions=" + std::to_string(evictions) + "\n" +
+               "registered_prefixes=" + std::to_string(prefix_gens.size()) + "\n" +
+               "prefix_bumps=" + std::to_string(prefix_bumps) + "\n" +
+               "stale_dropped=" + std::to_string(stale_dropped) + "\n" +
+               "db_time_saved_ms=" + std::to_string(saved_ms) + "\n" +
+               "resident_refill_cost_ms=" + std::to_string(std::max(resident_cost_ms, 0.0)) + "\n" +
+               "avg_refill_cost_ms=" + std::to_string(avg_cost_ms) + "\n";
+    }
+
+private:
+    struct Entry;
+    using ListIt = typename std::list<Entry>::iterator;
+
+    struct Entry
+    {
+        std::string key;
+        SharedValue value;
+        uint64_t version;
+        std::chrono::steady_clock::time_point loaded_at;
+        std::chrono::steady_clock::time_point refresh_requested;
+        uint32_t hits;
+
+        size_t bytes;
+        double cost_ms;
+        double priority;
+        typename std::multimap<double, ListIt>::iterator prio_pos;
+
+        uint32_t prefix_id;   // longest registered prefix covering the key
+        uint64_t prefix_gen;  // its chain_gen when the value was stored
+    };
+
+    static constexpr uint32_t NO_PREFIX = UINT32_MAX;
+
+    // Longest registered prefix of key no longer than max_len
+    uint32_t longest_registered(const std::string &key, size_t max_len) const
+    {
+        for (size_t len : prefix_lengths)
+        {
+            if (len > key.size() || len > max_len)
+                continue;
+            auto it = prefix_ids.find(key.substr(0, len));
+            if (it != prefix_ids.end())
+                return it->second;
+        }
+        return NO_PREFIX;
+    }
+
+    // Sum of generations from a prefix up through its ancestors.
+    // Generations only grow, so the sum changes whenever any of them is
+    // bumped.
+    uint64_t chain_gen(uint32_t id) const
+    {
+        uint64_t gen = 0;
+        for (; id != NO_PREFIX; id = prefix_parents[id])
+            gen += prefix_gens[id];
+        return gen;
+    }
+
+    // Tags an entry with the longest registered prefix of its key
+    void tag(Entry &e)
+    {
+        e.prefix_id = longest_registered(e.key, e.key.size());
+        if (e.prefix_id != NO_PREFIX)
+            e.prefix_gen = chain_gen(e.prefix_id);
+    }
+
+    bool is_stale(const Entry &e) const
+    {
+        return e.prefix_id != NO_PREFIX && chain_gen(e.prefix_id) != e.prefix_gen;
+    }
+
+    struct EntryKey
+    {
+        const std::string &operator()(ListIt it) const { return it->key; }
+    };
+
+    ListIt *lookup(const std::string &key)
+    {
+        if (index == CacheIndex::ART)
+            return art.find(key);
+        auto it = map.find(key);
+        return it == map.end() ? nullptr : &it->second;
+    }
+
+    void collect_prefix(const std::string &prefix, std::vector<ListIt> &out)
+    {
+        if (index == CacheIndex::ART)
+        {
+            art.for_each_prefix(prefix, [&](ListIt it)
+                                { out.push_back(it); });
+            return;
+        }
+        // The hash index has no order, so this is a full scan
+        for (auto &kv : map)
+            if (kv.first.compare(0, prefix.size(), prefix) == 0)
+                out.push_back(kv.second);
+    }
+
+    static size_t entry_size(const std::string &key, const std::string &value)
+    {
+        // Rough per-entry bookkeeping overhead (list node, map bucket)
+        return key.size() + value.size() + 96;
+    }
+
+    double priority_of(Entry &e)
+    {
+        e.priority = inflation + double(e.hits + 1) * e.cost_ms / double(e.bytes);
+        return e.priority;
+    }
+
+    void reprioritize(ListIt it)
+    {
+        prio.erase(it->prio_pos);
+        it->prio_pos = prio.emplace(priority_of(*it), it);
+    }
+
+    void erase(ListIt it)
+    {
+        bytes -= it->bytes;
+        if (policy == EvictionPolicy::GDSF)
+            prio.erase(it->prio_pos);
+        if (index == CacheIndex::ART)
+            art.erase(it->key);
+        else
+        {
+            auto m = map.find(it->key);
+            key_bytes -= key_heap_bytes(m->first);
+            map.erase(m);
+        }
+        resident_cost_ms -= it->cost_ms;
+        cache.erase(it);
+        if (cache.empty())
+            resident_cost_ms = 0; // drop accumulated rounding error
+    }
+
+    size_t index_bytes_locked() const
+    {
+        if (index == CacheIndex::ART)
+            return art.memory_bytes();
+        // Bucket array plus one node per key holding its own key copy
+        return map.bucket_count() * sizeof(void *) +
+               map.size() * (sizeof(typename decltype(map)::value_type) + sizeof(void *)) + key_bytes;
+    }
+
+    // Heap bytes of a key copy beyond the string's inline buffer
+    static size_t key_heap_bytes(const std::string &k)
+    {
+        return k.capacity() > 15 ? k.capacity() + 1 : 0;
+    }
+
+    void evict_if_needed()
+    {
+        // Never evict the entry that was just written
+        while (cache.size() > 1 && (cache.size() > cap || (max_bytes > 0 && bytes > max_bytes)))
+        {
+            ListIt victim = std::prev(cache.end());
+            if (policy == EvictionPolicy::GDSF)
+            {
+                victim = prio.begin()->second;
+                if (victim == cache.begin())
+                    victim = std::next(prio.begin())->second;
+                // Aging: later entries start from the evicted priority
+                inflation = victim->priority;
+            }
+            if (on_evict)
+                on_evict(victim->key);
+            erase(victim);
+            evictions++;
+        }
+    }
+
+    size_t cap;
+    size_t max_bytes;
+    EvictionPolicy policy;
+    CacheIndex index;
+    std::list<Entry> cache;
+    std::unordered_map<std::string, ListIt, Hash> map; // CacheIndex::Hash
+    ArtIndex<ListIt, EntryKey> art;              // CacheIndex::ART
+    std::multimap<double, ListIt> prio; // GDSF only
+    Lock mtx;
+
+    size_t bytes = 0;
+    uint64_t evictions = 0;
+    double inflation = 0;
+    double saved_ms = 0;
+    double avg_cost_ms = 1.0;
+    double resident_cost_ms = 0; // sum of cost_ms over cached entries
+    size_t key_bytes = 0;        // key_heap_bytes of the hash index's keys
+
+    std::unordered_map<std::string, uint32_t> prefix_ids;
+    std::vector<uint64_t> prefix_gens;
+    std::set<size_t, std::greater<size_t>> prefix_lengths; // longest first
+    std::vector<std::string> prefix_names;                 // by prefix id
+    std::vector<uint32_t> prefix_parents;                  // longest registered ancestor
+    uint64_t prefix_bumps = 0;
+    uint64_t stale_dropped = 0;
+
+    uint64_t next_version = 0;
+    std::chrono::milliseconds refresh_age{0};
+    uint32_t refresh_min_hits = 0;
+    std::function<void(const std::string &)> on_evict;
+};
+
+// The server shares one cache across all worker threads
+using LRUCache = BasicLRUCache<>;
+
+// ------------------- Integer-Key Fast Path --------------------
+// Keys of the form <registered prefix><integer> (client.cpp's k<N> and
+// popular_<N>) are parsed once into a 64-bit id and kept in a flat LRU
+// table keyed by that id: no string hashing and no key allocation.
+//
+// The integer path is deliberately bare. Its keys skip the miss batcher,
+// refresh-ahead, the eviction policy (always LRU), the blob tier and
+// prefix generations, and the table holds --cache-size entries of its own
+// outside --cache-bytes. Prefix deletes reach it through IntKeyCodec::under.
+
+class IntKeyCodec
+{
+public:
+    // Top byte of a packed id is the prefix slot, the rest the integer
+    static constexpr uint64_t MAX_ID = (uint64_t(1) << 56) - 1;
+    static constexpr size_t MAX_PREFIXES = 256;
+
+    // dbNamespace is the prefix's id in the kv_int_ns table. A 257th
+    // prefix would wrap to slot 0 and share its ids, so it is refused.
+    void add(const std::string &prefix, int dbNamespace)
+    {
+        if (prefixes.size() >= MAX_PREFIXES)
+            throw std::invalid_argument("more than " + std::to_string(MAX_PREFIXES) + " integer prefixes");
+        for (auto &p : prefixes)
+            if (p.prefix == prefix)
+                throw std::invalid_argument("duplicate integer prefix " + prefix);
+        prefixes.push_back({prefix, dbNamespace});
+        // Longest prefix first so "user_" wins over "u"
+        std::sort(prefixes.begin(), prefixes.end(), [](const Prefix &a, const Prefix &b)
+                  { return a.prefix.size() > b.prefix.size(); });
+    }
+
+    bool empty() const { return prefixes.empty(); }
+
+    // An integer namespace holding keys that start with some string prefix.
+    // digits is what the decimal id must start with ("" = every id).
+    struct Match
+    {
+        uint64_t slot;
+        int db_ns;
+        std::string digits;
+    };
+
+    // Namespaces with keys under prefix: all of "k" for "" or "k", and the
+    // ids starting with 12 for "k12". "k012" or "kx" match no id.
+    std::vector<Match> under(const std::string &prefix) const
+    {
+        std::vector<Match> out;
+        for (size_t slot = 0; slot < prefixes.size(); slot++)
+        {
+            const std::string &p = prefixes[slot].prefix;
+            if (prefix.size() <= p.size())
+            {
+                if (p.compare(0, prefix.size(), prefix) == 0)
+                    out.push_back({slot, prefixes[slot].db_ns, ""});
+                continue;
+            }
+            if (prefix.compare(0, p.size(), p) != 0)
+                continue;
+            std::string digits = prefix.substr(p.size());
+            if (digits.size() > 17 || (digits[0] == '0' && digits.size() > 1) ||
+                digits.find_first_not_of("0123456789") != std::string::npos)
+                continue;
+            out.push_back({slot, prefixes[slot].db_ns, digits});
+        }
+        return out;
+    }
+
+    // The string key a packed id was parsed from
+    std::string key(uint64_t packed) const
+    {
+        return prefixes[packed >> 56].prefix + std::to_string(packed & MAX_ID);
+    }
+
+    static bool has_digits(uint64_t id, const std::string &digits)
+    {
+        return digits.empty() || std::to_string(id).compare(0, digits.size(), digits) == 0;
+    }
+
+    // True if the packed cache key belongs to m
+    static bool matches(uint64_t packed, const Match &m)
+    {
+        return (packed >> 56) == m.slot && has_digits(packed & MAX_ID, m.digits);
+    }
+
+    // Canonical decimal only (no sign, no leading zeros), so every id maps
+    // back to exactly one string key
+    bool parse(const std::string &key, uint64_t &packed, int &dbNamespace, uint64_t &id) const
+    {
+        for (size_t slot = 0; slot < prefixes.size(); slot++)
+        {
+            const std::string &p = prefixes[slot].prefix;
+            if (key.size() <= p.size() || key.size() - p.size() > 17 || key.compare(0, p.size(), p) != 0)
+                continue;
+            size_t n = key.size() - p.size();
+            if (key[p.size()] == '0' && n > 1)
+                continue;
+
+            uint64_t v = 0;
+            size_t i = p.size();
+            for (; i < key.size(); i++)
+            {
+                unsigned d = (unsigned char)key[i] - '0';
+                if (d > 9)
+                    break;
+                v = v * 10 + d;
+            }
+            if (i != key.size() || v > MAX_ID)
+                continue;
+
+            packed = (uint64_t(slot) << 56) | v;
+            dbNamespace = prefixes[slot].db_ns;
+            id = v;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    struct Prefix
+    {
+        std::string prefix;
+        int db_ns;
+    };
+    std::vector<Prefix> prefixes;
+};
+
+// Eviction policies for FlatCache, over its intrusive list of slots
+// (front = newest). touch() runs on every hit and update, victim() picks
+// the slot to recycle when the table is full.
+struct LruEvict
+{
+    template <typename C>
+    static void touch(C &c, uint32_t s)
+    {
+        c.unlink(s);
+        c.push_front(s);
+    }
+    template <typename C>
+    static uint32_t victim(C &c) { return c.tail; }
+};
+
+// Insertion order: hits leave the list alone
+struct FifoEvict
+{
+    template <typename C>
+    static void touch(C &, uint32_t) {}
+    template <typename C>
+    static uint32_t victim(C &c) { return c.tail; }
+};
+
+// CLOCK (second chance): a hit only sets a bit instead of relinking, and
+// the sweep moves referenced slots back to the front with the bit cleared
+struct ClockEvict
+{
+    template <typename C>
+    static void touch(C &c, uint32_t s) { c.slots[s].referenced = true; }
+    template <typename C>
+    static uint32_t victim(C &c)
+    {
+        while (c.slots[c.tail].referenced)
+        {
+            uint32_t s = c.tail;
+            c.slots[s].referenced = false;
+            c.unlink(s);
+            c.push_front(s);
+        }
+        return c.tail;
+    }
+};
+
+// splitmix64 finalizer: integer keys are often dense, and an identity hash
+// would fill neighbouring buckets of the linear-probing table
+struct IntHash
+{
+    size_t operator()(uint64_t x) const
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+};
+
+// Fixed-capacity cache on a flat slot array and a linear-probing table of
+// slot indexes. Keys and values are stored inline in the slots; Hash must
+// spread its output over the low bits.
+template <typename Key, typename Value, typename Evict = LruEvict, typename Lock = MutexLock, typename Hash = IntHash>
+class FlatCache
+{
+    friend Evict;
+
+public:
+    explicit FlatCache(size_t capacity)
+        : slots(std::max<size_t>(capacity, 1))
+    {
+        size_t buckets = 1;
+        while (buckets < slots.size() * 2)
+            buckets <<= 1;
+        table.assign(buckets, EMPTY);
+        mask = buckets - 1;
+
+        // Every slot starts on the free list
+        for (uint32_t i = 0; i < slots.size(); i++)
+            slots[i].next = i + 1 < slots.size() ? i + 1 : NIL;
+        free_head = 0;
+    }
+
+    // Like BasicLRUCache::set_on_evict
+    void set_on_evict(std::function<void(const Key &)> fn)
+    {
+        std::lock_guard<Lock> lock(mtx);
+        on_evict = std::move(fn);
+    }
+
+    bool get(const Key &key, Value &value)
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        size_t b = find(key);
+        if (table[b] == EMPTY)
+            return false;
+        uint32_t s = table[b];
+        Evict::touch(*this, s);
+        value = slots[s].value;
+        return true;
+    }
+
+    bool peek(const Key &key, Value &value)
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        size_t b = find(key);
+        if (table[b] == EMPTY)
+            return false;
+        value = slots[table[b]].value;
+        return true;
+    }
+
+    void put(const Key &key, const Value &value)
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        size_t b = find(key);
+        if (table[b] != EMPTY)
+        {
+            uint32_t s = table[b];
+            slots[s].value = value;
+            Evict::touch(*this, s);
+            return;
+        }
+
+        if (free_head == NIL)
+        {
+            // Full: recycle the policy's victim
+            uint32_t victim = Evict::victim(*this);
+            if (on_evict)
+                on_evict(slots[victim].key);
+            erase_bucket(find(slots[victim].key));
+            unlink(victim);
+            slots[victim].next = free_head;
+            free_head = victim;
+            count--;
+            b = find(key); // erase may have shifted buckets
+        }
+
+        uint32_t s = free_head;
+        free_head = slots[s].next;
+        slots[s].key = key;
+        slots[s].value = value;
+        slots[s].referenced = false;
+        table[b] = s;
+        push_front(s);
+        count++;
+    }
+
+    void remove(const Key &key)
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        size_t b = find(key);
+        if (table[b] != EMPTY)
+            free_slot(b);
+    }
+
+    // Drops every entry whose key satisfies pred. Returns how many.
+    template <typename Pred>
+    size_t remove_if(Pred pred)
+    {
+        std::lock_guard<Lock> lock(mtx);
+
+        size_t n = 0;
+        for (uint32_t s = head; s != NIL;)
+        {
+            uint32_t next = slots[s].next;
+            if (pred(slots[s].key))
+            {
+                free_slot(find(slots[s].key));
+                n++;
+            }
+            s = next;
+        }
+        return n;
+    }
+
+    size_t size()
+    {
+        std::lock_guard<Lock> lock(mtx);
+        return count;
+    }
+
+    // Slot array and table, plus keys and values too long for the string
+    // inline buffer
+    size_t memory_bytes()
+    {
+        std::lock_guard<Lock> lock(mtx);
+        size_t n = slots.capacity() * sizeof(Slot) + table.capacity() * sizeof(uint32_t);
+        for (auto &s : slots)
+            n += heap_bytes(s.key) + heap_bytes(s.value);
+        return n;
+    }
+
+private:
+    static constexpr uint32_t NIL = UINT32_MAX;
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+
+    struct Slot
+    {
+        Key key{};
+        Value value{};
+        uint32_t prev = NIL;
+        uint32_t next = NIL;
+        bool referenced = false; // ClockEvict only
+    };
+
+    static size_t heap_bytes(const std::string &s) { return s.capacity() > 15 ? s.capacity() + 1 : 0; }
+    template <typename T>
+    static size_t heap_bytes(const T &) { return 0; }
+
+    // Bucket holding key, or the empty bucket where it would go
+    size_t find(const Key &key) const
+    {
+        size_t b = hash(key) & mask;
+        while (table[b] != EMPTY && !(slots[table[b]].key == key))
+            b = (b + 1) & mask;
+        return b;
+    }
+
+    // Unlinks the slot in bucket b and returns it to the free list
+    void free_slot(size_t b)
+    {
+        uint32_t s = table[b];
+        erase_bucket(b);
+        unlink(s);
+        // Swap rather than assign so string storage is released too
+        Slot fresh;
+        std::swap(slots[s].key, fresh.key);
+        std::swap(slots[s].value, fresh.value);
+        slots[s].next = free_head;
+        free_head = s;
+        count--;
+    }
+
+    // Linear-probing delete with backward shift (no tombstones)
+    void erase_bucket(size_t b)
+    {
+        size_t hole = b;
+        size_t i = b;
+        while (true)
+        {
+            i = (i + 1) & mask;
+            if (table[i] == EMPTY)
+                break;
+            size_t home = hash(slots[table[i]].key) & mask;
+            // Move i into the hole if its home is not in (hole, i]
+            if (((i - home) & mask) >= ((i - hole) & mask))
+            {
+                table[hole] = table[i];
+                hole = i;
+            }
+        }
+        table[hole] = EMPTY;
+    }
+
+    void unlink(uint32_t s)
+    {
+        Slot &n = slots[s];
+        if (n.prev != NIL)
+            slots[n.prev].next = n.next;
+        else
+            head = n.next;
+        if (n.next != NIL)
+            slots[n.next].prev = n.prev;
+        else
+            tail = n.prev;
+        n.prev = n.next = NIL;
+    }
+
+    void push_front(uint32_t s)
+    {
+        slots[s].prev = NIL;
+        slots[s].next = head;
+        if (head != NIL)
+            slots[head].prev = s;
+        head = s;
+        if (tail == NIL)
+            tail = s;
+    }
+
+    std::vector<Slot> slots;
+    std::vector<uint32_t> table;
+    size_t mask = 0;
+    uint32_t head = NIL;
+    uint32_t tail = NIL;
+    uint32_t free_head = NIL;
+    size_t count = 0;
+    Hash hash;
+    Lock mtx;
+    std::function<void(const Key &)> on_evict;
+};
+
+// The integer fast path's table: packed ids to values, LRU
+template <typename Lock = MutexLock>
+using BasicIntLRUCache = FlatCache<uint64_t, std::string, LruEvict, Lock>;
+
+using IntLRUCache = BasicIntLRUCache<>;
+
+// ------------------- Memory Accounting --------------------
+// Gauges for memory the caches don't already count (request bodies being
+// buffered, pqxx results being decoded), allocator statistics, and
+// returning freed heap to the OS. glibc keeps freed chunks in its arenas,
+// so RSS stays at its peak after an eviction storm until malloc_trim
+// runs; jemalloc (when linked, found through its weak mallctl symbol)
+// decays on its own, and a trim purges all arenas at once.
+
+extern "C" int mallctl(const char *, void *, size_t *, void *, size_t) __attribute__((weak));
+extern "C" void malloc_stats_print(void (*)(void *, const char *), void *, const char *) __attribute__((weak));
+
+struct MemGauge
+{
+    std::atomic<int64_t> bytes{0};
+    std::atomic<int64_t> peak{0};
+
+    void add(int64_t n)
+    {
+        int64_t now = bytes.fetch_add(n, std::memory_order_relaxed) + n;
+        int64_t p = peak.load(std::memory_order_relaxed);
+        while (now > p && !peak.compare_exchange_weak(p, now, std::memory_order_relaxed))
+            ;
+    }
+
+    void sub(int64_t n) { bytes.fetch_sub(n, std::memory_order_relaxed); }
+
+    // One hold per thread, released by the same thread (request bodies:
+    // held from the headers until the response is written); a new hold
+    // replaces one that was never released
+    void hold(size_t n)
+    {
+        release();
+        held() = n;
+        add(int64_t(n));
+    }
+
+    void release()
+    {
+        sub(int64_t(held()));
+        held() = 0;
+    }
+
+private:
+    static size_t &held()
+    {
+        static thread_local size_t n = 0;
+        return n;
+    }
+};
+
+// Charges n bytes to a gauge for the holder's lifetime
+class MemHold
+{
+public:
+    MemHold(MemGauge &g, size_t n) : gauge(g), bytes(int64_t(n)) { gauge.add(bytes); }
+    ~MemHold() { gauge.sub(bytes); }
+    MemHold(const MemHold &) = delete;
+    MemHold &operator=(const MemHold &) = delete;
+
+private:
+    MemGauge &gauge;
+    const int64_t bytes;
+};
+
+MemGauge request_memory;   // Content-Length of requests being handled
+MemGauge db_result_memory; // field bytes of live pqxx results
+
+class MemoryManager
+{
+public:
+    struct Trim
+    {
+        size_t rss_before;
+        size_t rss_after;
+        double ms;
+    };
+
+    // Trims automatically once tracked() (cached bytes) has fallen
+    // trimAfter bytes below its high-water mark since the last trim;
+    // checked once a second, 0 = only on request
+    MemoryManager(size_t trimAfter, std::function<size_t()> tracked)
+        : trim_after(trimAfter), tracked(std::move(tracked))
+    {
+        if (trim_after > 0)
+            watcher = std::thread([this]
+                                  { run(); });
+    }
+
+    ~MemoryManager()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (watcher.joinable())
+            watcher.join();
+    }
+
+    static bool jemalloc() { return mallctl != nullptr; }
+
+    static size_t resident_bytes()
+    {
+        unsigned long long size = 0, resident = 0;
+        if (FILE *f = std::fopen("/proc/self/statm", "r")) {
+            if (std::fscanf(f, "%llu %llu", &size, &resident) != 2)
+                resident = 0;
+            std::fclose(f);
+        }
+        return size_t(resident) * size_t(sysconf(_SC_PAGESIZE));
+    }
+
+    // Returns freed heap to the OS; serialized with the automatic policy
+    Trim trim(bool automatic = false)
+    {
+        std::lock_guard<std::mutex> lk(trim_mtx);
+        Trim t{resident_bytes(), 0, 0};
+        auto t0 = std::chrono::steady_clock::now();
+        if (jemalloc())
+            mallctl("arena.4096.purge", nullptr, nullptr, nullptr, 0); // MALLCTL_ARENAS_ALL
+        else
+            malloc_trim(0);
+        t.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        t.rss_after = resident_bytes();
+
+        (automatic ? auto_trims : manual_trims)++;
+        if (t.rss_before > t.rss_after)
+            released += t.rss_before - t.rss_after;
+        return t;
+    }
+
+    // key=value lines; mallinfo2 walks every arena under its lock, so
+    // this is for /memory rather than /stats
+    std::string allocator_stats() const
+    {
+        std::string out = std::string("allocator=") + (jemalloc() ? "jemalloc" : "glibc") + "\n";
+        if (jemalloc()) {
+            uint64_t epoch = 1;
+            size_t len = sizeof(epoch);
+            mallctl("epoch", &epoch, &len, &epoch, len); // refresh the cached stats
+            for (const char *name : {"allocated", "active", "resident", "mapped", "retained"}) {
+                size_t v = 0;
+                len = sizeof(v);
+                if (mallctl((std::string("stats.") + name).c_str(), &v, &len, nullptr, 0) == 0)
+                    out += std::string("alloc_") + name + "_bytes=" + std::to_string(v) + "\n";
+            }
+            return out;
+        }
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+        struct mallinfo2 mi = mallinfo2();
+        std::string dump = allocator_dump();
+        size_t arenas = 0;
+        for (size_t at = dump.find("<heap nr="); at != std::string::npos; at = dump.find("<heap nr=", at + 1))
+            arenas++;
+        out += "alloc_in_use_bytes=" + std::to_string(mi.uordblks + mi.hblkhd) + "\n" +
+               "alloc_free_bytes=" + std::to_string(mi.fordblks) + "\n" +
+               "alloc_arena_bytes=" + std::to_string(mi.arena) + "\n" +
+               "alloc_mmap_bytes=" + std::to_string(mi.hblkhd) + "\n" +
+               "alloc_releasable_bytes=" + std::to_string(mi.keepcost) + "\n" +
+               "alloc_arenas=" + std::to_string(arenas) + "\n";
+#endif
+        return out;
+    }
+
+    // The allocator's own report: malloc_info XML, or jemalloc's text stats
+    static std::string allocator_dump()
+    {
+        std::string out;
+        if (jemalloc()) {
+            if (malloc_stats_print)
+                malloc_stats_print([](void *o, const char *s)
+                                   { static_cast<std::string *>(o)->append(s); },
+                                   &out, nullptr);
+            return out;
+        }
+        char *buf = nullptr;
+        size_t len = 0;
+        if (FILE *f = open_memstream(&buf, &len)) {
+            malloc_info(0, f);
+            std::fclose(f);
+            out.assign(buf, len);
+        }
+        std::free(buf);
+        return out;
+    }
+
+    std::string stats() const
+    {
+        return "mem_request_bodies_bytes=" + std::to_string(request_memory.bytes.load()) + "\n" +
+               "mem_request_bodies_peak_bytes=" + std::to_string(request_memory.peak.load()) + "\n" +
+               "mem_db_results_bytes=" + std::to_string(db_result_memory.bytes.load()) + "\n" +
+               "mem_db_results_peak_bytes=" + std::to_string(db_result_memory.peak.load()) + "\n" +
+               "mem_trims=" + std::to_string(manual_trims.load()) + "\n" +
+               "mem_auto_trims=" + std::to_string(auto_trims.load()) + "\n" +
+               "mem_trim_released_bytes=" + std::to_string(released.load()) + "\n";
+    }
+
+private:
+    void run()
+    {
+        label_thread("memory");
+        size_t high = tracked();
+        std::unique_lock<std::mutex> lk(mtx);
+        while (!cv.wait_for(lk, std::chrono::seconds(1), [&]
+                            { return stopping; })) {
+            size_t now = tracked();
+            high = std::max(high, now);
+            if (high - now >= trim_after) {
+                lk.unlock();
+                trim(true);
+                lk.lock();
+                high = now;
+            }
+        }
+    }
+
+    const size_t trim_after;
+    const std::function<size_t()> tracked;
+    std::mutex trim_mtx;
+    std::atomic<uint64_t> manual_trims{0};
+    std::atomic<uint64_t> auto_trims{0};
+    std::atomic<uint64_t> released{0};
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread watcher;
+};
+
+// ------------------- PostgreSQL DB Wrapper --------------------
+
+// Thrown without touching Postgres while the circuit breaker is open
+struct DbUnavailable : std::runtime_error
+{
+    DbUnavailable() : std::runtime_error("database unavailable (circuit open)") {}
+};
+
+// A write the backend can't store as given (answered with 400)
+struct InvalidValue : std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+// Trips after consecutive connection failures and fails fast until a
+// cooldown passes; then one probe request is let through (half-open).
+// Each failed probe doubles the cooldown up to a cap.
+class CircuitBreaker
+{
+public:
+    CircuitBreaker(uint32_t threshold, std::chrono::milliseconds baseCooldown, std::chrono::milliseconds maxCooldown)
+        : failure_threshold(threshold), base_cooldown(baseCooldown), max_cooldown(maxCooldown), cooldown(baseCooldown) {}
+
+    // Throws DbUnavailable if the call must not reach the DB
+    void before()
+    {
+        if (state.load(std::memory_order_acquire) == CLOSED)
+            return;
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if (state == OPEN && std::chrono::steady_clock::now() >= open_until)
+        {
+            state = HALF_OPEN;
+            return; // this caller is the probe
+        }
+        if (state != CLOSED)
+        {
+            rejected++;
+            throw DbUnavailable();
+        }
+    }
+
+    void success()
+    {
+        if (state.load(std::memory_order_acquire) == CLOSED && consecutive_failures.load() == 0)
+            return;
+
+        std::lock_guard<std::mutex> lock(mtx);
+        consecutive_failures = 0;
+        cooldown = base_cooldown;
+        state = CLOSED;
+    }
+
+    // Calls that were already in flight when the circuit opened may still
+    // fail afterwards; they must not push the reopen time out or grow the
+    // cooldown, so only a CLOSED->OPEN or HALF_OPEN->OPEN trip arms it
+    void failure()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (state == OPEN)
+            return;
+        consecutive_failures++;
+        if (state == HALF_OPEN || consecutive_failures >= failure_threshold)
+        {
+            trips++;
+            state = OPEN;
+            open_until = std::chrono::steady_clock::now() + cooldown;
+            cooldown = std::min(cooldown * 2, max_cooldown);
+        }
+    }
+
+    std::string stats() const
+    {
+        static const char *names[] = {"closed", "open", "half_open"};
+        return std::string("db_circuit=") + names[state.load()] + "\n" +
+               "db_circuit_trips=" + std::to_string(trips.load()) + "\n" +
+               "db_circuit_rejected=" + std::to_string(rejected.load()) + "\n";
+    }
+
+private:
+    enum State
+    {
+        CLOSED,
+        OPEN,
+        HALF_OPEN
+    };
+
+    const uint32_t failure_threshold;
+    const std::chrono::milliseconds base_cooldown;
+    const std::chrono::milliseconds max_cooldown;
+
+    std::mutex mtx;
+    std::atomic<int> state{CLOSED};
+    std::atomic<uint32_t> consecutive_failures{0};
+    std::chrono::milliseconds cooldown;
+    std::chrono::steady_clock::time_point open_until;
+
+    std::atomic<uint64_t> trips{0};
+    std::atomic<uint64_t> rejected{0};
+};
+
+// Storage calls the server makes; implemented by Postgres (Database) and
+// by the embedded LSM engine (LsmStorage)
+class Storage
+{
+public:
+    virtual ~Storage() = default;
+
+    virtual void put(const std::string &key, const std::string &value) = 0;
+    virtual bool get(const std::string &key, std::string &value) = 0;
+    // Keys not in storage are absent from out
+    virtual void getMany(const std::vector<std::string> &keys,
+                         std::unordered_map<std::string, std::string> &out) = 0;
+    virtual int registerIntPrefix(const std::string &prefix) = 0;
+    virtual void putInt(int ns, uint64_t id, const std::string &value) = 0;
+    virtual bool getInt(int ns, uint64_t id, std::string &value) = 0;
+    virtual void removeInt(int ns, uint64_t id) = 0;
+    // Deletes the ids in ns whose decimal form starts with digits ("" = all)
+    virtual uint64_t removeIntPrefix(int ns, const std::string &digits, size_t batchSize) = 0;
+    virtual uint64_t removePrefix(const std::string &prefix, size_t batchSize) = 0;
+    virtual void remove(const std::string &key) = 0;
+    // Bytes [offset, offset + length) of the value, clipped to its end;
+    // total is the whole value's size. False if the key is missing.
+    virtual bool getRange(const std::string &key, size_t offset, size_t length,
+                          std::string &out, size_t &total) = 0;
+    // Overwrites the value's bytes from offset on (offset == size appends).
+    // False if the key is missing or offset is past the end.
+    virtual bool patch(const std::string &key, size_t offset, const std::string &data, size_t &total) = 0;
+    // Up to limit string keys in [start, end) in byte order (empty end = no
+    // bound, limit 0 = no limit); (start, end) if after is set, for paging
+    virtual void scan(const std::string &start, const std::string &end, size_t limit,
+                      std::vector<std::pair<std::string, std::string>> &out, bool after = false) = 0;
+    virtual std::string stats() = 0;
+};
+
+// Smallest string above every key starting with prefix: prefix with its
+// last byte incremented ("" if there is none, i.e. no upper bound)
+std::string prefix_upper_bound(const std::string &prefix)
+{
+    std::string upper = prefix;
+    while (!upper.empty() && (unsigned char)upper.back() == 0xFF)
+        upper.pop_back();
+    if (!upper.empty())
+        upper.back() = (char)((unsigned char)upper.back() + 1);
+    return upper;
+}
+
+std::string hex_encode(const std::string &bytes)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string out(bytes.size() * 2, '0');
+    for (size_t i = 0; i < bytes.size(); i++)
+    {
+        out[2 * i] = digits[(unsigned char)bytes[i] >> 4];
+        out[2 * i + 1] = digits[(unsigned char)bytes[i] & 15];
+    }
+    return out;
+}
+
+std::string hex_decode(const std::string &hex)
+{
+    auto nibble = [](char c)
+    { return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10; };
+    std::string out(hex.size() / 2, '\0');
+    for (size_t i = 0; i < out.size(); i++)
+        out[i] = char(nibble(hex[2 * i]) << 4 | nibble(hex[2 * i + 1]));
+    return out;
+}
+
+class Database : public Storage
+{
+public:
+    std::string connStr;
+
+    Database(const std::string &str)
+        : connStr(str), breaker(5, std::chrono::milliseconds(250), std::chrono::seconds(10))
+    {
+        // Only use a temporary connection for setup
+        pqxx::connection conn(connStr);
+        pqxx::work w(conn);
+        w.exec("CREATE TABLE IF NOT EXISTS kv(key TEXT PRIMARY KEY, value TEXT)");
+        // Byte-order index so prefix range deletes don't depend on the DB collation
+        w.exec("CREATE INDEX IF NOT EXISTS kv_key_c ON kv (key COLLATE \"C\")");
+        w.commit();
+    }
+
+    void put(const std::string &key, const std::string &value) override
+    {
+        run([&](pqxx::connection &conn)
+            {
+            pqxx::work w(conn);
+            w.exec_params(
+                "INSERT INTO kv(key,value) VALUES($1,$2) "
+                "ON CONFLICT(key) DO UPDATE SET value=EXCLUDED.value",
+                key, pqxx::zview(value)); // passed by reference, not copied
+            w.commit(); });
+    }
+
+    bool get(const std::string &key, std::string &value) override
+    {
+        bool found = false;
+        run([&](pqxx::connection &conn)
+            {
+            pqxx::work w(conn);
+            pqxx::result r = w.exec_params("SELECT value FROM kv WHERE key=$1", key);
+            MemHold held(db_result_memory, result_bytes(r));
+
+            found = !r.empty();
+            if (found)
+                value = r[0]["value"].as<std::string>(); });
+        return found;
+    }
+
+    // Fetch many keys in one round trip; keys not in the table are absent from out
+    void getMany(const std::vector<std::string> &keys,
+                 std::unordered_map<std::string, std::string> &out) override
+    {
+        run([&](pqxx::connection &conn)
+            {
+            pqxx::work w(conn);
+            pqxx::result r = w.exec_params("SELECT key, value FROM kv WHERE key = ANY($1)", keys);
+            MemHold held(db_result_memory, result_bytes(r));
+
+            for (const auto &row : r)
+                out[row["key"].as<std::string>()] = row["value"].as<std::string>(); });
+    }
+
+    // Registers an integer-key prefix, moving any canonical <prefix><int>
+    // rows from kv into kv_int. Returns the prefix's namespace id.
+    int registerIntPrefix(const std::string &prefix) override
+    {
+        pqxx::connection conn(connStr);
+        pqxx::work w(conn);
+        w.exec("CREATE TABLE IF NOT EXISTS kv_int_ns(ns SERIAL PRIMARY KEY, prefix TEXT UNIQUE NOT NULL)");
+        w.exec("CREATE TABLE IF NOT EXISTS kv_int(ns INT NOT NULL, id BIGINT NOT NULL, value TEXT, PRIMARY KEY(ns, id))");
+        w.exec_params("INSERT INTO kv_int_ns(prefix) VALUES($1) ON CONFLICT(prefix) DO NOTHING", prefix);
+        int ns = w.exec_params("SELECT ns FROM kv_int_ns WHERE prefix=$1", prefix)[0][0].as<int>();
+
+        // Same rule as IntKeyCodec::parse: canonical decimal below 2^56
+        auto canonical = [](const std::string &p)
+        {
+            return "starts_with(key, " + p + ") AND substr(key, length(" + p + ") + 1) ~ '^(0|[1-9][0-9]{0,16})$' "
+                   "AND substr(key, length(" + p + ") + 1)::numeric < 72057594037927936";
+        };
+        w.exec_params("INSERT INTO kv_int(ns, id, value) "
+                      "SELECT $1, substr(key, length($2) + 1)::bigint, value FROM kv WHERE " +
+                          canonical("$2") + " ON CONFLICT(ns, id) DO NOTHING",
+                      ns, prefix);
+        w.exec_params("DELETE FROM kv WHERE " + canonical("$1"), prefix);
+        w.commit();
+        return ns;
+    }
+
+    void putInt(int ns, uint64_t id, const std::string &value) override
+    {
+        run([&](pqxx::connection &conn)
+            {
+            pqxx::work w(conn);
+            w.exec_params(
+                "INSERT INTO kv_int(ns,id,value) VALUES($1,$2,$3) "
+                "ON CONFLICT(ns,id) DO UPDATE SET value=EXCLUDED.value",
+                ns, (int64_t)id, value);
+            w.commit(); });
+    }
+
+    bool getInt(int ns, uint64_t id, std::string &value) override
+    {
+        bool found = false;
+        run([&](pqxx::connection &conn)
+            {
+            pqxx::work w(conn);
+            pqxx::result r = w.exec_params("SELECT value FROM kv_int WHERE ns=$1 AND id=$2", ns, (int64_t)id);
+            MemHold held(db_result_memory, result_bytes(r));
+
+            found = !r.empty();
+            if (found)
+                value = r[0]["value"].as<std::string>(); });
+        return found;
+    }
+
+    void removeInt(int ns, uint64_t id) override
+    {
+        run([&](pqxx::connection &conn)
+            {
+            pqxx::work w(conn);
+            w.exec_params("DELETE FROM kv_int WHERE ns=$1 AND id=$2", ns, (int64_t)id);
+            w.commit(); });
+    }
+
+    // Batched like removePrefix; digits holds only [0-9] so it needs no
+    // LIKE escaping
+    uint64_t removeIntPrefix(int ns, const std::string &digits, size_t batchSize) override
+    {
+        uint64_t total = 0;
+        while (true)
+        {
+            size_t affected = 0;
+            run([&](pqxx::connection &conn)
+                {
+                pqxx::work w(conn);
+                pqxx::result r = w.exec_params(
+                    "DELETE FROM kv_int WHERE ns=$1 AND id IN (SELECT id FROM kv_int "
+                    "WHERE ns=$1 AND id::text LIKE $2 LIMIT $3)",
+                    ns, digits + "%", batchSize);
+                w.commit();
+                affected = r.affected_rows(); });
+            total += affected;
+            if (affected < batchSize)
+                return total;
+        }
+    }
+
+    // Deletes every key starting with prefix, batchSize rows per transaction
+    // so a large range never holds row locks for long. Returns rows deleted.
+    uint64_t removePrefix(const std::string &prefix, size_t batchSize) override
+    {
+        std::string upper = prefix_upper_bound(prefix);
+
+        uint64_t total = 0;
+        while (true)
+        {
+            size_t affected = 0;
+            run([&](pqxx::connection &conn)
+                {
+                pqxx::work w(conn);
+                pqxx::result r = upper.empty()
+                                     ? w.exec_params(
+                                           "DELETE FROM kv WHERE key IN (SELECT key FROM kv "
+                                           "WHERE key COLLATE \"C\" >= $1 LIMIT $2)",
+                                           prefix, batchSize)
+                                     : w.exec_params(
+                                           "DELETE FROM kv WHERE key IN (SELECT key FROM kv "
+                                           "WHERE key COLLATE \"C\" >= $1 AND key COLLATE \"C\" < $2 LIMIT $3)",
+                                           prefix, upper, batchSize);
+                w.commit();
+                affected = r.affected_rows(); });
+            total += affected;
+            if (affected < batchSize)
+                return total;
+        }
+    }
+
+    void remove(const std::string &key) override
+    {
+        run([&](pqxx::connection &conn)
+            {
+            pqxx::work w(conn);
+            w.exec_params("DELETE FROM kv WHERE key=$1", key);
+            w.commit(); });
+    }
+
+    // Only the slice crosses the wire (hex, since TEXT substrings count
+    // characters, not bytes)
+    bool getRange(const std::string &key, size_t offset, size_t length,
+                  std::string &out, size_t &total) override
+    {
+        bool found = false;
+        run([&](pqxx::connection &conn)
+            {
+            pqxx::work w(conn);
+            pqxx::result r = w.exec_params(
+                "SELECT octet_length(value), encode(substring(convert_to(value, 'UTF8') FROM $2 FOR $3), 'hex') "
+                "FROM kv WHERE key=$1",
+                key, (int64_t)offset + 1, (int64_t)length);
+            MemHold held(db_result_memory, result_bytes(r));
+
+            found = !r.empty();
+            if (found) {
+                total = r[0][0].as<size_t>();
+                out = hex_decode(r[0][1].as<std::string>());
+            } });
+        return found;
+    }
+
+    // value is TEXT, so the patched bytes must still be valid UTF-8; a
+    // patch that splits a character throws InvalidValue and changes nothing
+    bool patch(const std::string &key, size_t offset, const std::string &data, size_t &total) override
+    {
+        bool found = false;
+        bool invalid = false;
+        run([&](pqxx::connection &conn)
+            {
+            pqxx::work w(conn);
+            pqxx::result r;
+            try {
+                r = w.exec_params(
+                    "UPDATE kv SET value = convert_from(overlay(convert_to(value, 'UTF8') "
+                    "PLACING decode($2, 'hex') FROM $3 FOR $4), 'UTF8') "
+                    "WHERE key=$1 AND octet_length(value) >= $3 - 1 RETURNING octet_length(value)",
+                    key, hex_encode(data), (int64_t)offset + 1, (int64_t)data.size());
+            } catch (const pqxx::data_exception &) {
+                invalid = true; // rolled back with w
+                return;
+            }
+            w.commit();
+
+            found = !r.empty();
+            if (found)
+                total = r[0][0].as<size_t>(); });
+        if (invalid)
+            throw InvalidValue("Patch would leave the value invalid UTF-8");
+        return found;
+    }
+
+    void scan(const std::string &start, const std::string &end, size_t limit,
+              std::vector<std::pair<std::string, std::string>> &out, bool after = false) override
+    {
+        run([&](pqxx::connection &conn)
+            {
+            pqxx::work w(conn);
+            // LIMIT 0 would return no rows; 0 means no limit here, as in kvlsm
+            std::string bound = limit ? " LIMIT " + std::to_string(limit) : std::string();
+            // Paging can't append '\0' to the last key: libpq parameters are
+            // C strings, so the bound is made strict instead
+            std::string from = after ? "SELECT key, value FROM kv WHERE key COLLATE \"C\" > $1 "
+                                     : "SELECT key, value FROM kv WHERE key COLLATE \"C\" >= $1 ";
+            pqxx::result r = end.empty()
+                                 ? w.exec_params(from + "ORDER BY key COLLATE \"C\"" + bound, start)
+                                 : w.exec_params(from + "AND key COLLATE \"C\" < $2 ORDER BY key COLLATE \"C\"" + bound,
+                                                 start, end);
+            MemHold held(db_result_memory, result_bytes(r));
+            out.clear();
+            for (const auto &row : r)
+                out.emplace_back(row["key"].as<std::string>(), row["value"].as<std::string>()); });
+    }
+
+    std::string stats() override
+    {
+        return breaker.stats() +
+               "db_reconnects=" + std::to_string(reconnects.load()) + "\n" +
+               "db_connection_failures=" + std::to_string(connection_failures.load()) + "\n";
+    }
+
+private:
+    // Field bytes of a result (libpq keeps them in one block per result)
+    static size_t result_bytes(const pqxx::result &r)
+    {
+        size_t n = 0;
+        for (const auto &row : r)
+            for (const auto &f : row)
+                n += f.size();
+        return n;
+    }
+
+    // Per-thread connection, reopened after it breaks
+    static std::unique_ptr<pqxx::connection> &thread_conn()
+    {
+        thread_local std::unique_ptr<pqxx::connection> conn;
+        return conn;
+    }
+
+    // Runs op on this thread's connection. A broken connection is dropped
+    // and op retried once on a fresh one (all ops here are idempotent);
+    // connection failures feed the circuit breaker, which fails fast
+    // with DbUnavailable while Postgres is down.
+    void run(const std::function<void(pqxx::connection &)> &op)
+    {
+        breaker.before();
+        for (int attempt = 0;; attempt++)
+        {
+            auto &conn = thread_conn();
+            try
+            {
+                if (!conn || !conn->is_open())
+                {
+                    if (conn)
+                        reconnects++;
+                    conn.reset(new pqxx::connection(connStr));
+                }
+                op(*conn);
+                breaker.success();
+                return;
+            }
+            catch (const pqxx::broken_connection &)
+            {
+                conn.reset();
+                connection_failures++;
+                if (attempt == 0)
+                    continue;
+                breaker.failure();
+                throw;
+            }
+            catch (...)
+            {
+                // The DB answered (e.g. an SQL error), so it is reachable
+                breaker.success();
+                throw;
+            }
+        }
+    }
+
+    CircuitBreaker breaker;
+    std::atomic<uint64_t> reconnects{0};
+    std::atomic<uint64_t> connection_failures{0};
+};
+
+// ------------------- LSM Storage --------------------
+// Storage on the embedded LSM engine (kvlsm.h), for write-heavy setups that
+// don't need Postgres. Keys are tagged so the kinds sort apart:
+//   's' + key                       string keys
+//   'i' + ns + id (big-endian)      integer keys, ordered by id
+//   'n' + prefix -> ns              registered integer prefixes
+
+class LsmStorage : public Storage
+{
+public:
+    LsmStorage(const std::string &dir, const kvlsm::Options &opts) : lsm(dir, opts) {}
+
+    void put(const std::string &key, const std::string &value) override { lsm.put("s" + key, value); }
+    bool get(const std::string &key, std::string &value) override { return lsm.get("s" + key, value); }
+
+    void getMany(const std::vector<std::string> &keys,
+                 std::unordered_map<std::string, std::string> &out) override
+    {
+        std::string value;
+        for (auto &k : keys)
+            if (lsm.get("s" + k, value))
+                out[k] = value;
+    }
+
+    // Moves canonical <prefix><int> string keys under the integer encoding,
+    // like Database::registerIntPrefix does for the kv_int table
+    int registerIntPrefix(const std::string &prefix) override
+    {
+        std::lock_guard<std::mutex> lock(ns_mtx);
+        std::string v;
+        int ns;
+        if (lsm.get("n" + prefix, v))
+            ns = std::stoi(v);
+        else
+        {
+            ns = lsm.get("N", v) ? std::stoi(v) + 1 : 1;
+            lsm.put("N", std::to_string(ns));
+            lsm.put("n" + prefix, std::to_string(ns));
+        }
+
+        IntKeyCodec codec;
+        codec.add(prefix, ns);
+        std::vector<std::pair<std::string, std::string>> rows;
+        lsm.scan("s" + prefix, "s" + prefix_upper_bound(prefix), 0, [&](const std::string &k, const std::string &value)
+                 {
+            rows.emplace_back(k.substr(1), value);
+            return true; });
+        for (auto &r : rows)
+        {
+            uint64_t packed, id;
+            int rowNs;
+            if (!codec.parse(r.first, packed, rowNs, id))
+                continue;
+            std::string existing;
+            if (!lsm.get(int_key(ns, id), existing))
+                lsm.put(int_key(ns, id), r.second);
+            lsm.del("s" + r.first);
+        }
+        return ns;
+    }
+
+    void putInt(int ns, uint64_t id, const std::string &value) override { lsm.put(int_key(ns, id), value); }
+    bool getInt(int ns, uint64_t id, std::string &value) override { return lsm.get(int_key(ns, id), value); }
+    void removeInt(int ns, uint64_t id) override { lsm.del(int_key(ns, id)); }
+
+    // Walks the namespace batchSize keys at a time; ids that don't match
+    // stay behind, so each batch starts just past the last key seen
+    uint64_t removeIntPrefix(int ns, const std::string &digits, size_t batchSize) override
+    {
+        std::string start = int_key(ns, 0);
+        std::string end = prefix_upper_bound(start.substr(0, 5));
+        if (end.empty())
+            end = "j";
+        uint64_t total = 0;
+        while (true)
+        {
+            std::vector<std::string> doomed;
+            size_t seen = 0;
+            lsm.scan(start, end, batchSize, [&](const std::string &k, const std::string &)
+                     {
+                seen++;
+                start = k;
+                uint64_t id = 0;
+                for (int i = 0; i < 8; i++)
+                    id = (id << 8) | (unsigned char)k[5 + i];
+                if (IntKeyCodec::has_digits(id, digits))
+                    doomed.push_back(k);
+                return true; });
+            for (auto &k : doomed)
+                lsm.del(k);
+            total += doomed.size();
+            if (seen < batchSize)
+                return total;
+            start.push_back('\0');
+        }
+    }
+
+    uint64_t removePrefix(const std::string &prefix, size_t batchSize) override
+    {
+        std::string upper = prefix_upper_bound(prefix);
+        uint64_t total = 0;
+        while (true)
+        {
+            std::vector<std::pair<std::string, std::string>> rows;
+            scan(prefix, upper, batchSize, rows);
+            for (auto &r : rows)
+                lsm.del("s" + r.first);
+            total += rows.size();
+            if (rows.size() < batchSize)
+                return total;
+        }
+    }
+
+    void remove(const std::string &key) override { lsm.del("s" + key); }
+
+    // Values are stored whole, so these read (and rewrite) the full value
+    bool getRange(const std::string &key, size_t offset, size_t length,
+                  std::string &out, size_t &total) override
+    {
+        std::string value;
+        if (!lsm.get("s" + key, value))
+            return false;
+        total = value.size();
+        out = offset < value.size() ? value.substr(offset, length) : std::string();
+        return true;
+    }
+
+    bool patch(const std::string &key, size_t offset, const std::string &data, size_t &total) override
+    {
+        std::lock_guard<std::mutex> lock(patch_mtx);
+        std::string value;
+        if (!lsm.get("s" + key, value) || offset > value.size())
+            return false;
+        value.replace(offset, data.size(), data);
+        lsm.put("s" + key, value);
+        total = value.size();
+        return true;
+    }
+
+    void scan(const std::string &start, const std::string &end, size_t limit,
+              std::vector<std::pair<std::string, std::string>> &out, bool after = false) override
+    {
+        out.clear();
+        // "t" is just past every 's' key; kvlsm keys may hold '\0', so
+        // key + '\0' is the first key after it
+        std::string from = "s" + start;
+        if (after)
+            from.push_back('\0');
+        lsm.scan(from, end.empty() ? "t" : "s" + end, limit, [&](const std::string &k, const std::string &value)
+                 {
+            out.emplace_back(k.substr(1), value);
+            return true; });
+    }
+
+    std::string stats() override { return lsm.stats(); }
+
+private:
+    static std::string int_key(int ns, uint64_t id)
+    {
+        std::string k(13, 'i');
+        for (int i = 0; i < 4; i++)
+            k[1 + i] = char(uint32_t(ns) >> (24 - 8 * i));
+        for (int i = 0; i < 8; i++)
+            k[5 + i] = char(id >> (56 - 8 * i));
+        return k;
+    }
+
+    kvlsm::DB lsm;
+    std::mutex ns_mtx;
+    std::mutex patch_mtx;
+};
+
+// ------------------- Miss Batcher --------------------
+// Collects cache misses from all workers for a short window and resolves
+// them with a single SELECT ... WHERE key = ANY($1) of at most maxBatch
+// keys. flushers threads each run one batch at a time (each with its own
+// DB connection), so a slow query doesn't hold up every other miss.
+
+class MissBatcher
+{
+public:
+    MissBatcher(Storage &d, std::chrono::microseconds w, size_t maxBatch, size_t flushers)
+        : db(d), window(w), max_batch(std::max<size_t>(maxBatch, 1))
+    {
+        for (size_t i = 0; i < std::max<size_t>(flushers, 1); i++)
+            this->flushers.emplace_back([this]
+                                        { run(); });
+    }
+
+    ~MissBatcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &t : flushers)
+            t.join();
+    }
+
+    // Blocks until the batch containing this key has been fetched.
+    // query_ms gets the batch query's own duration, without the time
+    // spent waiting for the batch to fill, for cost-aware eviction.
+    bool get(const std::string &key, std::string &value, double *query_ms = nullptr)
+    {
+        auto w = std::make_shared<Waiter>();
+        w->key = key;
+        w->enqueued = std::chrono::steady_clock::now();
+        auto fut = w->result.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            pending.push_back(w);
+        }
+        cv.notify_one();
+
+        Result r = fut.get(); // rethrows DB errors
+        if (query_ms)
+            *query_ms = r.query_ms;
+        if (!r.found)
+            return false;
+        value = std::move(r.value);
+        return true;
+    }
+
+    std::string stats() const
+    {
+        uint64_t b = batches.load();
+        uint64_t k = batched_keys.load();
+        double avg = b > 0 ? double(k) / b : 0.0;
+        double avg_wait_us = k > 0 ? double(queue_wait_ns.load()) / k / 1000.0 : 0.0;
+        return "miss_batches=" + std::to_string(b) + "\n" +
+               "miss_batched_keys=" + std::to_string(k) + "\n" +
+               "miss_batch_avg=" + std::to_string(avg) + "\n" +
+               "miss_batch_max=" + std::to_string(max_seen.load()) + "\n" +
+               "miss_batch_avg_wait_us=" + std::to_string(avg_wait_us) + "\n";
+    }
+
+private:
+    struct Result
+    {
+        bool found;
+        std::string value;
+        double query_ms;
+    };
+
+    struct Waiter
+    {
+        std::string key;
+        std::chrono::steady_clock::time_point enqueued;
+        std::promise<Result> result;
+    };
+
+    void run()
+    {
+        label_thread("batcher");
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true)
+        {
+            cv.wait(lock, [this]
+                    { return stopping || !pending.empty(); });
+            if (pending.empty())
+                return; // stopping
+
+            // Give other workers a chance to join this batch
+            auto deadline = pending.front()->enqueued + window;
+            cv.wait_until(lock, deadline, [this]
+                          { return stopping || pending.size() >= max_batch; });
+            if (pending.empty())
+                continue; // another flusher took it
+
+            size_t n = std::min(max_batch, pending.size());
+            std::vector<std::shared_ptr<Waiter>> batch(pending.begin(), pending.begin() + n);
+            pending.erase(pending.begin(), pending.begin() + n);
+            if (!pending.empty())
+                cv.notify_one(); // the rest starts its own batch
+            lock.unlock();
+            flush(batch);
+            lock.lock();
+        }
+    }
+
+    void flush(std::vector<std::shared_ptr<Waiter>> &batch)
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::string> keys;
+        keys.reserve(batch.size());
+        for (auto &w : batch)
+        {
+            keys.push_back(w->key);
+            queue_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(start - w->enqueued).count();
+        }
+
+        batches++;
+        batched_keys += batch.size();
+        uint64_t prev = max_seen.load();
+        while (batch.size() > prev && !max_seen.compare_exchange_weak(prev, batch.size()))
+            ;
+
+        std::unordered_map<std::string, std::string> found;
+        try
+        {
+            db.getMany(keys, found);
+        }
+        catch (...)
+        {
+            for (auto &w : batch)
+                w->result.set_exception(std::current_exception());
+            return;
+        }
+        double query_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        // Duplicate keys in one batch all get a copy of the same row
+        for (auto &w : batch)
+        {
+            auto it = found.find(w->key);
+            if (it == found.end())
+                w->result.set_value({false, std::string(), query_ms});
+            else
+                w->result.set_value({true, it->second, query_ms});
+        }
+    }
+
+    Storage &db;
+    std::chrono::microseconds window;
+    size_t max_batch;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<Waiter>> pending;
+    bool stopping = false;
+
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> batched_keys{0};
+    std::atomic<uint64_t> max_seen{0};
+    std::atomic<uint64_t> queue_wait_ns{0};
+
+    std::vector<std::thread> flushers; // declared last; started in the constructor body
+};
+
+// ------------------- Refresh-Ahead --------------------
+// Reloads hot cache entries from Postgres in the background so that
+// readers keep getting the cached value instead of paying a miss.
+
+class Refresher
+{
+public:
+    Refresher(Storage &d, LRUCache &c, size_t maxQueue)
+        : db(d), cache(c), max_queue(maxQueue), worker([this]
+                                                      { run(); }) {}
+
+    ~Refresher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_one();
+        worker.join();
+    }
+
+    void schedule(const std::string &key, uint64_t version)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (queue.size() >= max_queue)
+            {
+                // The cache re-arms the entry after another refresh interval
+                dropped++;
+                return;
+            }
+            queue.emplace_back(key, version);
+        }
+        scheduled++;
+        cv.notify_one();
+    }
+
+    // Called after a reload changed (or dropped) a cached entry
+    std::function<void(const std::string &)> on_applied;
+
+    std::string stats() const
+    {
+        return "refresh_scheduled=" + std::to_string(scheduled.load()) + "\n" +
+               "refresh_applied=" + std::to_string(applied.load()) + "\n" +
+               "refresh_superseded=" + std::to_string(superseded.load()) + "\n" +
+               "refresh_dropped=" + std::to_string(dropped.load()) + "\n" +
+               "refresh_errors=" + std::to_string(errors.load()) + "\n";
+    }
+
+private:
+    void run()
+    {
+        label_thread("refresher");
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true)
+        {
+            cv.wait(lock, [this]
+                    { return stopping || !queue.empty(); });
+            if (stopping)
+                return;
+
+            std::vector<std::pair<std::string, uint64_t>> batch;
+            batch.swap(queue);
+            lock.unlock();
+            reload(batch);
+            lock.lock();
+        }
+    }
+
+    void reload(const std::vector<std::pair<std::string, uint64_t>> &batch)
+    {
+        std::vector<std::string> keys;
+        keys.reserve(batch.size());
+        for (auto &kv : batch)
+            keys.push_back(kv.first);
+
+        std::unordered_map<std::string, std::string> found;
+        try
+        {
+            db.getMany(keys, found);
+        }
+        catch (const DbUnavailable &)
+        {
+            // Keep serving the cached values until the DB is back
+            errors++;
+            return;
+        }
+        catch (const std::exception &e)
+        {
+            errors++;
+            std::cerr << "refresh-ahead reload failed: " << e.what() << std::endl;
+            return;
+        }
+
+        for (auto &kv : batch)
+        {
+            auto it = found.find(kv.first);
+            const std::string *value = it == found.end() ? nullptr : &it->second;
+            if (cache.complete_refresh(kv.first, kv.second, value))
+            {
+                applied++;
+                if (on_applied)
+                    on_applied(kv.first);
+            }
+            else
+                superseded++;
+        }
+    }
+
+    Storage &db;
+    LRUCache &cache;
+    size_t max_queue;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<std::pair<std::string, uint64_t>> queue;
+    bool stopping = false;
+
+    std::atomic<uint64_t> scheduled{0};
+    std::atomic<uint64_t> applied{0};
+    std::atomic<uint64_t> superseded{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> errors{0};
+
+    std::thread worker;
+};
+
+// ------------------- Write Coalescing --------------------
+// PUTs to a key that already has a write in flight are merged: the first
+// of them waits for the in-flight write and then commits the latest value
+// (last writer wins); everyone in the merged batch is acknowledged on that
+// commit.
+
+class WriteCoalescer
+{
+public:
+    // write runs with no other write to the same key in flight, so the
+    // DB commit and cache update it performs are ordered per key
+    void put(const std::string &key, SharedValue value,
+             const std::function<void(const SharedValue &)> &write)
+    {
+        puts++;
+        std::unique_lock<std::mutex> lock(mtx);
+        KeyState &st = keys[key]; // element references survive rehashing
+
+        if (st.next)
+        {
+            // Join the batch waiting behind the in-flight write
+            st.next->value = std::move(value);
+            auto done = st.next->done;
+            lock.unlock();
+            coalesced++;
+            done.get(); // rethrows the leader's DB error
+            return;
+        }
+
+        auto batch = std::make_shared<Batch>();
+        batch->value = std::move(value);
+        batch->done = batch->promise.get_future().share();
+        st.next = batch;
+
+        cv.wait(lock, [&]
+                { return !st.in_flight; });
+        st.next = nullptr;
+        st.in_flight = true;
+        SharedValue latest = std::move(batch->value);
+        lock.unlock();
+
+        std::exception_ptr err;
+        try
+        {
+            write(latest);
+            db_writes++;
+        }
+        catch (...)
+        {
+            err = std::current_exception();
+        }
+
+        lock.lock();
+        st.in_flight = false;
+        if (!st.next)
+            keys.erase(key);
+        lock.unlock();
+        cv.notify_all();
+
+        if (err)
+        {
+            batch->promise.set_exception(err);
+            std::rethrow_exception(err);
+        }
+        batch->promise.set_value();
+    }
+
+    std::string stats() const
+    {
+        uint64_t p = puts.load();
+        uint64_t w = db_writes.load();
+        return "coalesce_puts=" + std::to_string(p) + "\n" +
+               "coalesce_merged=" + std::to_string(coalesced.load()) + "\n" +
+               "coalesce_db_writes=" + std::to_string(w) + "\n" +
+               "coalesce_ratio=" + std::to_string(w > 0 ? double(p) / w : 0.0) + "\n";
+    }
+
+private:
+    struct Batch
+    {
+        SharedValue value;
+        std::promise<void> promise;
+        std::shared_future<void> done;
+    };
+
+    struct KeyState
+    {
+        bool in_flight = false;
+        std::shared_ptr<Batch> next; // writers queued behind the in-flight one
+    };
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::unordered_map<std::string, KeyState> keys;
+
+    std::atomic<uint64_t> puts{0};
+    std::atomic<uint64_t> coalesced{0};
+    std::atomic<uint64_t> db_writes{0};
+};
+
+// ------------------- Shared-Memory Read Path --------------------
+// Publishes keys that are hit in the cache into a kvshm::Table so local
+// processes can read them without a round trip. Any change to a key, or
+// its eviction from the cache, only erases it from the table; the next
+// HTTP hit republishes the new value. Readers skip entries older than
+// maxAgeMs, so a key read only through shm still comes back over HTTP
+// (where refresh-ahead sees it) that often.
+
+class ShmPublisher
+{
+public:
+    bool open(const std::string &name, uint32_t buckets, uint32_t keyMax, uint32_t valueMax,
+              uint32_t maxAgeMs, mode_t mode)
+    {
+        return table.create(name, buckets, keyMax, valueMax, maxAgeMs, mode);
+    }
+
+    // current re-reads the authoritative cached value under the publish
+    // lock, so a hit that raced with a PUT can't publish the old value
+    void on_hit(const std::string &key, const std::string &value,
+                const std::function<bool(std::string &)> &current)
+    {
+        std::string published;
+        if (table.get(key, published) && published == value)
+        {
+            if (has_evicted.load(std::memory_order_relaxed))
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                drain_evicted();
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mtx);
+        drain_evicted();
+        std::string now;
+        if (!current(now))
+            return;
+        if (table.put(key, now))
+            publishes++;
+        else
+            too_large++;
+    }
+
+    void erase(const std::string &key)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        drain_evicted();
+        table.erase(key);
+        erases++;
+    }
+
+    void erase_prefix(const std::string &prefix)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        drain_evicted();
+        erases += table.erase_prefix(prefix);
+    }
+
+    // Cache eviction hook. It runs under the cache lock, and on_hit holds
+    // the publish lock while it reads the cache, so the key is only queued
+    // here and erased by the next call that takes the publish lock.
+    void evicted(const std::string &key)
+    {
+        std::lock_guard<std::mutex> lock(evicted_mtx);
+        evicted_keys.push_back(key);
+        has_evicted.store(true, std::memory_order_relaxed);
+    }
+
+    std::string stats() const
+    {
+        return "shm_publishes=" + std::to_string(publishes.load()) + "\n" +
+               "shm_erases=" + std::to_string(erases.load()) + "\n" +
+               "shm_evictions=" + std::to_string(evictions.load()) + "\n" +
+               "shm_too_large=" + std::to_string(too_large.load()) + "\n";
+    }
+
+private:
+    // Caller holds mtx
+    void drain_evicted()
+    {
+        if (!has_evicted.load(std::memory_order_relaxed))
+            return;
+        std::vector<std::string> keys;
+        {
+            std::lock_guard<std::mutex> lock(evicted_mtx);
+            keys.swap(evicted_keys);
+            has_evicted.store(false, std::memory_order_relaxed);
+        }
+        for (auto &k : keys)
+            table.erase(k);
+        evictions += keys.size();
+    }
+
+    kvshm::Table table;
+    std::mutex mtx; // single writer
+    std::mutex evicted_mtx;
+    std::vector<std::string> evicted_keys;
+    std::atomic<bool> has_evicted{false};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> publishes{0};
+    std::atomic<uint64_t> erases{0};
+    std::atomic<uint64_t> too_large{0};
+};
+
+// ------------------- Hot Response Cache --------------------
+// Keeps the complete serialized response (headers after the status line,
+// the blank line and the "CACHE HIT: " body) for the hottest string keys.
+// Per-response headers such as Server-Timing are spliced in before the
+// blank line.
+// httplib always writes the status line itself and only lets us replace
+// the header writer, so a hot hit parks its entry in a thread_local and
+// the writer below emits the prebuilt headers in place of httplib's. The
+// response body is left empty; the writer hands the entry's body back to
+// the caller, which has the connection's GuardedStream send it straight
+// from the entry behind httplib's header buffer (one writev, no copy).
+//
+// Entries are dropped together with the cached value (PUT, PATCH, DELETE,
+// prefix invalidation, refresh-ahead) and expire after maxAge, since hot
+// hits bypass the LRU and so never schedule a refresh themselves.
+
+class HotResponses
+{
+public:
+    HotResponses(size_t capacity, uint32_t minHits, size_t valueMax,
+                 std::chrono::milliseconds maxAge, std::string keepAlive)
+        : capacity(capacity), min_hits(minHits), value_max(valueMax),
+          max_age(maxAge), keep_alive(std::move(keepAlive)) {}
+
+    // Read before the cache lookup whose value may be passed to on_hit
+    uint64_t epoch() const { return invalidations.load(); }
+
+    // Serves key if it is hot; only GETs without a Range may ask
+    bool serve(const std::string &key, Response &res)
+    {
+        std::shared_ptr<const Entry> e;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = entries.find(key);
+            if (it == entries.end())
+                return false;
+            if (std::chrono::steady_clock::now() - it->second->built > max_age) {
+                bytes -= it->second->wire.size();
+                entries.erase(it);
+                expired++;
+                return false;
+            }
+            e = it->second;
+        }
+        pending() = {e, &res.headers};
+        // Headers for the case httplib decides to close the connection
+        // and the prebuilt ones (which say keep-alive) can't be used
+        res.set_header("Content-Length", std::to_string(e->wire.size() - e->body_offset));
+        res.set_header("Content-Type", "text/plain");
+        served++;
+        return true;
+    }
+
+    // A regular cache hit; the key is admitted after min_hits of them
+    void on_hit(const std::string &key, const std::string &value, uint64_t epoch)
+    {
+        if (value.size() > value_max)
+            return;
+        std::lock_guard<std::mutex> lock(mtx);
+        if (++candidates[key] < min_hits)
+            return;
+        candidates.erase(key);
+        if (candidates.size() > 4 * capacity)
+            candidates.clear(); // forget cold keys; hot ones come back quickly
+        if (invalidations.load() != epoch)
+            return; // value may predate a write that already invalidated
+        if (entries.size() >= capacity && !sweep())
+            return;
+
+        auto e = std::make_shared<Entry>();
+        std::string body_len = std::to_string(11 + value.size());
+        e->wire.reserve(96 + keep_alive.size() + value.size());
+        e->wire += "Content-Length: " + body_len + "\r\n";
+        e->wire += "Content-Type: text/plain\r\n";
+        e->wire += "Keep-Alive: " + keep_alive + "\r\n";
+        e->head_end = e->wire.size();
+        e->wire += "\r\n";
+        e->body_offset = e->wire.size();
+        e->wire += "CACHE HIT: ";
+        e->wire += value;
+        e->built = std::chrono::steady_clock::now();
+
+        auto &slot = entries[key];
+        if (slot)
+            bytes -= slot->wire.size();
+        bytes += e->wire.size();
+        slot = std::move(e);
+        admits++;
+    }
+
+    void erase(const std::string &key)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        invalidations++;
+        candidates.erase(key);
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            bytes -= it->second->wire.size();
+            entries.erase(it);
+        }
+    }
+
+    void erase_prefix(const std::string &prefix)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        invalidations++;
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (it->first.compare(0, prefix.size(), prefix) == 0) {
+                bytes -= it->second->wire.size();
+                it = entries.erase(it);
+            } else
+                ++it;
+        }
+    }
+
+    // Body of a hot hit, still inside its entry; owner keeps it alive
+    struct Body
+    {
+        std::shared_ptr<const void> owner;
+        const char *data = nullptr;
+        size_t size = 0;
+    };
+
+    // Server's header writer. For a hot hit body is set and must be sent
+    // after the headers; strm only receives the headers.
+    ssize_t write_headers(Stream &strm, Headers &headers, Body &body)
+    {
+        Pending p = std::move(pending());
+        pending() = {};
+        if (!p.entry || p.owner != &headers)
+            return detail::write_headers(strm, headers);
+
+        const Entry &e = *p.entry;
+        body = {p.entry, e.wire.data() + e.body_offset, e.wire.size() - e.body_offset};
+        if (headers.count("Connection"))
+            return detail::write_headers(strm, headers);
+
+        ssize_t n = strm.write(e.wire.data(), e.head_end);
+        // Headers that vary per response (Server-Timing) go in between
+        for (auto &h : headers) {
+            if (!strcasecmp(h.first.c_str(), "Content-Length") || !strcasecmp(h.first.c_str(), "Content-Type") ||
+                !strcasecmp(h.first.c_str(), "Keep-Alive"))
+                continue;
+            n += strm.write(h.first + ": " + h.second + "\r\n");
+        }
+        return n + strm.write(e.wire.data() + e.head_end, e.body_offset - e.head_end);
+    }
+
+    // Wire copies currently held. Each duplicates a cached value, plus its
+    // headers, on top of the cache's own copy.
+    size_t memory_bytes()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return bytes;
+    }
+
+    // Most the wire copies can hold: capacity entries of value_max bytes
+    size_t memory_limit() const
+    {
+        return capacity * (96 + keep_alive.size() + 11 + value_max);
+    }
+
+    std::string stats()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return "hot_entries=" + std::to_string(entries.size()) + "\n" +
+               "hot_bytes=" + std::to_string(bytes) + "\n" +
+               "hot_served=" + std::to_string(served.load()) + "\n" +
+               "hot_admits=" + std::to_string(admits) + "\n" +
+               "hot_expired=" + std::to_string(expired) + "\n" +
+               "hot_invalidations=" + std::to_string(invalidations.load()) + "\n";
+    }
+
+private:
+    struct Entry
+    {
+        std::string wire;
+        size_t head_end = 0; // where the blank line before the body starts
+        size_t body_offset = 0;
+        std::chrono::steady_clock::time_point built;
+    };
+
+    // The hot hit being answered on this worker thread; owner ties it to
+    // the response so a stale one can never be written for another request
+    struct Pending
+    {
+        std::shared_ptr<const Entry> entry;
+        const Headers *owner = nullptr;
+    };
+
+    static Pending &pending()
+    {
+        static thread_local Pending p;
+        return p;
+    }
+
+    // Makes room by dropping expired entries; caller holds mtx
+    bool sweep()
+    {
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (now - it->second->built > max_age) {
+                bytes -= it->second->wire.size();
+                it = entries.erase(it);
+                expired++;
+            } else
+                ++it;
+        }
+        return entries.size() < capacity;
+    }
+
+    const size_t capacity;
+    const uint32_t min_hits;
+    const size_t value_max;
+    const std::chrono::milliseconds max_age;
+    const std::string keep_alive;
+
+    std::mutex mtx;
+    std::unordered_map<std::string, std::shared_ptr<const Entry>> entries;
+    std::unordered_map<std::string, uint32_t> candidates;
+    size_t bytes = 0;
+    uint64_t admits = 0;
+    uint64_t expired = 0;
+    std::atomic<uint64_t> served{0};
+    std::atomic<uint64_t> invalidations{0};
+};
+
+// ------------------- Large-Object Tier --------------------
+// Values above a size threshold are stored as content-addressed files
+// (<dir>/<first 2 hex>/<sha256>); the kv row and the cache hold only a
+// short reference. GETs map the file and hand the pages straight to the
+// socket, so multi-MB values are never copied through a user buffer.
+
+std::string sha256_hex(const std::string &data)
+{
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    auto rotr = [](uint32_t x, int n)
+    { return (x >> n) | (x << (32 - n)); };
+
+    // Padding: 0x80, zeros, then the bit length big-endian
+    std::string tail = data.substr(data.size() - data.size() % 64);
+    tail += char(0x80);
+    while (tail.size() % 64 != 56)
+        tail += char(0);
+    uint64_t bits = uint64_t(data.size()) * 8;
+    for (int i = 7; i >= 0; i--)
+        tail += char(bits >> (i * 8));
+
+    size_t full = data.size() / 64;
+    for (size_t blk = 0; blk < full + tail.size() / 64; blk++)
+    {
+        const unsigned char *p = (const unsigned char *)(blk < full ? data.data() + blk * 64
+                                                                    : tail.data() + (blk - full) * 64);
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = uint32_t(p[i * 4]) << 24 | uint32_t(p[i * 4 + 1]) << 16 | uint32_t(p[i * 4 + 2]) << 8 | p[i * 4 + 3];
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e, h[5] += f, h[6] += g, h[7] += hh;
+    }
+
+    char out[65];
+    for (int i = 0; i < 8; i++)
+        std::snprintf(out + i * 8, 9, "%08x", h[i]);
+    return std::string(out, 64);
+}
+
+class BlobStore
+{
+public:
+    // Read-only mapping of one blob; unmapped when the last response using it is done
+    struct Mapping
+    {
+        const char *data = nullptr;
+        size_t size = 0;
+        ~Mapping()
+        {
+            if (data)
+                munmap((void *)data, size);
+        }
+    };
+
+    BlobStore(const std::string &d, size_t threshold) : dir(d), min_size(threshold)
+    {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+            throw std::runtime_error("cannot create blob dir " + dir);
+    }
+
+    bool wants(const std::string &value) const { return value.size() >= min_size; }
+    size_t threshold() const { return min_size; }
+
+    // Writes value (unless an identical blob exists) and returns the
+    // reference to store in its place
+    std::string put(const std::string &value)
+    {
+        std::string hash = sha256_hex(value);
+        std::string path = path_of(hash);
+        if (utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0)
+        {
+            // Touched so a concurrent gc's grace period covers the new reference
+            dedup++;
+            return REF + hash + ":" + std::to_string(value.size());
+        }
+
+        mkdir(path.substr(0, path.rfind('/')).c_str(), 0755);
+        std::string tmp = dir + "/tmp.XXXXXX";
+        int fd = mkstemp(&tmp[0]);
+        if (fd < 0)
+            throw std::runtime_error("cannot create blob in " + dir);
+        bool ok = true;
+        for (size_t off = 0; ok && off < value.size();)
+        {
+            ssize_t n = ::write(fd, value.data() + off, value.size() - off);
+            ok = n > 0 || (n < 0 && errno == EINTR);
+            off += n > 0 ? (size_t)n : 0;
+        }
+        ok = ok && fdatasync(fd) == 0;
+        ::close(fd);
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+        {
+            ::unlink(tmp.c_str());
+            throw std::runtime_error("cannot write blob " + path);
+        }
+        puts++;
+        bytes_written += value.size();
+        return REF + hash + ":" + std::to_string(value.size());
+    }
+
+    // Recognizes a stored reference; anything else is an inline value
+    // Length of the "\x01blob:" marker that starts every reference
+    static constexpr size_t REF_LEN = 6;
+
+    // Stored values starting with the marker are read as references, so
+    // clients may not write such values themselves
+    static bool reserved(const std::string &value)
+    {
+        return value.compare(0, REF_LEN, REF) == 0;
+    }
+
+    static bool parse_ref(const std::string &value, std::string &hash, size_t &size)
+    {
+        const size_t n = sizeof(REF) - 1;
+        if (value.size() < n + 66 || value.compare(0, n, REF) != 0 || value[n + 64] != ':')
+            return false;
+        hash = value.substr(n, 64);
+        if (hash.find_first_not_of("0123456789abcdef") != std::string::npos)
+            return false;
+        char *end;
+        size = std::strtoull(value.c_str() + n + 65, &end, 10);
+        return *end == '\0';
+    }
+
+    std::shared_ptr<Mapping> map(const std::string &hash, size_t size)
+    {
+        auto m = std::make_shared<Mapping>();
+        int fd = ::open(path_of(hash).c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("blob " + hash + " missing");
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size != size)
+        {
+            ::close(fd);
+            throw std::runtime_error("blob " + hash + " has the wrong size");
+        }
+        if (size > 0)
+        {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                ::close(fd);
+                throw std::runtime_error("cannot map blob " + hash);
+            }
+            madvise(p, size, MADV_SEQUENTIAL);
+            m->data = (const char *)p;
+            m->size = size;
+        }
+        ::close(fd);
+        return m;
+    }
+
+    // Sends prefix + blob as the response body. The provider passes
+    // slices of the mapping to the socket write, so the bytes go from the
+    // page cache to the socket without a read() into a buffer.
+    void serve(Response &res, const std::string &prefix, const std::string &hash, size_t size)
+    {
+        auto m = map(hash, size);
+        serves++;
+        bytes_served += size;
+        res.set_content_provider(prefix.size() + size, "text/plain",
+                                 [m, prefix](size_t offset, size_t length, DataSink &sink)
+                                 {
+                                     if (offset < prefix.size())
+                                         return sink.write(prefix.data() + offset, std::min(length, prefix.size() - offset));
+                                     offset -= prefix.size();
+                                     return sink.write(m->data + offset, std::min(length, SLICE));
+                                 });
+    }
+
+    // Deletes blobs no live reference names. Files touched within grace
+    // are kept, since their reference may not be stored yet.
+    size_t gc(const std::set<std::string> &live, std::chrono::seconds grace)
+    {
+        size_t removed = 0;
+        time_t cutoff = time(nullptr) - grace.count();
+        DIR *top = opendir(dir.c_str());
+        if (!top)
+            return 0;
+        while (struct dirent *sub = readdir(top))
+        {
+            if (sub->d_name[0] == '.')
+                continue;
+            std::string subdir = dir + "/" + sub->d_name;
+            DIR *d = opendir(subdir.c_str());
+            if (!d)
+                continue;
+            while (struct dirent *e = readdir(d))
+            {
+                std::string path = subdir + "/" + e->d_name;
+                struct stat st;
+                if (e->d_name[0] == '.' || live.count(e->d_name) || stat(path.c_str(), &st) != 0 || st.st_mtime > cutoff)
+                    continue;
+                if (::unlink(path.c_str()) == 0)
+                    removed++;
+            }
+            closedir(d);
+        }
+        closedir(top);
+        gc_removed += removed;
+        return removed;
+    }
+
+    std::string stats() const
+    {
+        return "blob_puts=" + std::to_string(puts.load()) + "\n" +
+               "blob_dedup=" + std::to_string(dedup.load()) + "\n" +
+               "blob_bytes_written=" + std::to_string(bytes_written.load()) + "\n" +
+               "blob_serves=" + std::to_string(serves.load()) + "\n" +
+               "blob_bytes_served=" + std::to_string(bytes_served.load()) + "\n" +
+               "blob_gc_removed=" + std::to_string(gc_removed.load()) + "\n";
+    }
+
+private:
+    static constexpr char REF[] = "\x01" "blob:";
+    static_assert(sizeof(REF) - 1 == REF_LEN, "REF_LEN must match REF");
+    static constexpr size_t SLICE = 4 << 20; // per provider call, so shutdown is noticed
+
+    std::string path_of(const std::string &hash) const { return dir + "/" + hash.substr(0, 2) + "/" + hash; }
+
+    const std::string dir;
+    const size_t min_size;
+    std::atomic<uint64_t> puts{0};
+    std::atomic<uint64_t> dedup{0};
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<uint64_t> serves{0};
+    std::atomic<uint64_t> bytes_served{0};
+    std::atomic<uint64_t> gc_removed{0};
+};
+
+// ------------------- Adaptive Worker Pool --------------------
+
+// Replaces httplib's fixed-size ThreadPool. A controller samples how long
+// connections wait for a worker and how much of the workers' busy time is
+// spent blocked (on Postgres, batch futures or idle keep-alive sockets)
+// rather than on CPU, then grows or shrinks the pool between min and max.
+// Both listeners share one pool.
+class AdaptivePool
+{
+public:
+    AdaptivePool(size_t minWorkers, size_t maxWorkers, std::chrono::microseconds targetWait)
+        : min_workers(std::max<size_t>(1, minWorkers)),
+          max_workers(std::max(min_workers, maxWorkers)),
+          target_wait(targetWait),
+          cores(std::max(1u, std::thread::hardware_concurrency()))
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (size_t i = 0; i < min_workers; i++)
+            spawn_locked();
+        controller = std::thread([this]
+                                 { control_loop(); });
+    }
+
+    ~AdaptivePool() { shutdown(); }
+
+    // Handed to httplib::Server::new_task_queue. Stopping one listener
+    // leaves the shared pool running; main shuts it down last.
+    httplib::TaskQueue *new_queue() { return new Queue(*this); }
+
+    bool enqueue(std::function<void()> fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (stopping)
+                return false;
+            jobs.push_back(Job{std::move(fn), std::chrono::steady_clock::now()});
+        }
+        cv.notify_one();
+        return true;
+    }
+
+    void shutdown()
+    {
+        std::map<size_t, std::thread> remaining;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (stopping)
+                return;
+            stopping = true;
+        }
+        cv.notify_all();
+        ctl_cv.notify_all();
+        controller.join();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            remaining.swap(threads);
+        }
+        for (auto &t : remaining)
+            t.second.join();
+    }
+
+    std::string stats()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return "pool_workers=" + std::to_string(workers) + "\n" +
+               "pool_min=" + std::to_string(min_workers) + "\n" +
+               "pool_max=" + std::to_string(max_workers) + "\n" +
+               "pool_busy=" + std::to_string(busy) + "\n" +
+               "pool_queued=" + std::to_string(jobs.size()) + "\n" +
+               "pool_queue_wait_us=" + std::to_string(last_wait_us) + "\n" +
+               "pool_utilization=" + std::to_string(last_utilization) + "\n" +
+               "pool_blocking_ratio=" + std::to_string(last_blocking) + "\n" +
+               "pool_grows=" + std::to_string(grows) + "\n" +
+               "pool_shrinks=" + std::to_string(shrinks) + "\n" +
+               "pool_last_decision=" + last_decision + "\n";
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Job
+    {
+        std::function<void()> fn;
+        Clock::time_point queued;
+    };
+
+    class Queue : public httplib::TaskQueue
+    {
+    public:
+        explicit Queue(AdaptivePool &p) : pool(p) {}
+        bool enqueue(std::function<void()> fn) override { return pool.enqueue(std::move(fn)); }
+        void shutdown() override {}
+
+    private:
+        AdaptivePool &pool;
+    };
+
+    static constexpr int TICKS_PER_DECISION = 5;
+    static constexpr int CALM_WINDOWS_TO_SHRINK = 3;
+
+    void spawn_locked()
+    {
+        size_t id = next_id++;
+        workers++;
+        threads.emplace(id, std::thread([this, id]
+                                        { worker(id); }));
+    }
+
+    void worker(size_t id)
+    {
+        label_thread("worker");
+        for (;;)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [&]
+                        { return !jobs.empty() || stopping || retire > 0; });
+                if (jobs.empty())
+                {
+                    // Retire only when idle; queued work is drained first
+                    if (!stopping)
+                    {
+                        retire--;
+                        workers--;
+                        exited.push_back(id);
+                    }
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+                busy++;
+                auto now = Clock::now();
+                running[id] = now;
+                window_wait_ns += ns_between(job.queued, now);
+                window_dequeued++;
+            }
+
+            job.fn();
+
+            std::lock_guard<std::mutex> lock(mtx);
+            busy--;
+            window_busy_ns += ns_between(std::max(running[id], window_start), Clock::now());
+            running.erase(id);
+        }
+    }
+
+    static uint64_t ns_between(Clock::time_point a, Clock::time_point b)
+    {
+        return b > a ? (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(b - a).count() : 0;
+    }
+
+    // CPU time all current workers have consumed so far
+    uint64_t workers_cpu_ns_locked()
+    {
+        uint64_t total = 0;
+        for (auto &t : threads)
+        {
+            clockid_t cid;
+            struct timespec ts;
+            if (pthread_getcpuclockid(t.second.native_handle(), &cid) == 0 &&
+                clock_gettime(cid, &ts) == 0)
+                total += uint64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+        }
+        return total;
+    }
+
+    void control_loop()
+    {
+        label_thread("pool");
+        const auto tick = std::chrono::milliseconds(100);
+        int ticks = 0;
+        int calm_windows = 0;
+
+        std::unique_lock<std::mutex> lock(mtx);
+        uint64_t cpu_start = workers_cpu_ns_locked();
+        window_start = Clock::now();
+        while (!stopping)
+        {
+            ctl_cv.wait_for(lock, tick, [&]
+                            { return stopping; });
+            if (stopping)
+                break;
+
+            // Threads that retired since the last tick
+            for (size_t id : exited)
+            {
+                threads[id].join(); // already past its last lock use
+                threads.erase(id);
+            }
+            exited.clear();
+
+            if (++ticks < TICKS_PER_DECISION)
+                continue;
+
+            // Busy time in this window: finished jobs plus the running part
+            // of jobs still in progress
+            auto now = Clock::now();
+            uint64_t busy_ns = window_busy_ns;
+            for (auto &r : running)
+                busy_ns += ns_between(std::max(r.second, window_start), now);
+
+            // Wait of dequeued jobs, or of the oldest still-queued one if
+            // every worker is stuck and nothing was dequeued
+            uint64_t wait_ns = window_dequeued ? window_wait_ns / window_dequeued : 0;
+            if (!jobs.empty())
+                wait_ns = std::max(wait_ns, ns_between(jobs.front().queued, now));
+            uint64_t cpu_now = workers_cpu_ns_locked();
+            uint64_t cpu_ns = cpu_now > cpu_start ? cpu_now - cpu_start : 0;
+            uint64_t window_ns = ns_between(window_start, now);
+
+            last_wait_us = wait_ns / 1000;
+            last_utilization = double(busy_ns) / (double(window_ns) * workers);
+            last_blocking = busy_ns ? std::max(0.0, 1.0 - double(cpu_ns) / busy_ns) : 0.0;
+            decide(wait_ns, calm_windows);
+
+            ticks = 0;
+            window_start = now;
+            window_busy_ns = 0;
+            window_wait_ns = 0;
+            window_dequeued = 0;
+            cpu_start = workers_cpu_ns_locked(); // excludes retired threads
+        }
+    }
+
+    void decide(uint64_t wait_ns, int &calm_windows)
+    {
+        const uint64_t target_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(target_wait).count();
+        size_t before = workers;
+        std::string why = " (wait_us=" + std::to_string(last_wait_us) +
+                          " util=" + std::to_string(last_utilization) +
+                          " blocked=" + std::to_string(last_blocking) + ")";
+
+        if (wait_ns > target_ns)
+        {
+            calm_windows = 0;
+            if (workers >= max_workers)
+            {
+                last_decision = "hold at max" + why;
+                return;
+            }
+            // Workers mostly on CPU: past one per core more threads only
+            // add contention
+            if (last_blocking < 0.2 && workers >= cores)
+            {
+                last_decision = "hold cpu-bound" + why;
+                return;
+            }
+            // Mostly blocked workers are cheap, so grow faster
+            size_t step = last_blocking > 0.5 ? std::max<size_t>(1, workers / 2)
+                                              : std::max<size_t>(1, workers / 8);
+            size_t n = std::min(step, max_workers - workers);
+            for (size_t i = 0; i < n; i++)
+                spawn_locked();
+            grows++;
+        }
+        else if (wait_ns < target_ns / 4 && last_utilization < 0.5 && workers - retire > min_workers)
+        {
+            // Only shrink after a few calm windows so bursts don't flap
+            if (++calm_windows < CALM_WINDOWS_TO_SHRINK)
+                return;
+            calm_windows = 0;
+            size_t idle = workers - busy;
+            size_t n = std::min(std::max<size_t>(1, idle / 4), workers - retire - min_workers);
+            retire += n;
+            cv.notify_all();
+            shrinks++;
+            last_decision = "shrink " + std::to_string(before) + "->" + std::to_string(before - n) + why;
+            return;
+        }
+        else
+        {
+            calm_windows = 0;
+            return;
+        }
+        last_decision = "grow " + std::to_string(before) + "->" + std::to_string(workers) + why;
+    }
+
+    const size_t min_workers;
+    const size_t max_workers;
+    const std::chrono::microseconds target_wait;
+    const size_t cores;
+
+    std::mutex mtx;
+    std::condition_variable cv;     // workers
+    std::condition_variable ctl_cv; // controller
+    std::list<Job> jobs;
+    std::map<size_t, std::thread> threads;
+    std::map<size_t, Clock::time_point> running; // worker id -> job start
+    std::vector<size_t> exited;
+    std::thread controller;
+    size_t next_id = 0;
+    size_t workers = 0;
+    size_t busy = 0;
+    size_t retire = 0;
+    bool stopping = false;
+
+    Clock::time_point window_start;
+    uint64_t window_busy_ns = 0;
+    uint64_t window_wait_ns = 0;
+    uint64_t window_dequeued = 0;
+    uint64_t last_wait_us = 0;
+    double last_utilization = 0;
+    double last_blocking = 0;
+    uint64_t grows = 0;
+    uint64_t shrinks = 0;
+    std::string last_decision = "none";
+};
+
+// ------------------- In-Flight Body Budget --------------------
+// httplib buffers every request body in full before the handler runs, so
+// concurrent uploads are bounded only by RAM. Requests reserve their
+// Content-Length from a global budget before the body is read; while the
+// budget is exhausted the worker waits without reading the socket (TCP
+// flow control pushes back on the client) and gives up with 503 after
+// maxWait. The reservation is held until the response has been written,
+// when httplib frees the body.
+
+class BodyBudget
+{
+public:
+    enum class Result
+    {
+        Ok,
+        TooLarge, // can never fit
+        Busy      // waited maxWait without room
+    };
+
+    BodyBudget(size_t budget, std::chrono::milliseconds maxWait)
+        : budget(budget), max_wait(maxWait) {}
+
+    // Reserves bytes for the request being handled on this thread
+    Result acquire(size_t bytes)
+    {
+        release(); // a request that never reached release()
+        if (bytes == 0)
+            return Result::Ok;
+        if (bytes > budget) {
+            rejected++;
+            return Result::TooLarge;
+        }
+
+        std::unique_lock<std::mutex> lock(mtx);
+        if (used + bytes > budget) {
+            waits++;
+            if (!room.wait_for(lock, max_wait, [&]
+                               { return used + bytes <= budget; })) {
+                rejected++;
+                return Result::Busy;
+            }
+        }
+        used += bytes;
+        peak = std::max(peak, used);
+        held() = bytes;
+        return Result::Ok;
+    }
+
+    // Returns this thread's reservation once its response is written
+    void release()
+    {
+        size_t &h = held();
+        if (h == 0)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            used -= h;
+        }
+        h = 0;
+        room.notify_all();
+    }
+
+    std::string stats()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return "inflight_bytes=" + std::to_string(used) + "\n" +
+               "inflight_peak_bytes=" + std::to_string(peak) + "\n" +
+               "inflight_budget=" + std::to_string(budget) + "\n" +
+               "inflight_waits=" + std::to_string(waits) + "\n" +
+               "inflight_rejected=" + std::to_string(rejected.load()) + "\n";
+    }
+
+private:
+    // A request is handled start to finish on one worker thread
+    static size_t &held()
+    {
+        static thread_local size_t h = 0;
+        return h;
+    }
+
+    const size_t budget;
+    const std::chrono::milliseconds max_wait;
+    std::mutex mtx;
+    std::condition_variable room;
+    size_t used = 0;
+    size_t peak = 0;
+    uint64_t waits = 0;
+    std::atomic<uint64_t> rejected{0};
+};
+
+// ------------------- Value Path --------------------
+// A PUT body is appended once from httplib's receive buffer into a string
+// sized from Content-Length (httplib's own req.body grows by doubling) and
+// then shared, never copied, by the coalescer and the cache. GET replies
+// for large values stream from that shared buffer instead of copying it
+// into the response body.
+
+static constexpr size_t SHARED_REPLY_MIN = 16 * 1024;
+static constexpr size_t BODY_RESERVE_MAX = 64 << 20; // Content-Length is untrusted
+
+// Null if the body could not be read completely
+SharedValue read_body(const Request &req, const ContentReader &content_reader)
+{
+    std::string body;
+    body.reserve(std::min<size_t>(req.get_header_value_u64("Content-Length"), BODY_RESERVE_MAX));
+    if (!content_reader([&](const char *data, size_t n)
+                        { body.append(data, n); return true; }))
+        return nullptr;
+    return std::make_shared<const std::string>(std::move(body));
+}
+
+// Body for a found value. With a Range header the raw value is sent
+// instead and httplib cuts the requested bytes out of it (206).
+void reply_value(const Request &req, Response &res, const char *source, const SharedValue &value)
+{
+    std::string prefix = req.ranges.empty() ? source : "";
+    const char *type = req.ranges.empty() ? "text/plain" : "application/octet-stream";
+    if (value->size() < SHARED_REPLY_MIN) {
+        res.set_content(prefix + *value, type);
+        return;
+    }
+    res.set_content_provider(prefix.size() + value->size(), type,
+                             [prefix, value](size_t offset, size_t length, DataSink &sink)
+                             {
+                                 if (offset < prefix.size()) {
+                                     size_t n = std::min(length, prefix.size() - offset);
+                                     if (!sink.write(prefix.data() + offset, n))
+                                         return false;
+                                     offset += n;
+                                     length -= n;
+                                 }
+                                 return length == 0 || sink.write(value->data() + offset - prefix.size(), length);
+                             });
+}
+
+// ------------------- Socket Profiles --------------------
+// httplib listens with a backlog of 5 (CPPHTTPLIB_LISTEN_BACKLOG), which
+// overflows when a load generator opens its connections at once, and
+// leaves Nagle on, which holds back the body write that follows the
+// header write of every response. A profile bundles the listener and
+// per-connection options; options the kernel refuses (SO_BUSY_POLL above
+// net.core.busy_read needs CAP_NET_ADMIN) are skipped.
+//   default          httplib's options with a usable backlog
+//   low-latency      TCP_NODELAY, TCP_FASTOPEN, SO_BUSY_POLL on reads
+//   high-throughput  TCP_NODELAY, TCP_FASTOPEN, TCP_DEFER_ACCEPT (a
+//                    connection reaches a worker only once its request
+//                    has arrived) and larger socket buffers
+
+struct SocketProfile
+{
+    std::string name = "default";
+    int backlog = 1024; // capped by net.core.somaxconn
+    bool nodelay = false;
+    int fastopen_queue = 0;
+    int defer_accept_s = 0;
+    int busy_poll_us = 0;
+    int buffer_bytes = 0; // SO_SNDBUF/SO_RCVBUF (0 = kernel autotuning)
+
+    static bool named(const std::string &name, SocketProfile &p)
+    {
+        p = SocketProfile();
+        p.name = name;
+        if (name == "low-latency") {
+            p.backlog = 4096;
+            p.nodelay = true;
+            p.fastopen_queue = 256;
+            p.busy_poll_us = 50;
+        } else if (name == "high-throughput") {
+            p.backlog = 4096;
+            p.nodelay = true;
+            p.fastopen_queue = 256;
+            p.defer_accept_s = 1;
+            p.buffer_bytes = 1 << 20;
+        } else if (name != "default")
+            return false;
+        return true;
+    }
+
+    // Installed with set_socket_options; runs before bind()
+    void apply_listener(socket_t sock) const
+    {
+        default_socket_options(sock);
+#ifdef TCP_FASTOPEN
+        if (fastopen_queue > 0)
+            detail::set_socket_opt(sock, IPPROTO_TCP, TCP_FASTOPEN, fastopen_queue);
+#endif
+#ifdef TCP_DEFER_ACCEPT
+        if (defer_accept_s > 0)
+            detail::set_socket_opt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer_accept_s);
+#endif
+    }
+
+    void apply_accepted(socket_t sock) const
+    {
+        if (nodelay)
+            detail::set_socket_opt(sock, IPPROTO_TCP, TCP_NODELAY, 1);
+#ifdef SO_BUSY_POLL
+        if (busy_poll_us > 0)
+            detail::set_socket_opt(sock, SOL_SOCKET, SO_BUSY_POLL, busy_poll_us);
+#endif
+        if (buffer_bytes > 0) {
+            detail::set_socket_opt(sock, SOL_SOCKET, SO_SNDBUF, buffer_bytes);
+            detail::set_socket_opt(sock, SOL_SOCKET, SO_RCVBUF, buffer_bytes);
+        }
+    }
+
+    std::string stats() const { return "socket_profile=" + name + "\n"; }
+};
+
+// ------------------- Server Timing --------------------
+// /kv responses carry "Server-Timing: queue;dur=.., cache;dur=..,
+// db;dur=.., total;dur=.." (milliseconds) so clients can split their
+// latency into network, worker queue, cache and storage time:
+//   queue  time the connection waited for a worker (first request on a
+//          connection only; later ones were already on a worker)
+//   cache  cache, hot-response and integer-cache lookups
+//   db     storage calls, including batched and coalesced waits
+//   total  queue plus the time from the request's first byte to the end
+//          of the handler
+
+// Per worker thread; GuardedServer stamps each request's start
+struct RequestClock
+{
+    std::chrono::steady_clock::time_point start;
+    std::chrono::nanoseconds queued{0};
+
+    static RequestClock &current()
+    {
+        static thread_local RequestClock c;
+        return c;
+    }
+
+    // Queue wait plus time since the request's first byte
+    std::chrono::nanoseconds elapsed() const
+    {
+        return queued + (std::chrono::steady_clock::now() - start);
+    }
+};
+
+// Wraps the server's TaskQueue to record each connection's wait for a worker
+class TimedQueue : public TaskQueue
+{
+public:
+    explicit TimedQueue(TaskQueue *q) : inner(q) {}
+
+    bool enqueue(std::function<void()> fn) override
+    {
+        auto queued_at = std::chrono::steady_clock::now();
+        return inner->enqueue([fn = std::move(fn), queued_at]
+                              {
+            label_thread("worker");
+            RequestClock::current().queued = std::chrono::steady_clock::now() - queued_at;
+            fn(); });
+    }
+
+    void shutdown() override { inner->shutdown(); }
+    void on_idle() override { inner->on_idle(); }
+
+private:
+    std::unique_ptr<TaskQueue> inner;
+};
+
+// Accumulates a handler's phases; the header is set when it goes out of
+// scope, on every return path (and when a DB error unwinds the handler)
+class ServerTiming
+{
+public:
+    explicit ServerTiming(Response &r) : res(r) {}
+
+    ~ServerTiming()
+    {
+        const RequestClock &c = RequestClock::current();
+        auto now = std::chrono::steady_clock::now();
+        auto total = c.queued + (now - (c.start.time_since_epoch().count() ? c.start : created));
+        char buf[160];
+        std::snprintf(buf, sizeof(buf), "queue;dur=%.3f, cache;dur=%.3f, db;dur=%.3f, total;dur=%.3f",
+                      ms(c.queued), ms(cache_ns), ms(db_ns), ms(total));
+        res.set_header("Server-Timing", buf);
+    }
+
+    // Run f, adding its duration to the phase; returns what f returns
+    template <typename F>
+    decltype(auto) cache(F &&f)
+    {
+        Lap lap{cache_ns};
+        return f();
+    }
+
+    template <typename F>
+    decltype(auto) db(F &&f)
+    {
+        Lap lap{db_ns};
+        return f();
+    }
+
+private:
+    struct Lap
+    {
+        std::chrono::nanoseconds &acc;
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        ~Lap() { acc += std::chrono::steady_clock::now() - t0; }
+    };
+
+    static double ms(std::chrono::nanoseconds d) { return d.count() / 1e6; }
+
+    Response &res;
+    const std::chrono::steady_clock::time_point created = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds cache_ns{0};
+    std::chrono::nanoseconds db_ns{0};
+};
+
+// ------------------- Rolling Windows --------------------
+// The counters at the top of this file run since process start; these
+// cover only the last 10 s / 1 min / 5 min. A ring of one-second buckets
+// is updated with relaxed atomics only: the first writer of a new second
+// claims the slot by CAS, clears it and publishes the second, so the
+// request path never takes a lock. Latencies go into a log-linear
+// histogram (4 bins per power of two of microseconds), so the reported
+// percentiles are bin upper bounds, within 25% of the true value.
+
+class RollingStats
+{
+public:
+    RollingStats() : origin(std::chrono::steady_clock::now()) {}
+
+    void hit() { add(&Bucket::hits); }
+    void miss() { add(&Bucket::misses); }
+
+    // Called once per response; 5xx count as errors
+    void request(int status, std::chrono::nanoseconds latency)
+    {
+        Bucket *b = current();
+        if (!b)
+            return;
+        b->requests.fetch_add(1, std::memory_order_relaxed);
+        if (status >= 500)
+            b->errors.fetch_add(1, std::memory_order_relaxed);
+        uint64_t us = latency.count() > 0 ? uint64_t(latency.count()) / 1000 : 0;
+        b->latency[bin(us)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::string stats() const
+    {
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - origin).count();
+        int64_t now = int64_t(elapsed);
+        std::string out;
+        for (auto &w : WINDOWS) {
+            Totals t;
+            for (int64_t s = std::max<int64_t>(0, now - w.seconds + 1); s <= now; s++) {
+                const Bucket &b = buckets[s % SLOTS];
+                if (b.second.load(std::memory_order_acquire) != s)
+                    continue;
+                t.requests += b.requests.load(std::memory_order_relaxed);
+                t.errors += b.errors.load(std::memory_order_relaxed);
+                t.hits += b.hits.load(std::memory_order_relaxed);
+                t.misses += b.misses.load(std::memory_order_relaxed);
+                for (size_t i = 0; i < BINS; i++)
+                    t.latency[i] += b.latency[i].load(std::memory_order_relaxed);
+            }
+            // The current second is still filling; early on the window is
+            // only as long as the process has been up
+            double span = std::max(std::min(double(w.seconds - 1) + (elapsed - now), elapsed), 0.001);
+            std::string p = std::string("window_") + w.name + "_";
+            out += p + "rps=" + std::to_string(t.requests / span) + "\n";
+            out += p + "hit_rate=" + std::to_string(percent(t.hits, t.hits + t.misses)) + "%\n";
+            out += p + "error_rate=" + std::to_string(percent(t.errors, t.requests)) + "%\n";
+            out += p + "p50_ms=" + std::to_string(quantile(t, 0.50)) + "\n";
+            out += p + "p90_ms=" + std::to_string(quantile(t, 0.90)) + "\n";
+            out += p + "p99_ms=" + std::to_string(quantile(t, 0.99)) + "\n";
+        }
+        return out;
+    }
+
+private:
+    // 0-3 us exact, then 4 bins per power of two up to ~35 minutes
+    static constexpr size_t BINS = 120;
+    // 5 minutes plus the current second plus one being recycled
+    static constexpr int64_t SLOTS = 302;
+    static constexpr int64_t CLEARING = -2;
+
+    struct Window
+    {
+        const char *name;
+        int64_t seconds;
+    };
+    static constexpr Window WINDOWS[] = {{"10s", 10}, {"1m", 60}, {"5m", 300}};
+
+    struct Bucket
+    {
+        std::atomic<int64_t> second{-1};
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> latency[BINS] = {};
+    };
+
+    struct Totals
+    {
+        uint64_t requests = 0, errors = 0, hits = 0, misses = 0;
+        uint64_t latency[BINS] = {};
+    };
+
+    static size_t bin(uint64_t us)
+    {
+        if (us < 4)
+            return us;
+        int msb = 63 - __builtin_clzll(us);
+        size_t i = size_t(msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+        return std::min(i, BINS - 1);
+    }
+
+    // Smallest latency (us) that falls in bin i
+    static uint64_t bin_floor(size_t i)
+    {
+        if (i < 4)
+            return i;
+        return (4 + i % 4) << (i / 4 - 1);
+    }
+
+    static double percent(uint64_t part, uint64_t total)
+    {
+        return total ? double(part) * 100.0 / total : 0.0;
+    }
+
+    static double quantile(const Totals &t, double q)
+    {
+        uint64_t n = 0;
+        for (auto c : t.latency)
+            n += c;
+        if (!n)
+            return 0.0;
+        uint64_t rank = uint64_t(q * (n - 1)) + 1, seen = 0;
+        for (size_t i = 0; i < BINS; i++) {
+            seen += t.latency[i];
+            if (seen >= rank)
+                return bin_floor(i + 1) / 1000.0;
+        }
+        return bin_floor(BINS) / 1000.0;
+    }
+
+    void add(std::atomic<uint64_t> Bucket::*field)
+    {
+        if (Bucket *b = current())
+            (b->*field).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // This second's bucket, recycling the slot if it still holds an old
+    // second; null for a writer so delayed the slot has moved on
+    Bucket *current()
+    {
+        int64_t sec = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - origin).count();
+        Bucket &b = buckets[sec % SLOTS];
+        int64_t s = b.second.load(std::memory_order_acquire);
+        while (s != sec) {
+            if (s > sec)
+                return nullptr;
+            if (s == CLEARING) {
+                std::this_thread::yield();
+                s = b.second.load(std::memory_order_acquire);
+                continue;
+            }
+            if (b.second.compare_exchange_weak(s, CLEARING, std::memory_order_acquire)) {
+                b.requests.store(0, std::memory_order_relaxed);
+                b.errors.store(0, std::memory_order_relaxed);
+                b.hits.store(0, std::memory_order_relaxed);
+                b.misses.store(0, std::memory_order_relaxed);
+                for (auto &c : b.latency)
+                    c.store(0, std::memory_order_relaxed);
+                b.second.store(sec, std::memory_order_release);
+                break;
+            }
+        }
+        return &b;
+    }
+
+    const std::chrono::steady_clock::time_point origin;
+    Bucket buckets[SLOTS];
+};
+
+// ------------------- Stats Stream --------------------
+// GET /stats/stream is a server-sent event stream for dashboards. One
+// publisher thread takes a /stats snapshot per interval, only while
+// someone is subscribed, and turns it into two shared events: the full
+// set of values and the delta (keys whose value changed). Subscribers get
+// a full "snapshot" event on connect and then "delta" events. A
+// subscriber that falls more than BACKLOG events behind resyncs with a
+// fresh snapshot instead of queueing. Numeric values are sent as JSON
+// numbers, the rest (e.g. "57.5%") as strings. Each subscriber pins a
+// worker thread, so at most maxSubscribers are served at once.
+
+class StatsStream
+{
+public:
+    StatsStream(std::chrono::milliseconds interval, size_t maxSubscribers, std::function<std::string()> snapshot)
+        : interval(interval), max_subscribers(maxSubscribers), snapshot(std::move(snapshot)),
+          publisher([this]
+                    { run(); })
+    {
+    }
+
+    ~StatsStream()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        publisher.join();
+    }
+
+    // Turns res into an endless event stream; each subscriber holds a
+    // worker thread while connected. False (res untouched) when
+    // maxSubscribers are already connected.
+    bool subscribe(Response &res)
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            if (subscribers >= max_subscribers) {
+                rejected++;
+                return false;
+            }
+            subscribers++;
+        }
+        cv.notify_all();
+        auto seen = std::make_shared<uint64_t>(0);
+        res.set_header("Cache-Control", "no-cache");
+        res.set_chunked_content_provider(
+            "text/event-stream",
+            [this, seen](size_t, DataSink &sink)
+            {
+                std::shared_ptr<const std::string> msg = next(*seen);
+                if (!msg)
+                    return false;
+                return sink.write(msg->data(), msg->size());
+            },
+            [this](bool)
+            {
+                std::lock_guard<std::mutex> lk(m);
+                subscribers--;
+            });
+        return true;
+    }
+
+    std::string stats() const
+    {
+        std::lock_guard<std::mutex> lk(m);
+        return "stream_subscribers=" + std::to_string(subscribers) + "\n" +
+               "stream_rejected=" + std::to_string(rejected) + "\n" +
+               "stream_events=" + std::to_string(seq) + "\n" +
+               "stream_resyncs=" + std::to_string(resyncs) + "\n";
+    }
+
+private:
+    static constexpr size_t BACKLOG = 16;
+    // Comment line so idle proxies and dead clients are noticed
+    static constexpr std::chrono::seconds KEEPALIVE{15};
+
+    // The next event for a subscriber that has seen events up to `seen`;
+    // null once the server is shutting down
+    std::shared_ptr<const std::string> next(uint64_t &seen)
+    {
+        static const auto keepalive = std::make_shared<const std::string>(": keepalive\n\n");
+        std::unique_lock<std::mutex> lk(m);
+        if (!cv.wait_for(lk, KEEPALIVE, [&]
+                         { return stopping || seq > seen; }))
+            return keepalive;
+        if (stopping)
+            return nullptr;
+        if (seen == 0 || seq - seen > deltas.size()) {
+            if (seen != 0)
+                resyncs++;
+            seen = seq;
+            return full;
+        }
+        size_t idx = deltas.size() - (seq - seen);
+        seen++;
+        return deltas[idx];
+    }
+
+    void run()
+    {
+        label_thread("stats");
+        std::map<std::string, std::string> previous;
+        auto tick = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lk(m);
+        while (true) {
+            cv.wait(lk, [&]
+                    { return stopping || subscribers > 0; });
+            if (stopping)
+                return;
+            lk.unlock();
+
+            std::map<std::string, std::string> values;
+            std::istringstream in(snapshot());
+            std::string line;
+            while (std::getline(in, line)) {
+                size_t eq = line.find('=');
+                if (eq != std::string::npos)
+                    values[line.substr(0, eq)] = line.substr(eq + 1);
+            }
+            long long ts = std::chrono::duration_cast<std::chrono::milliseconds>(
+                               std::chrono::system_clock::now().time_since_epoch())
+                               .count();
+            std::string all = "{\"ts\":" + std::to_string(ts);
+            std::string changed = all;
+            for (auto &kv : values) {
+                std::string field = "," + json_string(kv.first) + ":" + json_value(kv.second);
+                all += field;
+                auto it = previous.find(kv.first);
+                if (it == previous.end() || it->second != kv.second)
+                    changed += field;
+            }
+            previous.swap(values);
+
+            lk.lock();
+            seq++;
+            std::string id = "id: " + std::to_string(seq) + "\n";
+            full = std::make_shared<const std::string>("event: snapshot\n" + id + "data: " + all + "}\n\n");
+            deltas.push_back(std::make_shared<const std::string>("event: delta\n" + id + "data: " + changed + "}\n\n"));
+            if (deltas.size() > BACKLOG)
+                deltas.pop_front();
+            cv.notify_all();
+
+            // Fixed rate; after a stall, skip the missed ticks rather than burst
+            tick += interval;
+            auto now = std::chrono::steady_clock::now();
+            if (tick < now)
+                tick = now;
+            cv.wait_until(lk, tick, [&]
+                          { return stopping; });
+        }
+    }
+
+    static std::string json_string(const std::string &s)
+    {
+        std::string out = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\')
+                out += '\\';
+            if ((unsigned char)c >= 0x20)
+                out += c;
+        }
+        return out + "\"";
+    }
+
+    static std::string json_value(const std::string &v)
+    {
+        char *end = nullptr;
+        double d = std::strtod(v.c_str(), &end);
+        if (!v.empty() && end == v.c_str() + v.size() && std::isfinite(d))
+            return v;
+        return json_string(v);
+    }
+
+    const std::chrono::milliseconds interval;
+    const size_t max_subscribers;
+    const std::function<std::string()> snapshot;
+    mutable std::mutex m;
+    std::condition_variable cv;
+    bool stopping = false;
+    size_t subscribers = 0;
+    uint64_t rejected = 0;
+    uint64_t seq = 0;
+    uint64_t resyncs = 0;
+    std::shared_ptr<const std::string> full;
+    std::deque<std::shared_ptr<const std::string>> deltas;
+    std::thread publisher;
+};
+
+// ------------------- Process Metrics --------------------
+// Resource usage from getrusage and /proc, to tell whether kvserver is
+// CPU-bound (cpu_percent near 100 per busy thread), blocked (voluntary
+// context switches dominate), preempted (involuntary ones) or paging
+// (major faults). Threads are grouped by the role label_thread gave them.
+// The main thread keeps the process name for ps/pkill and is reported as
+// the acceptor; unlabeled threads are "other". CPU percentages cover the
+// interval since the previous sample at least a second old, where 100%
+// is one core.
+
+class ProcessMetrics
+{
+public:
+    std::string stats()
+    {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        double user_ms = ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3;
+        double sys_ms = ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+
+        std::map<std::string, Role> roles;
+        std::map<pid_t, Sample> sample;
+        size_t threads = 0;
+        pid_t main_tid = getpid();
+        for (pid_t tid : list_ints("/proc/self/task")) {
+            std::string dir = "/proc/self/task/" + std::to_string(tid);
+            std::string comm = read_file(dir + "/comm");
+            if (!comm.empty() && comm.back() == '\n')
+                comm.pop_back();
+            std::string role = tid == main_tid ? "acceptor" : comm.compare(0, 3, "kv-") == 0 ? comm.substr(3) : "other";
+
+            Role &r = roles[role];
+            r.threads++;
+            threads++;
+            Sample &t = sample[tid] = {role, thread_cpu_ms(read_file(dir + "/stat"))};
+            r.cpu_ms += t.cpu_ms;
+            std::string status = read_file(dir + "/status");
+            r.ctx_voluntary += status_field(status, "voluntary_ctxt_switches:");
+            r.ctx_involuntary += status_field(status, "nonvoluntary_ctxt_switches:");
+        }
+
+        std::lock_guard<std::mutex> lk(m);
+        auto now = std::chrono::steady_clock::now();
+        double wall_ms = std::chrono::duration<double, std::milli>(now - sampled_at).count();
+        if (wall_ms >= 1000) {
+            process_percent = 100.0 * (user_ms + sys_ms - sampled_process_ms) / wall_ms;
+            role_percent.clear();
+            for (auto &t : sample) {
+                // Threads started since the last sample count from zero
+                auto it = sampled.find(t.first);
+                double before = it == sampled.end() ? 0.0 : it->second.cpu_ms;
+                role_percent[t.second.role] += 100.0 * (t.second.cpu_ms - before) / wall_ms;
+            }
+            sampled_at = now;
+            sampled_process_ms = user_ms + sys_ms;
+            sampled.swap(sample);
+        }
+
+        struct rlimit nofile;
+        getrlimit(RLIMIT_NOFILE, &nofile);
+        long page = sysconf(_SC_PAGESIZE);
+        unsigned long long size_pages = 0, resident_pages = 0;
+        std::istringstream(read_file("/proc/self/statm")) >> size_pages >> resident_pages;
+
+        std::string out =
+            "proc_cpu_user_ms=" + std::to_string(uint64_t(user_ms)) + "\n" +
+            "proc_cpu_sys_ms=" + std::to_string(uint64_t(sys_ms)) + "\n" +
+            "proc_cpu_percent=" + std::to_string(process_percent) + "\n" +
+            "proc_ctx_voluntary=" + std::to_string(ru.ru_nvcsw) + "\n" +
+            "proc_ctx_involuntary=" + std::to_string(ru.ru_nivcsw) + "\n" +
+            "proc_rss_bytes=" + std::to_string(resident_pages * page) + "\n" +
+            "proc_peak_rss_bytes=" + std::to_string(uint64_t(ru.ru_maxrss) * 1024) + "\n" +
+            "proc_vsize_bytes=" + std::to_string(size_pages * page) + "\n" +
+            "proc_minor_faults=" + std::to_string(ru.ru_minflt) + "\n" +
+            "proc_major_faults=" + std::to_string(ru.ru_majflt) + "\n" +
+            "proc_open_fds=" + std::to_string(list_ints("/proc/self/fd").size()) + "\n" +
+            "proc_fd_limit=" + std::to_string(uint64_t(nofile.rlim_cur)) + "\n" +
+            "proc_threads=" + std::to_string(threads) + "\n";
+        for (auto &r : roles) {
+            std::string p = "threads_" + r.first + "_";
+            out += p + "count=" + std::to_string(r.second.threads) + "\n";
+            out += p + "cpu_ms=" + std::to_string(uint64_t(r.second.cpu_ms)) + "\n";
+            out += p + "cpu_percent=" + std::to_string(role_percent[r.first]) + "\n";
+            out += p + "ctx_voluntary=" + std::to_string(r.second.ctx_voluntary) + "\n";
+            out += p + "ctx_involuntary=" + std::to_string(r.second.ctx_involuntary) + "\n";
+        }
+        return out;
+    }
+
+private:
+    struct Role
+    {
+        size_t threads = 0;
+        double cpu_ms = 0;
+        uint64_t ctx_voluntary = 0;
+        uint64_t ctx_involuntary = 0;
+    };
+
+    struct Sample
+    {
+        std::string role;
+        double cpu_ms;
+    };
+
+    static std::string read_file(const std::string &path)
+    {
+        std::ifstream in(path);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    // Numeric entries of a /proc directory (thread ids, fds)
+    static std::vector<pid_t> list_ints(const char *path)
+    {
+        std::vector<pid_t> out;
+        if (DIR *d = opendir(path)) {
+            while (dirent *e = readdir(d))
+                if (e->d_name[0] >= '0' && e->d_name[0] <= '9')
+                    out.push_back(std::atoi(e->d_name));
+            closedir(d);
+        }
+        return out;
+    }
+
+    // utime + stime (fields 14 and 15) of /proc/<pid>/task/<tid>/stat; the
+    // comm field before them may contain spaces, so count from its ')'
+    static double thread_cpu_ms(const std::string &stat)
+    {
+        size_t close = stat.rfind(')');
+        if (close == std::string::npos)
+            return 0.0;
+        std::istringstream in(stat.substr(close + 2));
+        std::string field;
+        unsigned long long utime = 0, stime = 0;
+        for (int i = 3; i <= 13 && in >> field; i++)
+            ;
+        in >> utime >> stime;
+        return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+    }
+
+    static uint64_t status_field(const std::string &status, const char *name)
+    {
+        size_t at = status.find(name);
+        return at == std::string::npos ? 0 : std::strtoull(status.c_str() + at + std::strlen(name), nullptr, 10);
+    }
+
+    std::mutex m;
+    // The first sample averages over the time since startup
+    std::chrono::steady_clock::time_point sampled_at = std::chrono::steady_clock::now();
+    double sampled_process_ms = 0;
+    std::map<pid_t, Sample> sampled;
+    double process_percent = 0;
+    std::map<std::string, double> role_percent;
+};
+
+// ------------------- Slow-Client Protection --------------------
+// httplib gives each connection a worker for its whole life and only
+// bounds single reads (read_timeout), so a client trickling a byte every
+// few seconds keeps a worker forever. GuardedServer runs httplib's
+// per-connection loop itself and reads through a GuardedStream that
+// enforces, per request:
+//   - a total deadline for the request line and headers (which also
+//     bounds how long a new connection may stay silent),
+//   - a total deadline for the body and a minimum body rate once a grace
+//     period has passed,
+// and between requests an idle timeout plus a cap on how many kept-alive
+// connections may sit idle holding a worker. A dropped request gets no
+// response; its connection is closed.
+
+struct ClientLimits
+{
+    std::chrono::milliseconds header{5000}; // 0 = off (same below)
+    std::chrono::milliseconds body{60000};
+    size_t min_body_rate = 1024; // bytes/s
+    std::chrono::milliseconds rate_grace{2000};
+    std::chrono::milliseconds idle{5000};
+    size_t max_idle = 0;
+};
+
+class ClientGuard
+{
+public:
+    explicit ClientGuard(const ClientLimits &l) : limits(l) {}
+
+    std::string stats() const
+    {
+        return "slow_header_dropped=" + std::to_string(header_dropped.load()) + "\n" +
+               "slow_body_dropped=" + std::to_string(body_dropped.load()) + "\n" +
+               "slow_rate_dropped=" + std::to_string(rate_dropped.load()) + "\n" +
+               "idle_connections=" + std::to_string(idle_now.load()) + "\n" +
+               "idle_timeouts=" + std::to_string(idle_timeouts.load()) + "\n" +
+               "idle_capped=" + std::to_string(idle_capped.load()) + "\n";
+    }
+
+    const ClientLimits limits;
+    std::atomic<uint64_t> header_dropped{0};
+    std::atomic<uint64_t> body_dropped{0};
+    std::atomic<uint64_t> rate_dropped{0};
+    std::atomic<int64_t> idle_now{0};
+    std::atomic<uint64_t> idle_timeouts{0};
+    std::atomic<uint64_t> idle_capped{0};
+};
+
+// Wraps the SocketStream of one request
+class GuardedStream final : public Stream
+{
+public:
+    GuardedStream(Stream &s, ClientGuard &g, std::chrono::steady_clock::time_point start,
+                  std::chrono::microseconds readTimeout)
+        : inner(s), guard(g), header_deadline(start + g.limits.header), read_timeout(readTimeout) {}
+
+    // Headers are parsed; what follows is the body
+    void start_body()
+    {
+        in_body = true;
+        body_start = std::chrono::steady_clock::now();
+    }
+
+    ssize_t read(char *ptr, size_t size) override
+    {
+        if (dropped)
+            return -1;
+        if (!inner.is_readable()) {
+            // Wait no longer than the phase deadline allows
+            auto limit = in_body ? guard.limits.body : guard.limits.header;
+            if (limit.count() > 0) {
+                auto deadline = in_body ? body_start + limit : header_deadline;
+                auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+                bool capped = left < read_timeout;
+                if (!capped)
+                    left = read_timeout;
+                if (left.count() <= 0 ||
+                    detail::select_read(socket(), left.count() / 1000000, left.count() % 1000000) == 0) {
+                    if (capped)
+                        return drop(in_body ? guard.body_dropped : guard.header_dropped);
+                    return -1; // plain read_timeout, as httplib would
+                }
+            }
+        }
+
+        ssize_t n = inner.read(ptr, size);
+        if (n > 0 && in_body && guard.limits.min_body_rate > 0) {
+            body_bytes += n;
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - body_start).count();
+            if (ms > guard.limits.rate_grace.count() && body_bytes * 1000 < guard.limits.min_body_rate * size_t(ms))
+                return drop(guard.rate_dropped);
+        }
+        return n;
+    }
+
+    // Sends data right behind the next write (httplib's status line and
+    // headers) in the same writev, straight from the caller's buffer
+    void send_after_next_write(std::shared_ptr<const void> owner, const char *data, size_t size)
+    {
+        tail_owner = std::move(owner);
+        tail = data;
+        tail_size = size;
+    }
+
+    ssize_t write(const char *ptr, size_t size) override
+    {
+        if (dropped)
+            return -1;
+        // httplib writes the status line and headers in one piece
+        if (status_code == 0 && size >= 12 && std::memcmp(ptr, "HTTP/1.", 7) == 0)
+            status_code = (ptr[9] - '0') * 100 + (ptr[10] - '0') * 10 + (ptr[11] - '0');
+        if (tail_size > 0)
+            return write_with_tail(ptr, size);
+        return inner.write(ptr, size);
+    }
+
+    // Status of the response written so far (0 = none)
+    int status() const { return status_code; }
+    // Set when the request's body is left unread
+    bool close_after_response = false;
+    bool is_readable() const override { return inner.is_readable(); }
+    bool wait_readable() const override { return inner.wait_readable(); }
+    bool wait_writable() const override { return !dropped && inner.wait_writable(); }
+    void get_remote_ip_and_port(std::string &ip, int &port) const override { inner.get_remote_ip_and_port(ip, port); }
+    void get_local_ip_and_port(std::string &ip, int &port) const override { inner.get_local_ip_and_port(ip, port); }
+    socket_t socket() const override { return inner.socket(); }
+    time_t duration() const override { return inner.duration(); }
+
+private:
+    ssize_t drop(std::atomic<uint64_t> &counter)
+    {
+        counter++;
+        dropped = true;
+        return -1;
+    }
+
+    // Returns how much of ptr went out, like write(); the tail is finished
+    // here once ptr is through, and a failure on it drops the connection
+    ssize_t write_with_tail(const char *ptr, size_t size)
+    {
+        if (!inner.wait_writable()) {
+            clear_tail();
+            return -1;
+        }
+        iovec iov[2] = {{(void *)ptr, size}, {(void *)tail, tail_size}};
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        ssize_t n;
+        do
+            n = sendmsg(socket(), &msg, MSG_NOSIGNAL);
+        while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            clear_tail();
+            return -1;
+        }
+        if (size_t(n) < size)
+            return n; // the rest of ptr comes back with the tail still queued
+
+        size_t sent = n - size;
+        while (sent < tail_size) {
+            ssize_t m = inner.write(tail + sent, tail_size - sent);
+            if (m <= 0) {
+                dropped = true; // the client already has a partial body
+                break;
+            }
+            sent += m;
+        }
+        clear_tail();
+        return size;
+    }
+
+    void clear_tail()
+    {
+        tail_owner.reset();
+        tail = nullptr;
+        tail_size = 0;
+    }
+
+    Stream &inner;
+    ClientGuard &guard;
+    const std::chrono::steady_clock::time_point header_deadline;
+    const std::chrono::microseconds read_timeout;
+    bool in_body = false;
+    bool dropped = false;
+    std::chrono::steady_clock::time_point body_start;
+    size_t body_bytes = 0;
+    int status_code = 0;
+    std::shared_ptr<const void> tail_owner;
+    const char *tail = nullptr;
+    size_t tail_size = 0;
+};
+
+class GuardedServer : public Server
+{
+public:
+    // profile is null for listeners that aren't TCP
+    GuardedServer(ClientGuard &g, const SocketProfile *p = nullptr) : guard(g), profile(p)
+    {
+        if (profile)
+            set_socket_options([p](socket_t sock)
+                               { p->apply_listener(sock); });
+    }
+
+    // listen() with the profile's backlog instead of httplib's fixed one
+    bool serve(const std::string &host, int port)
+    {
+        if (!bind_to_port(host, port))
+            return false;
+        // Linux lets a listening socket change its backlog
+        if (profile)
+            ::listen(svr_sock_, profile->backlog);
+        return listen_after_bind();
+    }
+
+    // Called on the worker thread after each request on a connection, with
+    // the status written (0 if the connection failed first). Unlike
+    // httplib's logger it runs outside logger_mutex_.
+    std::function<void(int status)> on_request_done;
+
+    // Called from the pre-routing handler, on the request's worker thread
+    static void headers_read()
+    {
+        if (GuardedStream *s = current())
+            s->start_body();
+    }
+
+    // For a response sent without reading the request's body: the
+    // connection ends after it instead of parsing the body as a request
+    static void close_after_response()
+    {
+        if (GuardedStream *s = current())
+            s->close_after_response = true;
+    }
+
+    // From the header writer: data goes out after the headers being
+    // written, without a copy. False if this thread isn't serving a
+    // connection of a GuardedServer; the caller then writes it itself.
+    static bool send_after_headers(std::shared_ptr<const void> owner, const char *data, size_t size)
+    {
+        GuardedStream *s = current();
+        if (!s)
+            return false;
+        s->send_after_next_write(std::move(owner), data, size);
+        return true;
+    }
+
+private:
+    static GuardedStream *&current()
+    {
+        static thread_local GuardedStream *s = nullptr;
+        return s;
+    }
+
+    // httplib's process_and_close_socket with our waits and stream
+    bool process_and_close_socket(socket_t sock) override
+    {
+        if (profile)
+            profile->apply_accepted(sock);
+
+        std::string remote_addr, local_addr;
+        int remote_port = 0, local_port = 0;
+        detail::get_remote_ip_and_port(sock, remote_addr, remote_port);
+        detail::get_local_ip_and_port(sock, local_addr, local_port);
+
+        auto start = std::chrono::steady_clock::now();
+        bool ret = false;
+        for (size_t count = keep_alive_max_count_; count > 0; count--) {
+            // A new connection waits against the header deadline
+            bool first = count == keep_alive_max_count_;
+            if (!wait_request(sock, first, start))
+                break;
+            start = std::chrono::steady_clock::now();
+
+            detail::SocketStream strm(sock, read_timeout_sec_, read_timeout_usec_, write_timeout_sec_, write_timeout_usec_);
+            GuardedStream guarded(strm, guard, start,
+                                  std::chrono::seconds(read_timeout_sec_) + std::chrono::microseconds(read_timeout_usec_));
+            bool connection_closed = false;
+            current() = &guarded;
+            RequestClock::current().start = start;
+            ret = process_request(guarded, remote_addr, remote_port, local_addr, local_port,
+                                  count == 1, connection_closed, nullptr);
+            current() = nullptr;
+            if (on_request_done)
+                on_request_done(guarded.status());
+            RequestClock::current().queued = std::chrono::nanoseconds(0);
+            if (guarded.close_after_response) {
+                discard_and_close(sock);
+                return ret;
+            }
+            if (!ret || connection_closed)
+                break;
+        }
+
+        detail::shutdown_socket(sock);
+        detail::close_socket(sock);
+        return ret;
+    }
+
+    // Closing with unread input makes the kernel reset the connection,
+    // which can destroy the response before the client reads it. Half-close
+    // instead and throw away what the client keeps sending, up to a limit
+    // of bytes and time, before closing.
+    static void discard_and_close(socket_t sock)
+    {
+        ::shutdown(sock, SHUT_WR);
+        char buf[16384];
+        size_t left = 1 << 20;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (left > 0 && std::chrono::steady_clock::now() < deadline &&
+               detail::select_read(sock, 0, 100000) > 0) {
+            ssize_t n = ::recv(sock, buf, sizeof(buf), 0);
+            if (n <= 0)
+                break;
+            left -= std::min(left, size_t(n));
+        }
+        detail::close_socket(sock);
+    }
+
+    // Polls in short steps so a server shutdown is noticed (as httplib's
+    // keep_alive() does); false closes the connection
+    bool wait_request(socket_t sock, bool first, std::chrono::steady_clock::time_point start)
+    {
+        const time_t step_us = CPPHTTPLIB_KEEPALIVE_TIMEOUT_CHECK_INTERVAL_USECOND;
+        if (detail::select_read(sock, 0, step_us) > 0)
+            return true;
+
+        const ClientLimits &l = guard.limits;
+        if (!first && l.max_idle > 0 && guard.idle_now.load() >= int64_t(l.max_idle)) {
+            guard.idle_capped++;
+            return false;
+        }
+        auto limit = first ? l.header : l.idle;
+        if (limit.count() == 0)
+            limit = std::chrono::seconds(keep_alive_timeout_sec_);
+
+        guard.idle_now++;
+        bool ready = false;
+        while (svr_sock_ != INVALID_SOCKET) {
+            auto r = detail::select_read(sock, 0, step_us);
+            if (r != 0) {
+                ready = r > 0;
+                break;
+            }
+            if (std::chrono::steady_clock::now() - start > limit) {
+                (first ? guard.header_dropped : guard.idle_timeouts)++;
+                break;
+            }
+        }
+        guard.idle_now--;
+        return ready;
+    }
+
+    ClientGuard &guard;
+    const SocketProfile *profile;
+};
+
+// ------------------- Benchmarks --------------------
+// In-process cache micro-benchmarks (no DB needed): kvserver --bench-keys N
+
+static double bench_ns_per_op(size_t ops, const std::function<void(size_t)> &op)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; i++)
+        op(i);
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / ops;
+}
+
+void run_key_benchmark(size_t ops)
+{
+    const size_t keyspace = 100000;
+    std::mt19937_64 rng(42);
+    std::vector<std::string> keys(ops);
+    for (auto &k : keys)
+        k = "k" + std::to_string(rng() % keyspace);
+    std::string v(100, 'v'), out;
+
+    LRUCache str_cache(keyspace);
+    IntLRUCache int_cache(keyspace);
+    IntKeyCodec codec;
+    codec.add("k", 0);
+    uint64_t packed, id;
+    int ns;
+
+    double sp = bench_ns_per_op(ops, [&](size_t i)
+                                { str_cache.put(keys[i], v); });
+    double sg = bench_ns_per_op(ops, [&](size_t i)
+                                { str_cache.get(keys[i], out); });
+    // The int path includes parsing the request key once per op
+    double ip = bench_ns_per_op(ops, [&](size_t i)
+                                { codec.parse(keys[i], packed, ns, id); int_cache.put(packed, v); });
+    double ig = bench_ns_per_op(ops, [&](size_t i)
+                                { codec.parse(keys[i], packed, ns, id); int_cache.get(packed, out); });
+
+    std::cout << "ops=" << ops << " keyspace=" << keyspace << " value_bytes=" << v.size() << "\n"
+              << "string_put_ns=" << sp << "\n"
+              << "string_get_ns=" << sg << "\n"
+              << "int_put_ns=" << ip << "\n"
+              << "int_get_ns=" << ig << "\n";
+}
+
+// Read-through loop (get, put on miss) over a cache holding half the
+// keyspace, split across threads; returns ns per op of wall time
+template <typename Cache, typename K>
+double bench_read_through(Cache &cache, const std::vector<K> &keys, int threads)
+{
+    const std::string v(100, 'v');
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+        workers.emplace_back([&, t]
+                             {
+            std::string out;
+            for (size_t i = t; i < keys.size(); i += threads)
+                if (!cache.get(keys[i], out))
+                    cache.put(keys[i], v); });
+    for (auto &w : workers)
+        w.join();
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / keys.size();
+}
+
+template <typename Cache, typename K>
+void bench_policy(const char *name, const std::vector<K> &keys, size_t capacity, int threads)
+{
+    Cache cache(capacity);
+    std::cout << name << " threads=" << threads << " ns_per_op=" << bench_read_through(cache, keys, threads) << "\n";
+}
+
+// kvserver --bench-policies N: the server's string and int caches under
+// each lock policy, then the flat cache under each eviction policy and
+// with string keys
+void run_policy_benchmark(size_t ops)
+{
+    const size_t keyspace = 100000;
+    const size_t capacity = keyspace / 2;
+    std::mt19937_64 rng(7);
+    // Skewed: most lookups land in the first twentieth of the keyspace
+    std::vector<uint64_t> ids(ops);
+    for (auto &id : ids)
+        id = (rng() % keyspace) * (rng() % 4 == 0) + (rng() % (keyspace / 20));
+    std::vector<std::string> skeys(ops);
+    for (size_t i = 0; i < ops; i++)
+        skeys[i] = "k" + std::to_string(ids[i]);
+    int mt = std::max(2u, std::thread::hardware_concurrency());
+
+    bench_policy<BasicLRUCache<NoLock>>("LRUCache<NoLock>", skeys, capacity, 1);
+    bench_policy<BasicLRUCache<MutexLock>>("LRUCache<MutexLock>", skeys, capacity, 1);
+    bench_policy<BasicIntLRUCache<NoLock>>("IntLRUCache<NoLock>", ids, capacity, 1);
+    bench_policy<BasicIntLRUCache<MutexLock>>("IntLRUCache<MutexLock>", ids, capacity, 1);
+
+    bench_policy<BasicLRUCache<SpinLock>>("LRUCache<SpinLock>", skeys, capacity, mt);
+    bench_policy<BasicLRUCache<MutexLock>>("LRUCache<MutexLock>", skeys, capacity, mt);
+    bench_policy<BasicIntLRUCache<SpinLock>>("IntLRUCache<SpinLock>", ids, capacity, mt);
+    bench_policy<BasicIntLRUCache<MutexLock>>("IntLRUCache<MutexLock>", ids, capacity, mt);
+
+    bench_policy<FlatCache<uint64_t, std::string, FifoEvict, NoLock>>("FlatCache<FIFO,NoLock>", ids, capacity, 1);
+    bench_policy<FlatCache<uint64_t, std::string, ClockEvict, NoLock>>("FlatCache<CLOCK,NoLock>", ids, capacity, 1);
+    bench_policy<FlatCache<uint64_t, std::string, ClockEvict, SpinLock>>("FlatCache<CLOCK,SpinLock>", ids, capacity, mt);
+    bench_policy<FlatCache<std::string, std::string, LruEvict, NoLock, std::hash<std::string>>>(
+        "FlatCache<string,LRU,NoLock>", skeys, capacity, 1);
+}
+
+// kvserver --bench-copies N: allocations per PUT and GET of the value path
+// above against the previous one (req.body copied into a local, copied
+// into the cache, copied out again and concatenated into the reply).
+// "copies" counts allocations at least as large as the value, each of
+// which holds a full copy of it.
+//
+// Counting replaces the global operator new, so it is only compiled into
+// benchmark builds (-DKV_BENCH_ALLOC), never into the server that ships.
+
+#ifdef KV_BENCH_ALLOC
+struct AllocCounter
+{
+    bool on = false;
+    size_t large_min = 0;
+    uint64_t allocs = 0;
+    uint64_t bytes = 0;
+    uint64_t large = 0;
+};
+static thread_local AllocCounter alloc_counter;
+
+void *operator new(size_t n)
+{
+    if (alloc_counter.on) {
+        alloc_counter.allocs++;
+        alloc_counter.bytes += n;
+        alloc_counter.large += n >= alloc_counter.large_min;
+    }
+    if (void *p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+void run_copy_benchmark(size_t ops)
+{
+    for (size_t size : {size_t(1) << 10, size_t(64) << 10, size_t(1) << 20}) {
+        std::string wire(size, 'v'); // the body as it arrives on the socket
+        Request req;
+        req.set_header("Content-Length", std::to_string(size));
+        // Feeds the body in httplib's receive-buffer sized pieces
+        ContentReader reader([&](ContentReceiver receiver)
+                             {
+                                 for (size_t off = 0; off < size; off += CPPHTTPLIB_RECV_BUFSIZ)
+                                     if (!receiver(wire.data() + off, std::min(CPPHTTPLIB_RECV_BUFSIZ, size - off)))
+                                         return false;
+                                 return true; },
+                             nullptr);
+        LRUCache cache(16);
+
+        auto measure = [&](const char *name, const std::function<void()> &op)
+        {
+            alloc_counter = AllocCounter{true, size};
+            double ns = bench_ns_per_op(ops, [&](size_t)
+                                        { op(); });
+            AllocCounter c = alloc_counter;
+            alloc_counter.on = false;
+            std::cout << name << " value_bytes=" << size << " ns=" << ns
+                      << " allocs=" << double(c.allocs) / ops
+                      << " alloc_bytes=" << double(c.bytes) / ops
+                      << " copies=" << double(c.large) / ops << "\n";
+        };
+
+        measure("legacy_put", [&]
+                {
+            std::string body;
+            reader([&](const char *data, size_t n)
+                   { body.append(data, n); return true; });
+            std::string value = body;
+            cache.put("k", value); });
+        measure("legacy_get", [&]
+                {
+            std::string value;
+            cache.get("k", value);
+            Response res;
+            res.set_content("CACHE HIT: " + value, "text/plain"); });
+        measure("put", [&]
+                { cache.put("k", read_body(req, reader)); });
+        measure("get", [&]
+                {
+            SharedValue value;
+            cache.get("k", value);
+            Response res;
+            reply_value(req, res, "CACHE HIT: ", value); });
+    }
+}
+#endif
+
+// ------------------- Self-Test --------------------
+// kvserver --self-test: invariants that are easy to break and invisible
+// until a stale or lost value is served. Prints one line per check and
+// exits 1 if any fails.
+
+bool self_check(bool ok, const char *what)
+{
+    std::cout << (ok ? "ok    " : "FAIL  ") << what << "\n";
+    return ok;
+}
+
+// Random inserts and erases against ArtIndex and a std::set, with keys
+// that force every node size, prefixes longer than MAX_PREFIX, keys that
+// are prefixes of other keys and the empty key. Checks lookups, limited
+// prefix scans (in order) and that the tree is freed once empty.
+bool check_art_against_set()
+{
+    struct SelfKey
+    {
+        const std::string &operator()(const std::string &s) const { return s; }
+    };
+    ArtIndex<std::string, SelfKey> art;
+    std::set<std::string> model;
+    std::mt19937_64 rng(11);
+
+    auto key = [&]
+    {
+        switch (rng() % 4)
+        {
+        case 0:
+            return "user:" + std::to_string(rng() % 5000);
+        case 1:
+        {
+            std::string k(rng() % 3, '\0'); // up to Node256 fan-out, and ""
+            for (auto &c : k)
+                c = char(rng() % 256);
+            return k;
+        }
+        case 2:
+            return std::string("shared-prefix-longer-than-max/") + std::string(rng() % 3, 'x') + char('a' + rng() % 26);
+        default:
+            return std::string(rng() % 16, 'a'); // each a prefix of the next
+        }
+    };
+
+    auto same_prefix = [&](const std::string &prefix, size_t limit)
+    {
+        std::vector<std::string> got;
+        art.for_each_prefix(prefix, [&](const std::string &k)
+                            {
+            got.push_back(k);
+            return got.size() < limit; });
+        auto it = model.lower_bound(prefix);
+        for (auto &k : got)
+        {
+            if (it == model.end() || *it != k)
+                return false;
+            ++it;
+        }
+        bool atEnd = it == model.end() || it->compare(0, prefix.size(), prefix) != 0;
+        return got.size() == limit || atEnd;
+    };
+
+    bool ok = true;
+    for (int i = 0; i < 200000 && ok; i++)
+    {
+        std::string k = key();
+        if (rng() % 3 == 0)
+            ok &= art.erase(k) == (model.erase(k) == 1);
+        else
+        {
+            art.insert(k, k);
+            model.insert(k);
+        }
+
+        if (i % 97 == 0)
+        {
+            std::string probe = key();
+            std::string *found = art.find(probe);
+            ok &= found ? *found == probe && model.count(probe) : !model.count(probe);
+            std::string prefix = key();
+            prefix.resize(rng() % (prefix.size() + 1));
+            ok &= same_prefix(prefix, 1 + rng() % 40);
+            ok &= art.size() == model.size();
+        }
+    }
+    ok &= same_prefix("", SIZE_MAX);
+
+    for (auto &k : model)
+        ok &= art.erase(k);
+    ok &= art.size() == 0 && art.memory_bytes() == 0;
+    return ok;
+}
+
+// Random puts and deletes against kvlsm and a std::map, with a memtable
+// small enough to flush and compact many times, comparing point reads and
+// bounded scans along the way and everything after a reopen
+// FlatCache with string keys (probing and backward-shift deletes on a
+// non-integer hash) against a list-and-map model of LRU and FIFO, plus the
+// order CLOCK evicts in
+template <typename Evict>
+bool check_flat_against_model(bool reorder_on_hit)
+{
+    FlatCache<std::string, std::string, Evict, NoLock, std::hash<std::string>> cache(64);
+    std::list<std::string> order; // front = next to keep
+    std::map<std::string, std::string> model;
+    std::mt19937_64 rng(5);
+    std::string v;
+
+    auto bump = [&](const std::string &k)
+    {
+        order.remove(k);
+        order.push_front(k);
+    };
+    for (int i = 0; i < 100000; i++)
+    {
+        std::string k = "k" + std::to_string(rng() % 200);
+        int op = rng() % 4;
+        if (op == 0)
+        {
+            cache.remove(k);
+            model.erase(k);
+            order.remove(k);
+        }
+        else if (op == 1)
+        {
+            bool hit = cache.get(k, v);
+            auto it = model.find(k);
+            if (hit != (it != model.end()) || (hit && v != it->second))
+                return false;
+            if (hit && reorder_on_hit)
+                bump(k);
+        }
+        else
+        {
+            std::string val = std::to_string(i);
+            if (model.count(k))
+            {
+                if (reorder_on_hit)
+                    bump(k);
+            }
+            else
+            {
+                if (model.size() == 64)
+                {
+                    model.erase(order.back());
+                    order.pop_back();
+                }
+                order.push_front(k);
+            }
+            cache.put(k, val);
+            model[k] = val;
+        }
+        if (cache.size() != model.size())
+            return false;
+    }
+    for (auto &kv : model)
+        if (!cache.peek(kv.first, v) || v != kv.second)
+            return false;
+    return true;
+}
+
+bool check_clock_order()
+{
+    FlatCache<uint64_t, std::string, ClockEvict, NoLock> cache(3);
+    std::vector<uint64_t> evicted;
+    cache.set_on_evict([&](uint64_t k)
+                       { evicted.push_back(k); });
+    std::string v;
+    cache.put(1, "a");
+    cache.put(2, "b");
+    cache.put(3, "c");
+    cache.get(1, v);
+    cache.get(2, v);
+    cache.put(4, "d"); // 1 and 2 get a second chance, 3 goes
+    cache.put(5, "e"); // bits cleared by the sweep: 1 is oldest again
+    return evicted == std::vector<uint64_t>{3, 1};
+}
+
+// Late failures while OPEN leave the reopen time alone; a failed probe
+// reopens for twice the cooldown
+bool check_circuit_breaker()
+{
+    using ms = std::chrono::milliseconds;
+    CircuitBreaker cb(2, ms(20), ms(1000));
+    auto allowed = [&]
+    {
+        try
+        {
+            cb.before();
+            return true;
+        }
+        catch (const DbUnavailable &)
+        {
+            return false;
+        }
+    };
+
+    cb.failure();
+    cb.failure();
+    if (allowed())
+        return false;
+    for (int i = 0; i < 5; i++)
+        cb.failure(); // in-flight calls failing after the trip
+    std::this_thread::sleep_for(ms(30));
+    if (!allowed()) // the probe
+        return false;
+    cb.failure();
+    std::this_thread::sleep_for(ms(25));
+    if (allowed())
+        return false;
+    std::this_thread::sleep_for(ms(30));
+    if (!allowed())
+        return false;
+    cb.success();
+    return allowed() && cb.stats().find("db_circuit_trips=2\n") != std::string::npos;
+}
+
+// rm -r for the self-test's temporary directories
+void remove_tree(const std::string &path)
+{
+    if (DIR *d = opendir(path.c_str()))
+    {
+        while (struct dirent *e = readdir(d))
+            if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
+            {
+                std::string child = path + "/" + e->d_name;
+                struct stat st;
+                if (lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+                    remove_tree(child);
+                else
+                    unlink(child.c_str());
+            }
+        closedir(d);
+    }
+    rmdir(path.c_str());
+}
+
+bool check_lsm_against_map()
+{
+    char dirTemplate[] = "/tmp/kvlsm-selftest-XXXXXX";
+    if (!mkdtemp(dirTemplate))
+        return false;
+    std::string dir = dirTemplate;
+
+    kvlsm::Options opts;
+    opts.memtable_bytes = 16 << 10;
+    opts.block_bytes = 512;
+    opts.table_bytes = 32 << 10;
+    opts.level1_bytes = 64 << 10;
+
+    std::map<std::string, std::string> model;
+    std::mt19937_64 rng(42);
+    auto key = [&]
+    {
+        return "k" + std::to_string(rng() % 2000);
+    };
+
+    auto same_range = [&](kvlsm::DB &lsm, const std::string &start, const std::string &end, size_t limit)
+    {
+        std::vector<std::pair<std::string, std::string>> got;
+        lsm.scan(start, end, limit, [&](const std::string &k, const std::string &v)
+                 {
+            got.emplace_back(k, v);
+            return true; });
+        auto it = model.lower_bound(start);
+        for (auto &kv : got)
+        {
+            if (it == model.end() || it->first != kv.first || it->second != kv.second)
+                return false;
+            ++it;
+        }
+        bool atEnd = it == model.end() || (!end.empty() && it->first >= end);
+        return limit ? got.size() == limit || atEnd : atEnd;
+    };
+
+    bool ok = true;
+    {
+        std::unique_ptr<kvlsm::DB> lsm(new kvlsm::DB(dir, opts));
+        for (int i = 0; i < 50000 && ok; i++)
+        {
+            std::string k = key();
+            if (rng() % 4 == 0)
+            {
+                lsm->del(k);
+                model.erase(k);
+            }
+            else
+            {
+                std::string v = std::to_string(i) + std::string(rng() % 64, 'v');
+                lsm->put(k, v);
+                model[k] = v;
+            }
+
+            if (i % 500 == 0)
+            {
+                std::string probe = key(), got;
+                auto m = model.find(probe);
+                ok &= lsm->get(probe, got) ? m != model.end() && m->second == got : m == model.end();
+                std::string a = key(), b = key();
+                ok &= same_range(*lsm, std::min(a, b), std::max(a, b), rng() % 50);
+            }
+            if (i == 25000)
+            {
+                lsm.reset(); // reopen mid-run
+                lsm.reset(new kvlsm::DB(dir, opts));
+            }
+        }
+        ok &= same_range(*lsm, "", "", 0);
+    }
+    {
+        kvlsm::DB lsm(dir, opts);
+        ok &= same_range(lsm, "", "", 0);
+    }
+
+    remove_tree(dir);
+    return ok;
+}
+
+// A kvserver child on a free loopback port with the LSM backend, a blob
+// tier (4 KiB threshold) and a fresh data directory, for checks that have
+// to go through the HTTP handlers. Killed and cleaned up on destruction.
+class SelfTestServer
+{
+public:
+    explicit SelfTestServer(const std::vector<std::string> &extra = {})
+    {
+        char dirTemplate[] = "/tmp/kvserver-selftest-XXXXXX";
+        if (!mkdtemp(dirTemplate))
+            return;
+        dir = dirTemplate;
+        port = free_port();
+        std::vector<std::string> args = {"kvserver", "--storage", "lsm", "--lsm-dir", dir + "/lsm",
+                                         "--blob-dir", dir + "/blobs", "--blob-threshold", "4096",
+                                         "--port", std::to_string(port)};
+        args.insert(args.end(), extra.begin(), extra.end());
+
+        pid = fork();
+        if (pid == 0)
+        {
+            int null = ::open("/dev/null", O_WRONLY);
+            dup2(null, 1);
+            dup2(null, 2);
+            std::vector<char *> argv;
+            for (auto &a : args)
+                argv.push_back(&a[0]);
+            argv.push_back(nullptr);
+            execv("/proc/self/exe", argv.data());
+            _exit(127);
+        }
+
+        Client cli("127.0.0.1", port);
+        for (int i = 0; i < 100 && pid > 0 && port > 0; i++)
+        {
+            if (cli.Get("/stats"))
+            {
+                ready = true;
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+
+    ~SelfTestServer()
+    {
+        if (pid > 0)
+        {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+        if (!dir.empty())
+            remove_tree(dir);
+    }
+
+    bool ready = false;
+    int port = 0;
+
+private:
+    static int free_port()
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        int port = 0;
+        if (fd >= 0 && bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+            getsockname(fd, (sockaddr *)&addr, &len) == 0)
+            port = ntohs(addr.sin_port);
+        if (fd >= 0)
+            ::close(fd);
+        return port;
+    }
+
+    pid_t pid = -1;
+    std::string dir;
+};
+
+// PATCH appends and overwrites, its 416 and 400 answers, and Range GETs
+// served from the DB and from a blob the patch pushed past the threshold
+bool check_patch_and_ranges()
+{
+    SelfTestServer server;
+    if (!server.ready)
+        return false;
+    Client cli("127.0.0.1", server.port);
+    bool ok = true;
+
+    auto patch = [&](const std::string &key, size_t first, const std::string &data)
+    {
+        Headers h = {{"Content-Range", "bytes " + std::to_string(first) + "-" + std::to_string(first + data.size() - 1) + "/*"}};
+        auto r = cli.Patch("/kv/" + key, h, data.data(), data.size(), "application/octet-stream");
+        return r ? r->status : -1;
+    };
+    // Raw bytes [first, last] of a value, or "" if the GET fails
+    auto range = [&](const std::string &key, size_t first, size_t last)
+    {
+        auto r = cli.Get("/kv/" + key, Headers{make_range_header({{first, last}})});
+        return r && r->status == 206 ? r->body : std::string();
+    };
+
+    ok &= cli.Put("/kv/p", "hello", "text/plain")->status == 200;
+    ok &= patch("p", 5, " world") == 200;
+    ok &= range("p", 0, 10) == "hello world";
+    ok &= patch("p", 0, "J") == 200;
+    ok &= range("p", 0, 10) == "Jello world";
+    ok &= patch("p", 12, "x") == 416;
+    ok &= patch("missing", 0, "x") == 416;
+
+    // The marker arrives one byte at a time
+    ok &= cli.Put("/kv/m", "xblob:tail", "text/plain")->status == 200;
+    ok &= patch("m", 0, "\x01") == 400;
+    ok &= range("m", 0, 9) == "xblob:tail";
+
+    std::string big(3000, '\0');
+    for (size_t i = 0; i < big.size(); i++)
+        big[i] = char('a' + i % 26);
+    ok &= cli.Put("/kv/g", big, "application/octet-stream")->status == 200;
+    ok &= range("g", 500, 509) == big.substr(500, 10);
+
+    // Append across the 4 KiB threshold: the value moves to a blob
+    std::string tail(2000, 'Z');
+    ok &= patch("g", big.size(), tail) == 200;
+    big += tail;
+    auto stats = cli.Get("/stats");
+    ok &= stats && stats->body.find("blob_puts=1\n") != std::string::npos;
+    ok &= range("g", 2990, 3009) == big.substr(2990, 20);
+    ok &= range("g", 0, big.size() - 1) == big;
+
+    // Patching the blob writes a new one
+    ok &= patch("g", 1, "!!") == 200;
+    big.replace(1, 2, "!!");
+    ok &= range("g", 0, 3) == big.substr(0, 4);
+    ok &= range("g", 4990, 4999) == big.substr(4990);
+    return ok;
+}
+
+// Writes head on a fresh connection, then rest once the server has had
+// time to answer (so rest can't share a read buffer with head), and
+// returns everything sent back until the server closes or a few seconds
+// pass
+std::string raw_exchange(int port, const std::string &head, const std::string &rest)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    timeval tv{3, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    std::string reply;
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+        send(fd, head.data(), head.size(), MSG_NOSIGNAL) == ssize_t(head.size()))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        send(fd, rest.data(), rest.size(), MSG_NOSIGNAL); // fails once closed
+        char buf[4096];
+        ssize_t n;
+        while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+            reply.append(buf, n);
+    }
+    ::close(fd);
+    return reply;
+}
+
+// Requests the body budget turns away are answered before their body is
+// read; the bytes after the headers must not run as another request
+bool check_budget_rejection_closes()
+{
+    SelfTestServer server({"--inflight-mb", "1"});
+    if (!server.ready)
+        return false;
+    const std::string smuggled = "PUT /kv/smuggled HTTP/1.1\r\nHost: x\r\nContent-Length: 1\r\n\r\nx";
+    bool ok = true;
+
+    // Over the budget: only the start of the 2 MiB body is ever sent
+    std::string reply = raw_exchange(server.port, "PUT /kv/big HTTP/1.1\r\nHost: x\r\nContent-Length: 2097152\r\n\r\n", smuggled);
+    ok &= reply.compare(0, 12, "HTTP/1.1 413") == 0 && reply.find("HTTP/1.1", 1) == std::string::npos;
+
+    // Chunked while a budget is set
+    reply = raw_exchange(server.port, "PUT /kv/chunked HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n", smuggled);
+    ok &= reply.compare(0, 12, "HTTP/1.1 411") == 0 && reply.find("HTTP/1.1", 1) == std::string::npos;
+
+    Client cli("127.0.0.1", server.port);
+    auto r = cli.Get("/kv/smuggled");
+    return ok && r && r->status == 404;
+}
+
+int run_self_test()
+{
+    bool ok = true;
+    std::string v;
+
+    {
+        LRUCache cache(16);
+        cache.register_prefix("user:");
+        cache.register_prefix("user:123:");
+        cache.put("user:123:name", "a");
+        cache.put("user:9", "b");
+        cache.put("other", "c");
+        cache.bump_prefix("user:");
+        ok &= self_check(!cache.get("user:123:name", v), "bumping a prefix invalidates keys under a nested registered prefix");
+        ok &= self_check(!cache.get("user:9", v), "bumping a prefix invalidates its own keys");
+        ok &= self_check(cache.get("other", v) && v == "c", "bumping a prefix leaves unrelated keys");
+
+        cache.put("user:123:name", "d");
+        cache.put("user:7", "e");
+        cache.bump_prefix("user:123:");
+        ok &= self_check(!cache.get("user:123:name", v), "bumping a nested prefix invalidates its keys");
+        ok &= self_check(cache.get("user:7", v) && v == "e", "bumping a nested prefix leaves its parent's other keys");
+    }
+    {
+        // Inner prefix registered after the outer one, with keys cached
+        // on both sides of the registration
+        LRUCache cache(16);
+        cache.register_prefix("a:");
+        cache.put("a:b:1", "x");
+        cache.register_prefix("a:b:");
+        cache.put("a:b:2", "y");
+        cache.bump_prefix("a:");
+        ok &= self_check(!cache.get("a:b:1", v) && !cache.get("a:b:2", v),
+                         "an ancestor registered first still invalidates a later nested prefix");
+
+        // Outer prefix registered after the inner one
+        cache.register_prefix("z:y:");
+        cache.put("z:y:1", "x");
+        cache.register_prefix("z:");
+        cache.put("z:y:2", "y");
+        cache.bump_prefix("z:");
+        ok &= self_check(!cache.get("z:y:2", v), "an ancestor registered later invalidates an existing nested prefix");
+    }
+
+    ok &= self_check(check_art_against_set(), "ART index matches std::set through inserts, erases and prefix scans");
+    ok &= self_check(check_flat_against_model<LruEvict>(true), "flat cache with string keys matches an LRU model");
+    ok &= self_check(check_flat_against_model<FifoEvict>(false), "flat cache with string keys matches a FIFO model");
+    ok &= self_check(check_clock_order(), "CLOCK gives hit entries a second chance");
+    ok &= self_check(check_circuit_breaker(), "circuit breaker ignores failures while open and doubles the cooldown after a failed probe");
+    ok &= self_check(check_lsm_against_map(), "LSM matches std::map through flushes, compactions and reopen");
+    ok &= self_check(check_budget_rejection_closes(), "body budget rejections close the connection instead of parsing the body");
+    ok &= self_check(check_patch_and_ranges(), "PATCH appends, 416 past the end, 400 on the blob marker, ranges across the blob threshold");
+
+    return ok ? 0 : 1;
+}
+
+// ------------------- MAIN SERVER --------------------
+
+struct ServerConfig
+{
+    int port = 8080;
+    // Path of an additional Unix-domain-socket listener (empty = off)
+    std::string unix_socket;
+    size_t cache_entries = 1000;
+    size_t cache_bytes = 0; // 0 = limited by entry count only
+    EvictionPolicy eviction = EvictionPolicy::LRU;
+    CacheIndex cache_index = CacheIndex::Hash;
+    // Window the miss batcher waits to collect more misses (0 = no
+    // batching). Off by default: every miss would wait out the window,
+    // even with no other miss to share the query with.
+    int batch_window_us = 0;
+    size_t batch_max = 256;
+    // Batches in flight at once (one DB connection each)
+    size_t batch_flushers = 4;
+    // Hot entries older than this are reloaded in the background (0 = off)
+    int refresh_age_ms = 0;
+    uint32_t refresh_min_hits = 3;
+    // Prefixes registered for generation-based invalidation at startup
+    std::vector<std::string> prefixes;
+    size_t prefix_delete_batch = 1000;
+    // Prefixes whose <prefix><integer> keys use the integer-key fast path
+    std::vector<std::string> int_prefixes;
+    // POSIX shm name of the hot-key table for local readers (empty = off)
+    std::string shm_name;
+    uint32_t shm_buckets = 4096;
+    uint32_t shm_value_max = 1024;
+    uint32_t shm_max_age_ms = 1000;
+    uint32_t shm_mode = 0600;
+    // Merge concurrent PUTs to the same key into one DB write
+    bool coalesce_writes = false;
+    // "pg" (Postgres) or "lsm" (embedded engine in lsm_dir)
+    std::string storage = "pg";
+    std::string lsm_dir = "kvdata";
+    kvlsm::Options lsm;
+    // Values of at least blob_threshold bytes go to files in blob_dir (empty = off)
+    std::string blob_dir;
+    size_t blob_threshold = 1 << 20;
+    // Adaptive worker pool bounds (pool_max 0 = httplib's fixed pool)
+    size_t pool_min = 4;
+    size_t pool_max = 0;
+    int pool_target_wait_us = 1000;
+    // Pre-serialized responses for up to hot_responses hot keys (0 = off)
+    size_t hot_responses = 0;
+    uint32_t hot_min_hits = 8;
+    size_t hot_value_max = 16 * 1024;
+    int hot_max_age_ms = 1000;
+    // Global cap on buffered request bodies (0 = unlimited)
+    size_t inflight_bytes = 0;
+    int inflight_wait_ms = 500;
+    // Slow-client deadlines and idle connection limits
+    ClientLimits clients;
+    // Requests served per keep-alive connection
+    size_t keep_alive_max = CPPHTTPLIB_KEEPALIVE_MAX_COUNT;
+    // TCP listener and connection options
+    SocketProfile socket;
+    // Publish interval of /stats/stream
+    int stats_stream_ms = 1000;
+    size_t stats_stream_max = 4;
+    // Return freed heap to the OS once cached bytes drop this far below
+    // their peak (0 = only via POST /memory/trim)
+    size_t trim_after_bytes = size_t(64) << 20;
+};
+
+static const char *USAGE =
+    "  --port N                  TCP port (8080)\n"
+    "  --unix PATH               also listen on a Unix-domain socket\n"
+    "  --socket-profile NAME     default, low-latency or high-throughput\n"
+    "  --storage pg|lsm          storage engine (pg)\n"
+    "  --lsm-dir DIR             LSM data directory (kvdata)\n"
+    "  --lsm-sync                fsync the LSM log on every write\n"
+    "  --lsm-threads N           LSM flush/compaction threads\n"
+    "  --lsm-memtable-mb N       LSM memtable size\n"
+    "  --cache-size N            cached entries (1000)\n"
+    "  --cache-bytes N           cached bytes (0 = entry count only)\n"
+    "  --eviction lru|gdsf       eviction policy (lru)\n"
+    "  --cache-index hash|art    cache index (hash)\n"
+    "  --batch-window-us N       batch concurrent misses (0 = off)\n"
+    "  --batch-max N             misses per batch (256)\n"
+    "  --batch-flushers N        batch queries in flight at once (4)\n"
+    "  --refresh-age-ms N        refresh hot entries older than N (0 = off)\n"
+    "  --refresh-min-hits N      hits before an entry is refreshed (3)\n"
+    "  --prefix P                register P for prefix invalidation\n"
+    "  --prefix-delete-batch N   rows per prefix delete statement, >= 1 (1000)\n"
+    "  --int-prefix P            store <P><integer> keys in the integer table\n"
+    "                            (up to 256 distinct prefixes);\n"
+    "                            they bypass batching, refresh-ahead, --eviction,\n"
+    "                            --cache-bytes and the blob tier\n"
+    "  --coalesce-writes         merge concurrent PUTs to one key\n"
+    "  --blob-dir DIR            store large values as files in DIR\n"
+    "  --blob-threshold N        smallest blob value in bytes (1 MiB)\n"
+    "  --shm NAME                publish hot keys to shared memory\n"
+    "  --shm-buckets N           shared-memory table buckets (4096)\n"
+    "  --shm-value-max N         largest shared-memory value (1024)\n"
+    "  --shm-max-age-ms N        readers skip older entries (1000, 0 = no limit)\n"
+    "  --shm-mode OCTAL          shared-memory permissions (600)\n"
+    "  --hot-responses N         pre-serialized hot responses (0 = off)\n"
+    "  --hot-min-hits N          hits before a response is cached (8)\n"
+    "  --hot-value-max N         largest pre-serialized value (16384)\n"
+    "  --hot-max-age-ms N        pre-serialized response lifetime (1000)\n"
+    "  --pool-min N              adaptive pool minimum workers (4)\n"
+    "  --pool-max N              adaptive pool maximum (0 = fixed pool)\n"
+    "  --pool-target-wait-us N   queue wait the pool grows to hold (1000)\n"
+    "  --inflight-mb N           cap on buffered request bodies (0 = off)\n"
+    "  --inflight-wait-ms N      wait for budget before 503 (500)\n"
+    "  --header-timeout-ms N     deadline for request headers (5000)\n"
+    "  --body-timeout-ms N       deadline for a request body (60000)\n"
+    "  --min-body-rate N         slowest body upload in bytes/s (1024)\n"
+    "  --idle-timeout-ms N       keep-alive idle timeout (5000)\n"
+    "  --max-idle-conns N        cap on idle keep-alive connections (0 = off)\n"
+    "  --keep-alive-max N        requests per keep-alive connection (100)\n"
+    "  --stats-stream-ms N       /stats/stream interval, at least 100 (1000)\n"
+    "  --stats-stream-max N      concurrent /stats/stream clients (4, 0 = off)\n"
+    "  --trim-after-mb N         trim the heap after N MB of evictions (64)\n"
+    "  --bench-keys N | --bench-copies N | --bench-policies N\n"
+    "                            run a benchmark and exit (--bench-copies\n"
+    "                            needs a -DKV_BENCH_ALLOC build)\n"
+    "  --self-test               check invariants (caches, LSM, PATCH/Range\n"
+    "                            through a child server) and exit\n";
+
+int main(int argc, char *argv[])
+{
+    ServerConfig cfg;
+
+    // A missing or malformed flag value prints usage instead of reading
+    // past argv or escaping from stoul as an uncaught exception
+    std::string a;
+    auto text = [&](int &i) -> std::string
+    {
+        if (i + 1 >= argc)
+            throw std::invalid_argument(a + " needs a value");
+        return argv[++i];
+    };
+    auto number = [&](int &i, unsigned long long max, int base = 10) -> unsigned long long
+    {
+        std::string v = text(i);
+        size_t end = 0;
+        unsigned long long n = 0;
+        if (!v.empty() && v[0] != '-') {
+            try {
+                n = std::stoull(v, &end, base);
+            } catch (const std::exception &) {
+                end = 0;
+            }
+        }
+        if (v.empty() || end != v.size() || n > max)
+            throw std::invalid_argument(a + (base == 8 ? " expects an octal mode" : " expects a non-negative number") +
+                                        (max < SIZE_MAX && base == 10 ? " up to " + std::to_string(max) : std::string()) +
+                                        ", got \"" + v + "\"");
+        return n;
+    };
+
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            a = argv[i];
+            if (a == "--help")
+            {
+                std::cout << "Usage: " << argv[0] << " [options]\n"
+                          << USAGE;
+                return 0;
+            }
+            else if (a == "--port")
+                cfg.port = int(number(i, 65535));
+            else if (a == "--unix")
+                cfg.unix_socket = text(i);
+            else if (a == "--cache-size")
+                cfg.cache_entries = number(i, SIZE_MAX);
+            else if (a == "--cache-bytes")
+                cfg.cache_bytes = number(i, SIZE_MAX);
+            else if (a == "--eviction")
+            {
+                std::string name = text(i);
+                if (name != "lru" && name != "gdsf")
+                {
+                    std::cerr << "Unknown eviction policy " << name << " (lru, gdsf)" << std::endl;
+                    return 1;
+                }
+                cfg.eviction = name == "gdsf" ? EvictionPolicy::GDSF : EvictionPolicy::LRU;
+            }
+            else if (a == "--cache-index")
+            {
+                std::string name = text(i);
+                if (name != "hash" && name != "art")
+                {
+                    std::cerr << "Unknown cache index " << name << " (hash, art)" << std::endl;
+                    return 1;
+                }
+                cfg.cache_index = name == "art" ? CacheIndex::ART : CacheIndex::Hash;
+            }
+            else if (a == "--batch-window-us")
+                cfg.batch_window_us = int(number(i, INT_MAX));
+            else if (a == "--batch-max")
+            {
+                cfg.batch_max = number(i, SIZE_MAX);
+                if (cfg.batch_max == 0)
+                    throw std::invalid_argument("--batch-max must be at least 1");
+            }
+            else if (a == "--batch-flushers")
+            {
+                cfg.batch_flushers = number(i, 1024);
+                if (cfg.batch_flushers == 0)
+                    throw std::invalid_argument("--batch-flushers must be at least 1");
+            }
+            else if (a == "--refresh-age-ms")
+                cfg.refresh_age_ms = int(number(i, INT_MAX));
+            else if (a == "--refresh-min-hits")
+                cfg.refresh_min_hits = uint32_t(number(i, UINT32_MAX));
+            else if (a == "--prefix")
+                cfg.prefixes.push_back(text(i));
+            else if (a == "--prefix-delete-batch")
+            {
+                cfg.prefix_delete_batch = number(i, SIZE_MAX);
+                if (cfg.prefix_delete_batch == 0)
+                    throw std::invalid_argument("--prefix-delete-batch must be at least 1");
+            }
+            else if (a == "--storage")
+                cfg.storage = text(i);
+            else if (a == "--lsm-dir")
+                cfg.lsm_dir = text(i);
+            else if (a == "--lsm-sync")
+                cfg.lsm.sync = true;
+            else if (a == "--lsm-threads")
+                cfg.lsm.background_threads = int(number(i, INT_MAX));
+            else if (a == "--lsm-memtable-mb")
+                cfg.lsm.memtable_bytes = number(i, SIZE_MAX >> 20) << 20;
+            else if (a == "--blob-dir")
+                cfg.blob_dir = text(i);
+            else if (a == "--blob-threshold")
+                cfg.blob_threshold = number(i, SIZE_MAX);
+            else if (a == "--pool-min")
+                cfg.pool_min = number(i, SIZE_MAX);
+            else if (a == "--pool-max")
+                cfg.pool_max = number(i, SIZE_MAX);
+            else if (a == "--pool-target-wait-us")
+                cfg.pool_target_wait_us = int(number(i, INT_MAX));
+            else if (a == "--hot-responses")
+                cfg.hot_responses = number(i, SIZE_MAX);
+            else if (a == "--hot-min-hits")
+                cfg.hot_min_hits = uint32_t(number(i, UINT32_MAX));
+            else if (a == "--hot-value-max")
+                cfg.hot_value_max = number(i, SIZE_MAX);
+            else if (a == "--hot-max-age-ms")
+                cfg.hot_max_age_ms = int(number(i, INT_MAX));
+            else if (a == "--inflight-mb")
+                cfg.inflight_bytes = number(i, SIZE_MAX >> 20) << 20;
+            else if (a == "--inflight-wait-ms")
+                cfg.inflight_wait_ms = int(number(i, INT_MAX));
+            else if (a == "--header-timeout-ms")
+                cfg.clients.header = std::chrono::milliseconds(int(number(i, INT_MAX)));
+            else if (a == "--body-timeout-ms")
+                cfg.clients.body = std::chrono::milliseconds(int(number(i, INT_MAX)));
+            else if (a == "--min-body-rate")
+                cfg.clients.min_body_rate = number(i, SIZE_MAX);
+            else if (a == "--idle-timeout-ms")
+                cfg.clients.idle = std::chrono::milliseconds(int(number(i, INT_MAX)));
+            else if (a == "--max-idle-conns")
+                cfg.clients.max_idle = number(i, SIZE_MAX);
+            else if (a == "--keep-alive-max")
+            {
+                cfg.keep_alive_max = number(i, SIZE_MAX);
+                if (cfg.keep_alive_max == 0)
+                    throw std::invalid_argument("--keep-alive-max must be at least 1");
+            }
+            else if (a == "--trim-after-mb")
+                cfg.trim_after_bytes = number(i, SIZE_MAX >> 20) << 20;
+            else if (a == "--stats-stream-max")
+                cfg.stats_stream_max = number(i, SIZE_MAX);
+            else if (a == "--stats-stream-ms")
+            {
+                cfg.stats_stream_ms = int(number(i, INT_MAX));
+                if (cfg.stats_stream_ms < 100)
+                {
+                    std::cerr << "--stats-stream-ms must be at least 100" << std::endl;
+                    return 1;
+                }
+            }
+            else if (a == "--socket-profile")
+            {
+                std::string name = text(i);
+                if (!SocketProfile::named(name, cfg.socket))
+                {
+                    std::cerr << "Unknown socket profile " << name << " (default, low-latency, high-throughput)" << std::endl;
+                    return 1;
+                }
+            }
+            else if (a == "--shm")
+                cfg.shm_name = text(i);
+            else if (a == "--shm-buckets")
+                cfg.shm_buckets = uint32_t(number(i, UINT32_MAX));
+            else if (a == "--shm-value-max")
+                cfg.shm_value_max = uint32_t(number(i, UINT32_MAX));
+            else if (a == "--shm-max-age-ms")
+                cfg.shm_max_age_ms = uint32_t(number(i, UINT32_MAX));
+            else if (a == "--shm-mode")
+                cfg.shm_mode = uint32_t(number(i, 0777, 8));
+            else if (a == "--coalesce-writes")
+                cfg.coalesce_writes = true;
+            else if (a == "--int-prefix")
+            {
+                std::string p = text(i);
+                if (std::find(cfg.int_prefixes.begin(), cfg.int_prefixes.end(), p) != cfg.int_prefixes.end())
+                    throw std::invalid_argument("--int-prefix " + p + " given twice");
+                if (cfg.int_prefixes.size() >= IntKeyCodec::MAX_PREFIXES)
+                    throw std::invalid_argument("--int-prefix accepts at most " + std::to_string(IntKeyCodec::MAX_PREFIXES) + " prefixes");
+                cfg.int_prefixes.push_back(p);
+            }
+            else if (a == "--bench-keys")
+            {
+                run_key_benchmark(number(i, SIZE_MAX));
+                return 0;
+            }
+            else if (a == "--bench-copies")
+            {
+#ifdef KV_BENCH_ALLOC
+                run_copy_benchmark(number(i, SIZE_MAX));
+                return 0;
+#else
+                std::cerr << "--bench-copies needs a build with -DKV_BENCH_ALLOC" << std::endl;
+                return 1;
+#endif
+            }
+            else if (a == "--self-test")
+                return run_self_test();
+            else if (a == "--bench-policies")
+            {
+                run_policy_benchmark(number(i, SIZE_MAX));
+                return 0;
+            }
+            else
+                throw std::invalid_argument("unknown option " + a);
+        }
+    }
+    catch (const std::invalid_argument &e)
+    {
+        std::cerr << e.what() << "\n\n"
+                  << "Usage: " << argv[0] << " [options]\n"
+                  << USAGE;
+        return 1;
+    }
+
+    // Initialize DB + Cache
+    std::unique_ptr<Storage> storage;
+    if (cfg.storage == "lsm")
+        storage.reset(new LsmStorage(cfg.lsm_dir, cfg.lsm));
+    else
+        storage.reset(new Database("dbname=kvdb user=kvuser password=kvpass host=127.0.0.1 connect_timeout=2"));
+    Storage &db = *storage;
+    LRUCache cache(cfg.cache_entries, cfg.cache_bytes, cfg.eviction, cfg.cache_index);
+
+    for (auto &p : cfg.prefixes)
+        cache.register_prefix(p);
+
+    IntKeyCodec intkeys;
+    for (auto &p : cfg.int_prefixes)
+        intkeys.add(p, db.registerIntPrefix(p));
+    IntLRUCache intcache(intkeys.empty() ? 1 : cfg.cache_entries);
+
+    std::unique_ptr<MissBatcher> batcher;
+    if (cfg.batch_window_us > 0)
+        batcher.reset(new MissBatcher(db, std::chrono::microseconds(cfg.batch_window_us), cfg.batch_max, cfg.batch_flushers));
+
+    std::unique_ptr<Refresher> refresher;
+    if (cfg.refresh_age_ms > 0)
+    {
+        cache.set_refresh_ahead(std::chrono::milliseconds(cfg.refresh_age_ms), cfg.refresh_min_hits);
+        refresher.reset(new Refresher(db, cache, 4096));
+    }
+
+    std::unique_ptr<ShmPublisher> shm;
+    if (!cfg.shm_name.empty())
+    {
+        shm.reset(new ShmPublisher);
+        if (!shm->open(cfg.shm_name, cfg.shm_buckets, 128, cfg.shm_value_max, cfg.shm_max_age_ms, cfg.shm_mode))
+        {
+            std::cerr << "Failed to create shared memory " << cfg.shm_name << std::endl;
+            return 1;
+        }
+        cache.set_on_evict([&](const std::string &key)
+                           { shm->evicted(key); });
+        if (!intkeys.empty())
+            intcache.set_on_evict([&](uint64_t packed)
+                                  { shm->evicted(intkeys.key(packed)); });
+    }
+
+    // What Keep-Alive advertises: --idle-timeout-ms rounded up to seconds,
+    // or httplib's own timeout when that is off (see wait_request)
+    int keep_alive_sec = cfg.clients.idle.count() > 0 ? int((cfg.clients.idle.count() + 999) / 1000)
+                                                      : CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND;
+
+    std::unique_ptr<HotResponses> hot;
+    if (cfg.hot_responses > 0)
+        hot.reset(new HotResponses(cfg.hot_responses, cfg.hot_min_hits, cfg.hot_value_max,
+                                   std::chrono::milliseconds(cfg.hot_max_age_ms),
+                                   "timeout=" + std::to_string(keep_alive_sec) + ", max=" + std::to_string(cfg.keep_alive_max)));
+
+    // Everything that mirrors a cached string value goes with it
+    auto drop_copies = [&](const std::string &key)
+    {
+        if (shm)
+            shm->erase(key);
+        if (hot)
+            hot->erase(key);
+    };
+    auto drop_prefix_copies = [&](const std::string &prefix)
+    {
+        if (shm)
+            shm->erase_prefix(prefix);
+        if (hot)
+            hot->erase_prefix(prefix);
+    };
+
+    // Integer keys under a prefix live in intcache, outside the string
+    // cache's prefix generations. Returns entries dropped.
+    auto drop_int_prefix = [&](const std::vector<IntKeyCodec::Match> &matches)
+    {
+        size_t n = 0;
+        for (auto &m : matches)
+            n += intcache.remove_if([&](uint64_t packed)
+                                    { return IntKeyCodec::matches(packed, m); });
+        return n;
+    };
+    if (refresher)
+        refresher->on_applied = drop_copies;
+
+    std::unique_ptr<WriteCoalescer> coalescer;
+    if (cfg.coalesce_writes)
+        coalescer.reset(new WriteCoalescer);
+
+    std::unique_ptr<BlobStore> blobs;
+    if (!cfg.blob_dir.empty())
+        blobs.reset(new BlobStore(cfg.blob_dir, cfg.blob_threshold));
+
+    std::unique_ptr<AdaptivePool> pool;
+    if (cfg.pool_max > 0)
+        pool.reset(new AdaptivePool(cfg.pool_min, cfg.pool_max, std::chrono::microseconds(cfg.pool_target_wait_us)));
+
+    std::unique_ptr<BodyBudget> budget;
+    if (cfg.inflight_bytes > 0)
+        budget.reset(new BodyBudget(cfg.inflight_bytes, std::chrono::milliseconds(cfg.inflight_wait_ms)));
+
+    ClientGuard guard(cfg.clients);
+    RollingStats rolling;
+    ProcessMetrics procs;
+    MemoryManager memory(cfg.trim_after_bytes, [&]
+                         { return cache.value_bytes() + (hot ? hot->memory_bytes() : 0); });
+
+    // PUT and PATCH write a key under its stripe, so a PATCH's
+    // read-modify-write can't interleave with another write to the key
+    const size_t WRITE_STRIPES = 64;
+    std::mutex write_locks[WRITE_STRIPES];
+    auto write_lock = [&](const std::string &key) -> std::mutex &
+    {
+        return write_locks[std::hash<std::string>()(key) % WRITE_STRIPES];
+    };
+
+    // Ranged GET that missed the cache: fetch only the requested bytes
+    // rather than pulling a large value into the cache for a slice
+    auto reply_range_from_db = [&](const std::string &key, Response &res)
+    {
+        const size_t head_bytes = 128; // covers a whole blob reference
+        std::string head, hash;
+        size_t total, size;
+        if (!db.getRange(key, 0, head_bytes, head, total)) {
+            res.status = 404;
+            res.set_content("Not found", "text/plain");
+            return;
+        }
+        if (head.size() == total) {
+            if (blobs && BlobStore::parse_ref(head, hash, size))
+                blobs->serve(res, "", hash, size);
+            else
+                res.set_content(std::move(head), "application/octet-stream");
+            return;
+        }
+
+        auto first = std::make_shared<std::string>(std::move(head));
+        res.set_content_provider(total, "application/octet-stream",
+                                 [&db, key, first](size_t offset, size_t length, DataSink &sink)
+                                 {
+                                     if (offset + length <= first->size())
+                                         return sink.write(first->data() + offset, length);
+                                     try {
+                                         std::string part;
+                                         size_t now;
+                                         // A value that shrank underneath ends the response early
+                                         return db.getRange(key, offset, length, part, now) && part.size() == length &&
+                                                sink.write(part.data(), part.size());
+                                     } catch (const std::exception &) {
+                                         return false;
+                                     }
+                                 });
+    };
+
+    // Everything /stats reports, as key=value lines
+    std::unique_ptr<StatsStream> stream;
+    auto stats_body = [&]
+    {
+        uint64_t h = cache_hits.load();
+        uint64_t m = cache_misses.load();
+        uint64_t total = h + m;
+        double hit_rate = (total > 0) ? (double(h) * 100.0 / total) : 0.0;
+
+        std::string body =
+            "cache_hits=" + std::to_string(h) + "\n" +
+            "cache_misses=" + std::to_string(m) + "\n" +
+            "hit_rate=" + std::to_string(hit_rate) + "%\n";
+        body += rolling.stats();
+        body += cache.stats();
+        body += db.stats();
+        if (!intkeys.empty())
+            body += "intcache_entries=" + std::to_string(intcache.size()) + "\n";
+        if (batcher)
+            body += batcher->stats();
+        if (refresher)
+            body += refresher->stats();
+        if (shm)
+            body += shm->stats();
+        if (hot)
+            body += hot->stats();
+        if (coalescer)
+            body += coalescer->stats();
+        if (blobs)
+            body += blobs->stats();
+        if (pool)
+            body += pool->stats();
+        if (budget)
+            body += budget->stats();
+        body += guard.stats();
+        body += cfg.socket.stats();
+        body += stream->stats();
+        body += procs.stats();
+        body += memory.stats();
+        return body;
+    };
+    stream.reset(new StatsStream(std::chrono::milliseconds(cfg.stats_stream_ms), cfg.stats_stream_max, stats_body));
+
+    // Routes are installed on every listener (TCP and, optionally, UDS)
+    auto install_routes = [&](GuardedServer &svr)
+    {
+        // Prebuilt hot responses carry the same Keep-Alive values
+        svr.set_keep_alive_timeout(keep_alive_sec);
+        svr.set_keep_alive_max_count(cfg.keep_alive_max);
+        svr.new_task_queue = [&]
+        {
+            TaskQueue *q = pool ? pool->new_queue() : new ThreadPool(CPPHTTPLIB_THREAD_POOL_COUNT);
+            return new TimedQueue(q);
+        };
+        // Runs once the headers are parsed, before httplib reads the body.
+        // Rejections answer before the body is read, so they also end the
+        // connection (GuardedServer::close_after_response); otherwise the
+        // unread body would be parsed as the next request.
+        svr.set_pre_routing_handler([&](const Request &req, Response &res)
+                                    {
+            GuardedServer::headers_read();
+            request_memory.hold(req.get_header_value_u64("Content-Length"));
+            if (!budget)
+                return Server::HandlerResponse::Unhandled;
+            if (detail::is_chunked_transfer_encoding(req.headers)) {
+                GuardedServer::close_after_response();
+                res.status = 411;
+                res.set_content("Chunked bodies need Content-Length while a body budget is set", "text/plain");
+                return Server::HandlerResponse::Handled;
+            }
+            switch (budget->acquire(req.get_header_value_u64("Content-Length"))) {
+            case BodyBudget::Result::Ok:
+                return Server::HandlerResponse::Unhandled;
+            case BodyBudget::Result::TooLarge:
+                res.status = 413;
+                res.set_content("Body larger than the in-flight budget", "text/plain");
+                break;
+            case BodyBudget::Result::Busy:
+                res.status = 503;
+                res.set_header("Retry-After", "1");
+                res.set_content("Too many bytes in flight", "text/plain");
+                break;
+            }
+            GuardedServer::close_after_response();
+            return Server::HandlerResponse::Handled; });
+        // After the response is written (or the request failed), on the
+        // same thread
+        svr.on_request_done = [&](int status)
+        {
+            if (status)
+                rolling.request(status, RequestClock::current().elapsed());
+            request_memory.release();
+            if (budget)
+                budget->release();
+        };
+        if (hot)
+            svr.set_header_writer([&](Stream &strm, Headers &headers)
+                                  {
+                HotResponses::Body body;
+                ssize_t n = hot->write_headers(strm, headers, body);
+                if (n >= 0 && body.size && !GuardedServer::send_after_headers(std::move(body.owner), body.data, body.size))
+                    n += strm.write(body.data, body.size);
+                return n; });
+
+        // DB failures surface as exceptions from the handlers below. Cache
+        // hits never reach the DB, so they keep working while it is down.
+        // Driver messages can carry SQL and connection details, so they go
+        // to the log and clients get a fixed message.
+        svr.set_exception_handler([](const Request &req, Response &res, std::exception_ptr ep)
+                                  {
+            try {
+                std::rethrow_exception(ep);
+            } catch (const DbUnavailable &e) {
+                res.status = 503;
+                res.set_header("Retry-After", "1");
+                res.set_content(e.what(), "text/plain");
+            } catch (const InvalidValue &e) {
+                res.status = 400;
+                res.set_content(e.what(), "text/plain");
+            } catch (const std::exception &e) {
+                std::cerr << req.method << " " << req.path << ": " << e.what() << std::endl;
+                res.status = 500;
+                res.set_content("Internal server error", "text/plain");
+            } catch (...) {
+                std::cerr << req.method << " " << req.path << ": unknown exception" << std::endl;
+                res.status = 500;
+                res.set_content("Internal server error", "text/plain");
+            } });
+
+        // PUT /kv/key
+        // The body is read by the handler itself (see read_body)
+        svr.Put(R"(^/kv/([^/]+)$)", [&](const Request &req, Response &res, const ContentReader &content_reader)
+                {
+                    ServerTiming timing(res);
+                    std::string key = req.matches[1];
+                    if (req.is_multipart_form_data()) {
+                        res.status = 415;
+                        res.set_content("Send the raw value, not a form", "text/plain");
+                        return;
+                    }
+                    SharedValue value = read_body(req, content_reader);
+                    if (!value) {
+                        res.status = 400;
+                        res.set_content("Incomplete body", "text/plain");
+                        return;
+                    }
+                    if (BlobStore::reserved(*value)) {
+                        res.status = 400;
+                        res.set_content("Values may not start with the blob reference marker", "text/plain");
+                        return;
+                    }
+
+                    uint64_t packed, id;
+                    int ns;
+                    std::function<void(const SharedValue &)> write;
+                    if (intkeys.parse(key, packed, ns, id)) {
+                        write = [&](const SharedValue &v)
+                        {
+                            std::lock_guard<std::mutex> lock(write_lock(key));
+                            db.putInt(ns, id, *v);
+                            intcache.put(packed, *v);
+                        };
+                    } else {
+                        write = [&](const SharedValue &v)
+                        {
+                            std::lock_guard<std::mutex> lock(write_lock(key));
+                            if (blobs && blobs->wants(*v)) {
+                                std::string ref = blobs->put(*v);
+                                db.put(key, ref);
+                                cache.put(key, ref);
+                                return;
+                            }
+                            db.put(key, *v);
+                            cache.put(key, v);
+                        };
+                    }
+
+                    timing.db([&]
+                              {
+                        if (coalescer)
+                            coalescer->put(key, std::move(value), write);
+                        else
+                            write(value); });
+                    drop_copies(key);
+
+                    res.set_content("PUT OK", "text/plain");
+                    // std::cout << "PUT /kv/" << key << " = " << value << std::endl;
+                });
+
+        // GET /kv/key
+        svr.Get(R"(^/kv/(.+)$)", [&](const Request &req, Response &res)
+                {
+            ServerTiming timing(res);
+            std::string key = req.matches[1];
+            std::string value;
+
+            uint64_t packed, id;
+            int ns;
+            if (intkeys.parse(key, packed, ns, id)) {
+                if (timing.cache([&]
+                                 { return intcache.get(packed, value); })) {
+                    cache_hits++;
+                    rolling.hit();
+                    if (shm)
+                        shm->on_hit(key, value, [&](std::string &v)
+                                    { return intcache.peek(packed, v); });
+                    reply_value(req, res, "CACHE HIT: ", std::make_shared<const std::string>(std::move(value)));
+                    return;
+                }
+                cache_misses++;
+                rolling.miss();
+                if (timing.db([&]
+                              { return db.getInt(ns, id, value); })) {
+                    intcache.put(packed, value);
+                    reply_value(req, res, "DB HIT: ", std::make_shared<const std::string>(std::move(value)));
+                    return;
+                }
+                res.status = 404;
+                res.set_content("Not found", "text/plain");
+                return;
+            }
+
+            bool plain = req.ranges.empty() && req.method != "HEAD";
+            if (hot && plain && timing.cache([&]
+                                             { return hot->serve(key, res); })) {
+                cache_hits++;
+                rolling.hit();
+                return;
+            }
+            uint64_t hotEpoch = hot ? hot->epoch() : 0;
+
+            // Check cache
+            uint64_t refreshVersion = 0;
+            std::string blobHash;
+            size_t blobSize;
+            SharedValue shared;
+            if (timing.cache([&]
+                             { return cache.get(key, shared, refresher ? &refreshVersion : nullptr); })) {
+                cache_hits++;
+                rolling.hit();
+                if (refreshVersion)
+                    refresher->schedule(key, refreshVersion);
+                if (blobs && BlobStore::parse_ref(*shared, blobHash, blobSize)) {
+                    blobs->serve(res, req.ranges.empty() ? "CACHE HIT: " : "", blobHash, blobSize);
+                    return;
+                }
+                if (shm)
+                    shm->on_hit(key, *shared, [&](std::string &v)
+                                { return cache.peek(key, v); });
+                if (hot && plain)
+                    hot->on_hit(key, *shared, hotEpoch);
+                reply_value(req, res, "CACHE HIT: ", shared);
+                return;
+            }
+
+            cache_misses++;
+
+            rolling.miss();
+            if (!req.ranges.empty()) {
+                timing.db([&]
+                          { reply_range_from_db(key, res); });
+                return;
+            }
+            // Fallback DB; the refill cost GDSF weighs is the query alone,
+            // not the time spent waiting for a batch to fill
+            auto t0 = std::chrono::steady_clock::now();
+            double fetch_ms = 0;
+            bool found = timing.db([&]
+                                   { return batcher ? batcher->get(key, value, &fetch_ms) : db.get(key, value); });
+            if (!batcher)
+                fetch_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            if (found) {
+                shared = std::make_shared<const std::string>(std::move(value));
+                cache.put(key, shared, fetch_ms);
+                if (blobs && BlobStore::parse_ref(*shared, blobHash, blobSize)) {
+                    blobs->serve(res, "DB HIT: ", blobHash, blobSize);
+                    return;
+                }
+                reply_value(req, res, "DB HIT: ", shared);
+                return;
+            }
+
+            res.status = 404;
+            res.set_content("Not found", "text/plain");
+            std::cout << "GET /kv/" << key << std::endl; });
+
+        // PATCH /kv/key  -> overwrite part of a value; the body holds the new
+        // bytes and "Content-Range: bytes <first>-<last>/*" says where they
+        // go (first == current size appends)
+        svr.Patch(R"(^/kv/([^/]+)$)", [&](const Request &req, Response &res)
+                  {
+            ServerTiming timing(res);
+            std::string key = req.matches[1];
+            const std::string &data = req.body;
+
+            unsigned long long first, last;
+            int n = 0;
+            if (data.empty() ||
+                std::sscanf(req.get_header_value("Content-Range").c_str(), "bytes %llu-%llu/%n", &first, &last, &n) != 2 ||
+                n == 0 || last < first || last - first + 1 != data.size()) {
+                res.status = 400;
+                res.set_content("PATCH needs a body and Content-Range: bytes <first>-<last>/*", "text/plain");
+                return;
+            }
+            size_t offset = first;
+
+            // Patches are read-modify-write on some paths
+            std::lock_guard<std::mutex> lock(write_lock(key));
+
+            bool found;
+            bool reserved = false;
+            size_t total = 0;
+            uint64_t packed, id;
+            int ns;
+            std::string head, hash;
+            size_t size;
+            timing.db([&]
+                      {
+                if (intkeys.parse(key, packed, ns, id)) {
+                    std::string value;
+                    found = db.getInt(ns, id, value) && offset <= value.size();
+                    if (found) {
+                        value.replace(offset, data.size(), data);
+                        db.putInt(ns, id, value);
+                        total = value.size();
+                    }
+                    intcache.remove(packed);
+                } else if (blobs && db.getRange(key, 0, 128, head, total) && head.size() == total &&
+                           BlobStore::parse_ref(head, hash, size)) {
+                    // Blob files are immutable: the patched copy becomes a new blob
+                    found = offset <= size;
+                    if (found) {
+                        auto m = blobs->map(hash, size);
+                        std::string value(m->data, m->size);
+                        value.replace(offset, data.size(), data);
+                        reserved = BlobStore::reserved(value);
+                        if (!reserved)
+                            db.put(key, blobs->wants(value) ? blobs->put(value) : value);
+                        total = value.size();
+                    }
+                    cache.remove(key);
+                } else {
+                    // Same rule as PUT for the patched value's first bytes
+                    std::string start;
+                    size_t length;
+                    if (offset < BlobStore::REF_LEN && db.getRange(key, 0, BlobStore::REF_LEN, start, length) &&
+                        offset <= start.size()) {
+                        start.replace(offset, data.size(), data);
+                        reserved = BlobStore::reserved(start);
+                    }
+                    found = !reserved && db.patch(key, offset, data, total);
+                    // A value the patch grew past the threshold moves to the blob tier
+                    std::string value;
+                    if (found && blobs && total >= blobs->threshold() && db.get(key, value) && blobs->wants(value))
+                        db.put(key, blobs->put(value));
+                    cache.remove(key);
+                } });
+            drop_copies(key);
+
+            if (reserved) {
+                res.status = 400;
+                res.set_content("Values may not start with the blob reference marker", "text/plain");
+                return;
+            }
+
+            if (!found) {
+                res.status = 416;
+                res.set_content("Not found or offset past the end", "text/plain");
+                return;
+            }
+            res.set_content("PATCH OK size=" + std::to_string(total), "text/plain"); });
+
+        // DELETE /kv/key
+        svr.Delete(R"(^/kv/([^/]+)$)", [&](const Request &req, Response &res)
+                   {
+                       ServerTiming timing(res);
+                       std::string key = req.matches[1];
+
+                       uint64_t packed, id;
+                       int ns;
+                       if (intkeys.parse(key, packed, ns, id)) {
+                           timing.db([&]
+                                     { db.removeInt(ns, id); });
+                           intcache.remove(packed);
+                           if (shm)
+                               shm->erase(key);
+                           res.set_content("DELETE OK", "text/plain");
+                           return;
+                       }
+
+                       timing.db([&]
+                                 { db.remove(key); });
+                       cache.remove(key);
+                       drop_copies(key);
+
+                       res.set_content("DELETE OK", "text/plain");
+                       std::cout << "DELETE /kv/" << key << std::endl; });
+
+        // GET /cache/prefix/<prefix>  -> dump cached keys under prefix
+        svr.Get(R"(^/cache/prefix/(.*)$)", [&](const Request &req, Response &res)
+                {
+            std::vector<std::pair<std::string, std::string>> entries;
+            size_t limit = req.has_param("limit") ? std::stoul(req.get_param_value("limit")) : 0;
+            cache.dump_prefix(req.matches[1], entries, limit);
+
+            std::string body;
+            for (auto &kv : entries)
+                body += kv.first + "=" + kv.second + "\n";
+            res.set_content(body, "text/plain"); });
+
+        // DELETE /cache/prefix/<prefix>  -> invalidate cached keys under prefix
+        svr.Delete(R"(^/cache/prefix/(.*)$)", [&](const Request &req, Response &res)
+                   {
+            std::string prefix = req.matches[1];
+            size_t ints = drop_int_prefix(intkeys.under(prefix));
+            if (cache.bump_prefix(prefix)) {
+                drop_prefix_copies(prefix);
+                res.set_content("INVALIDATED generation", "text/plain");
+                return;
+            }
+            size_t n = cache.remove_prefix(prefix) + ints;
+            drop_prefix_copies(prefix);
+            res.set_content("INVALIDATED " + std::to_string(n), "text/plain"); });
+
+        // POST /prefix/<prefix>  -> register prefix for O(1) invalidation
+        svr.Post(R"(^/prefix/(.+)$)", [&](const Request &req, Response &res)
+                 {
+            uint64_t gen = cache.register_prefix(req.matches[1]);
+            res.set_content("REGISTERED gen=" + std::to_string(gen), "text/plain"); });
+
+        // DELETE /prefix/<prefix>  -> drop prefix from cache and DB
+        svr.Delete(R"(^/prefix/(.+)$)", [&](const Request &req, Response &res)
+                   {
+            std::string prefix = req.matches[1];
+            cache.register_prefix(prefix);
+
+            // Bump on both sides of the DB delete so a miss that reloaded a row
+            // while the delete was running can't leave it cached
+            // Integer keys get the same treatment by clearing intcache
+            std::vector<IntKeyCodec::Match> ints = intkeys.under(prefix);
+            cache.bump_prefix(prefix);
+            drop_int_prefix(ints);
+            uint64_t n = db.removePrefix(prefix, cfg.prefix_delete_batch);
+            for (auto &m : ints)
+                n += db.removeIntPrefix(m.db_ns, m.digits, cfg.prefix_delete_batch);
+            cache.bump_prefix(prefix);
+            drop_int_prefix(ints);
+            drop_prefix_copies(prefix);
+
+            res.set_content("DELETED " + std::to_string(n), "text/plain");
+            std::cout << "DELETE /prefix/" << prefix << " (" << n << " rows)" << std::endl; });
+
+        // GET /scan?start=&end=&limit=  -> stored string keys in [start, end), in order
+        // (limit defaults to 100; 0 = no limit)
+        svr.Get("/scan", [&](const Request &req, Response &res)
+                {
+            size_t limit = req.has_param("limit") ? std::stoul(req.get_param_value("limit")) : 100;
+            std::vector<std::pair<std::string, std::string>> rows;
+            db.scan(req.get_param_value("start"), req.get_param_value("end"), limit, rows);
+
+            std::string body;
+            for (auto &kv : rows)
+                body += kv.first + "=" + kv.second + "\n";
+            res.set_content(body, "text/plain"); });
+
+        // POST /blobs/gc  -> delete blob files no stored key references
+        svr.Post("/blobs/gc", [&](const Request &, Response &res)
+                 {
+            if (!blobs) {
+                res.status = 404;
+                res.set_content("Blob tier disabled", "text/plain");
+                return;
+            }
+            std::set<std::string> live;
+            std::string start;
+            bool after = false;
+            const size_t batch = 1000;
+            while (true) {
+                std::vector<std::pair<std::string, std::string>> rows;
+                db.scan(start, "", batch, rows, after);
+                std::string hash;
+                size_t size;
+                for (auto &kv : rows)
+                    if (BlobStore::parse_ref(kv.second, hash, size))
+                        live.insert(hash);
+                if (rows.size() < batch)
+                    break;
+                start = rows.back().first;
+                after = true;
+            }
+            size_t n = blobs->gc(live, std::chrono::minutes(10));
+            res.set_content("REMOVED " + std::to_string(n), "text/plain"); });
+
+        // GET /memory  -> bytes per subsystem and allocator statistics. Hot
+        // responses are second copies of cached values (up to --hot-value-max
+        // each), counted separately from mem_cache_values_bytes.
+        svr.Get("/memory", [&](const Request &, Response &res)
+                {
+            size_t values = cache.value_bytes(), index = cache.index_bytes();
+            size_t ints = intkeys.empty() ? 0 : intcache.memory_bytes();
+            size_t hot_bytes = hot ? hot->memory_bytes() : 0;
+            int64_t requests = request_memory.bytes.load(), results = db_result_memory.bytes.load();
+            size_t accounted = values + index + ints + hot_bytes + size_t(std::max<int64_t>(0, requests + results));
+
+            std::string body =
+                "mem_cache_values_bytes=" + std::to_string(values) + "\n" +
+                "mem_cache_index_bytes=" + std::to_string(index) + "\n" +
+                "mem_intcache_bytes=" + std::to_string(ints) + "\n" +
+                "mem_hot_responses_bytes=" + std::to_string(hot_bytes) + "\n" +
+                "mem_hot_responses_limit_bytes=" + std::to_string(hot ? hot->memory_limit() : 0) + "\n" +
+                "mem_accounted_bytes=" + std::to_string(accounted) + "\n" +
+                "proc_rss_bytes=" + std::to_string(MemoryManager::resident_bytes()) + "\n";
+            body += memory.stats();
+            body += memory.allocator_stats();
+            res.set_content(body, "text/plain"); });
+
+        // GET /memory/allocator  -> malloc_info XML (jemalloc: its text stats)
+        svr.Get("/memory/allocator", [&](const Request &, Response &res)
+                { res.set_content(MemoryManager::allocator_dump(),
+                                  MemoryManager::jemalloc() ? "text/plain" : "application/xml"); });
+
+        // POST /memory/trim  -> return freed heap to the OS
+        svr.Post("/memory/trim", [&](const Request &, Response &res)
+                 {
+            MemoryManager::Trim t = memory.trim();
+            res.set_content("TRIMMED rss_before=" + std::to_string(t.rss_before) +
+                                " rss_after=" + std::to_string(t.rss_after) +
+                                " ms=" + std::to_string(t.ms),
+                            "text/plain"); });
+
+        // GET /stats  -> show cache stats
+        svr.Get("/stats", [&](const Request &, Response &res)
+                { res.set_content(stats_body(), "text/plain"); });
+
+        // GET /stats/stream  -> server-sent events with /stats deltas
+        svr.Get("/stats/stream", [&](const Request &, Response &res)
+                {
+            if (!stream->subscribe(res)) {
+                res.status = 503;
+                res.set_header("Retry-After", "5");
+                res.set_content("Too many stats streams", "text/plain");
+            } });
+    };
+
+    GuardedServer svr(guard, &cfg.socket);
+    install_routes(svr);
+
+    // Co-located clients can skip the TCP stack entirely
+    std::unique_ptr<GuardedServer> uds;
+    std::thread uds_thread;
+    if (!cfg.unix_socket.empty())
+    {
+        uds.reset(new GuardedServer(guard));
+        uds->set_address_family(AF_UNIX);
+        install_routes(*uds);
+        ::unlink(cfg.unix_socket.c_str()); // stale socket from a previous run
+        uds_thread = std::thread([&]
+                                 {
+            label_thread("acceptor");
+            // The port is ignored for AF_UNIX, but 0 would make httplib
+            // look up an ephemeral TCP port and fail
+            if (!uds->listen(cfg.unix_socket, 1))
+                std::cerr << "Failed to listen on unix socket " << cfg.unix_socket << std::endl; });
+        std::cout << "Server running on unix:" << cfg.unix_socket << "\n";
+    }
+
+    std::cout << "Server running on http://127.0.0.1:" << cfg.port << "\n";
+    if (!svr.serve("0.0.0.0", cfg.port))
+        std::cerr << "Failed to listen on port " << cfg.port << std::endl;
+
+    if (uds)
+    {
+        uds->stop();
+        uds_thread.join();
+    }
+    if (pool)
+        pool->shutdown();
 }
\ No newline at end of file